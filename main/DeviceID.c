@@ -18,80 +18,138 @@
 // License.    #include "freertos/FreeRTOS.h"
 
 
-#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#include "sdkconfig.h"
+#define LOG_LOCAL_LEVEL CONFIG_OT_LOG_LEVEL_DEVID
 #include "DeviceID.h"
 #include "TrustPlatform.h"
+#include "DeviceRNG.h"
+#include "KeyPool.h"
+#include "PersoMetrics.h"
+#include "PersoLog.h"
 #include "esp_vfs.h"
 #include "esp_spiffs.h"
 
 
 #include "esp_heap_caps.h"
+#include "mbedtls/base64.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/platform_util.h"
+#include <stdio.h>
+#include <sys/param.h>
+#include "esp_timer.h"
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 
 static const char *TAG = "DeviceID";
 
 /***********      Global type definitio       ************/
 
-struct options
-{
-    int type;                     /* the type of key to generate          */
-    int rsa_keysize;              /* length of key in bits                */
-    char *subject_name;           /* subject name for certificate request */
-    char *subjectalt_name;        /* subject alternative name */
-    int format;                   /* the output format to use             */
-    mbedtls_md_type_t md_alg;     /* Hash algorithm used for signature.   */
-} gOpt;
-
+// the default DevID of DeviceID_open() ... DeviceID_close(); the lock is valid before the first open
+static devid_ctx_t gDevID = { .lock = portMUX_INITIALIZER_UNLOCKED };
 
+#ifdef CONFIG_OT_DEVID_CA_BUNDLE
+// trust anchor built into the firmware (CMakeLists.txt, target_add_binary_data ... TEXT)
+extern const unsigned char devid_ca_pem_start[] asm("_binary_devid_ca_pem_start");
+extern const unsigned char devid_ca_pem_end[]   asm("_binary_devid_ca_pem_end");
+#endif
 
-// global crypto Context var 
-mbedtls_pk_context pk;
-mbedtls_entropy_context gEntropy;
-mbedtls_ctr_drbg_context gCtr_drbg;
-mbedtls_mpi N,P,Q,D,E,DP,DQ,QP;
-mbedtls_x509write_csr req;
+static int _load_file(char* p_filename, unsigned char** pp_buf, uint16_t* p_len);
 
-bool gDevIDopen = false;
-bool gDevIDKeyGen = false;
+typedef struct
+{
+    devid_progress_cb_t p_cb;
+    void *p_arg;
+    devid_cancel_t *p_cancel;
+    devid_keygen_progress_t *p_progress;    // progress of the context or the private progress of a background keygen
+    portMUX_TYPE *p_lock;                   // guards *p_progress, read by other tasks
+    size_t prime_len;                       // byte length of one prime candidate
+    int64_t start_us;
+    int64_t last_yield_us;
+} keygen_hook_t;
 
 
 
 //
-//      DeviceID_open()
-//      inital the Device itself, prepair the crypt Context , fetches the default paramter the structure. 
+//      DeviceID_ctxOpen()
+//      inital a DevID context: TrustStore and DRBG (shared, once), the CSR write context 
+//      and the TrustStore file names of the identity. 
+//      @param  - [Output] p_ctx = the context
+//      @param  - [Input] p_id = identity name (max. DEVID_ID_MAX chars), NULL for the default DevID
 //      @return:    success: DEVID_OK
-//                  failure: Error
+//                  failure: DEVID_ERR_INIT
 //
-//int DeviceID_open(void)
-int DeviceID_open(void)
+int DeviceID_ctxOpen(devid_ctx_t* p_ctx, const char* p_id)
 {
- 
   int ret = DEVID_FAIL;
+
   ESP_LOGI(TAG,"init TrustStore Context.......");
-  if(TPinit() != TP_OK)
+  if (p_id != NULL && (p_id[0] == 0x00 || strlen(p_id) > DEVID_ID_MAX || strchr(p_id, '/') != NULL))
+  {
+      ESP_LOGE(TAG," failed\n  !  invalid identity name");
+      ret = DEVID_ERR_INIT;
+  }
+  else if(TPinit() != TP_OK)
+  {
+      ret = DEVID_ERR_INIT;
+  }
+  else if(DeviceRNG_init() != ESP_OK)
   {
       ret = DEVID_ERR_INIT;
   }
   else
   {
-    
-    ESP_LOGI(TAG,"init DevID Context.......");
-    mbedtls_ctr_drbg_init(&gCtr_drbg);
-    mbedtls_pk_init(&pk);
-    mbedtls_mpi_init(&N);mbedtls_mpi_init(&P);mbedtls_mpi_init(&Q);
-    mbedtls_mpi_init(&D);mbedtls_mpi_init(&E);mbedtls_mpi_init(&DP);
-    mbedtls_mpi_init(&DQ);mbedtls_mpi_init(&QP);
-    mbedtls_x509write_csr_init(&req);
-    gOpt.type = DEVID_TYPE;
-    gOpt.rsa_keysize = DEVID_RSA_KEYSIZE;
-    gOpt.format = DEVID_FORMAT;
-    gOpt.md_alg = DEVID_MD_ALG;
-    gOpt.subject_name = DEVID_SUBJECT_NAME;
-    gDevIDopen = true;
+    ESP_LOGI(TAG,"init DevID Context %s.......", p_id != NULL ? p_id : "(default)");
+    memset(p_ctx, 0x00, sizeof(devid_ctx_t));
+    portMUX_INITIALIZE(&p_ctx->lock);
+    mbedtls_x509write_csr_init(&p_ctx->req);
+    if (p_id == NULL)
+    {
+      strcpy(p_ctx->keyfile, DEVID_KEY_FILENAME);
+      strcpy(p_ctx->certfile, DEVID_CERT_FILENAME);
+      strcpy(p_ctx->digestfile, DEVID_DIGEST_FILENAME);
+    }
+    else
+    {
+      snprintf(p_ctx->keyfile, DEVID_NAME_SIZE, "%s.key", p_id);
+      snprintf(p_ctx->certfile, DEVID_NAME_SIZE, "%s.crt", p_id);
+      snprintf(p_ctx->digestfile, DEVID_NAME_SIZE, "%s.dig", p_id);
+    }
+    p_ctx->p_subject_name = DEVID_SUBJECT_NAME;
+    p_ctx->open = true;
     ret = DEVID_OK;
   }
   return ret;
 }
+
+//
+//      DeviceID_ctxClose()
+//      close a DevID context and free all resources
+//      @return:    success: DEVID_OK
+//                  failure: Error
+//
+int DeviceID_ctxClose(devid_ctx_t* p_ctx)
+{
+  if(p_ctx->open)
+  {
+    mbedtls_x509write_csr_free(&p_ctx->req);
+    p_ctx->open = false;
+  }
+  return DEVID_OK;
+}
+
+//
+//      DeviceID_open()
+//      inital the Device itself, prepair the crypt Context , fetches the default paramter the structure. 
+//      @return:    success: DEVID_OK
+//                  failure: Error
+//
+int DeviceID_open(void)
+{
+  return DeviceID_ctxOpen(&gDevID, NULL);
+}
+
 //
 //      DeviceID_close()
 //      close the Device ID conext and free all resources
@@ -99,140 +157,508 @@ int DeviceID_open(void)
 //                  failure: Error
 //
 int DeviceID_close(void)
+{
+  return DeviceID_ctxClose(&gDevID);
+}
+
+
+
+//
+//      _keygen_rng()
+//      RNG callback handed to mbedtls_rsa_gen_key(). Every draw of prime size starts a 
+//      new candidate (or Miller-Rabin witness), so this is where the progress is counted, 
+//      the task yields so the idle task can feed the watchdog and the cancel token is checked.
+//
+static int _keygen_rng(void* p_rng, unsigned char* p_output, size_t len)
+{
+  keygen_hook_t *p_hook = (keygen_hook_t *) p_rng;
+  int64_t now = esp_timer_get_time();
+
+  if (p_hook->p_cancel != NULL && p_hook->p_cancel->cancel)
+    return MBEDTLS_ERR_RSA_RNG_FAILED;
+
+  taskENTER_CRITICAL(p_hook->p_lock);
+  p_hook->p_progress->draws++;
+  if (len == p_hook->prime_len)
+    p_hook->p_progress->candidates++;
+  p_hook->p_progress->elapsed_us = now - p_hook->start_us;
+  taskEXIT_CRITICAL(p_hook->p_lock);
+
+  if (len == p_hook->prime_len && p_hook->p_cb != NULL)
+    p_hook->p_cb(p_hook->p_progress, p_hook->p_arg);
+
+  if (now - p_hook->last_yield_us >= DEVID_KEYGEN_YIELD_MS * 1000LL)
+  {
+    vTaskDelay(DEVID_KEYGEN_YIELD_TICKS);
+    p_hook->last_yield_us = esp_timer_get_time();
+    taskENTER_CRITICAL(p_hook->p_lock);
+    p_hook->p_progress->yields++;
+    taskEXIT_CRITICAL(p_hook->p_lock);
+  }
+  return DeviceRNG_random(NULL, p_output, len);
+}
+
+//
+//      DeviceID_ctxGetKeygenProgress()
+//      copy the progress of the running or last key generation of a context, under the 
+//      spinlock of the context; the context must have been opened once (the default DevID 
+//      is valid from the start)
+//
+void DeviceID_ctxGetKeygenProgress(devid_ctx_t* p_ctx, devid_keygen_progress_t* p_progress)
+{
+  taskENTER_CRITICAL(&p_ctx->lock);
+  memcpy(p_progress, &p_ctx->progress, sizeof(devid_keygen_progress_t));
+  taskEXIT_CRITICAL(&p_ctx->lock);
+}
+
+//
+//      DeviceID_getKeygenProgress()
+//      copy the progress of the running or last key generation of the default DevID
+//
+void DeviceID_getKeygenProgress(devid_keygen_progress_t* p_progress)
+{
+  DeviceID_ctxGetKeygenProgress(&gDevID, p_progress);
+}
+
+//
+//      _progress_done()
+//      report a key that is ready without a key generation (key pool, resumed key)
+//
+static void _progress_done(devid_ctx_t* p_ctx)
+{
+  taskENTER_CRITICAL(&p_ctx->lock);
+  memset(&p_ctx->progress, 0x00, sizeof(devid_keygen_progress_t));
+  p_ctx->progress.done = true;
+  taskEXIT_CRITICAL(&p_ctx->lock);
+}
+
+//
+//      _gen_key_pem()
+//      generate a RSA key pair into p_pk and write it PEM encoded to p_buf
+//      @param  - [Input] p_pk = initialized pk context, will be set up as RSA key
+//      @param  - [Input] p_hook = progress / yield / cancel hook, start_us is set here
+//      @param  - [Output] p_buf / buflen = buffer for the PEM key 
+//
+//      @return:    success: DEVID_OK
+//                  failure: DEVID_ERR_KEYGEN, DEVID_ERR_CANCELLED
+//
+static int _gen_key_pem(mbedtls_pk_context* p_pk, keygen_hook_t* p_hook, unsigned char* p_buf, size_t buflen)
 {
   int ret = DEVID_FAIL;
+  devid_keygen_progress_t progress;
 
-  if(gDevIDKeyGen)
+  ESP_LOGI(TAG,"Generating the keypair  ...                 Watermark: %d bytes", uxTaskGetStackHighWaterMark(NULL));
+  // DevID parameters are used directly, the pool producer also runs without an open context
+  if ((ret = mbedtls_pk_setup(p_pk, mbedtls_pk_info_from_type(DEVID_TYPE))) != 0) 
   {
-    mbedtls_entropy_free(&gEntropy);
-    gDevIDKeyGen = false;
+    ESP_LOGE(TAG," failed\n  !  mbedtls_pk_setup returned -0x%04x", (unsigned int) -ret);
+    return DEVID_ERR_KEYGEN;
   }
-  if(gDevIDopen)
+  taskENTER_CRITICAL(p_hook->p_lock);
+  memset(p_hook->p_progress, 0x00, sizeof(devid_keygen_progress_t));
+  p_hook->p_progress->running = true;
+  taskEXIT_CRITICAL(p_hook->p_lock);
+  p_hook->prime_len = (DEVID_RSA_KEYSIZE / 2 + 7) / 8;
+  p_hook->start_us = p_hook->last_yield_us = esp_timer_get_time();
+  ret = mbedtls_rsa_gen_key(mbedtls_pk_rsa(*p_pk),_keygen_rng,p_hook,DEVID_RSA_KEYSIZE,DEVID_EXPONENT);
+  taskENTER_CRITICAL(p_hook->p_lock);
+  p_hook->p_progress->elapsed_us = esp_timer_get_time() - p_hook->start_us;
+  p_hook->p_progress->running = false;
+  progress = *p_hook->p_progress;
+  taskEXIT_CRITICAL(p_hook->p_lock);
+  if (ret == 0)
+    PersoMetrics_observe(PMETRIC_OP_KEYGEN, progress.elapsed_us);
+  ESP_LOGI(TAG,"Keygen finished after %lld ms, %" PRIu32 " candidates, %" PRIu32 " yields",
+           progress.elapsed_us / 1000, progress.candidates, progress.yields);
+  if (p_hook->p_cancel != NULL && p_hook->p_cancel->cancel)
   {
-    mbedtls_x509write_csr_free(&req);
-    mbedtls_pk_free(&pk);
-    mbedtls_ctr_drbg_free(&gCtr_drbg);
-    gDevIDopen = false;
+    ESP_LOGI(TAG,"Keygen cancelled");
+    ret = DEVID_ERR_CANCELLED;
+  }
+  else if (ret != 0)
+  {
+    ESP_LOGE(TAG," failed  !  mbedtls_rsa_gen_key returned -0x%04x", (unsigned int) -ret);
+    ret = DEVID_ERR_KEYGEN;
+  }
+  else if ((ret = mbedtls_pk_write_key_pem(p_pk, p_buf, buflen)) != 0) 
+  {
+    ESP_LOGE(TAG," failed  !  mbedtls_pk_write_key_pem returned -0x%04x", (unsigned int) -ret);
+    ret = DEVID_ERR_KEYGEN;
+  }
+  else
+  {
+    ret = DEVID_OK;
   }
-  
-  ret = DEVID_OK;
   return ret;
 }
 
-
-
 //
 //      DeviceID_genKey()
-//      seed the Random Number generator. 
-//      Generate Key Pair and store it to the TrustStore
-//      @param  - [Input] p_seed = the seed for the Random 
+//      Generate Key Pair and store it to the TrustStore, without progress reporting
 //
 //      @return:    success: DEVID_OK
 //                  failure: error Message
 //
-int DeviceID_genKey(char* p_seed)
+int DeviceID_genKey(void)
+{
+  return DeviceID_ctxGenKey(&gDevID, NULL, NULL, NULL);
+}
+
+//
+//      DeviceID_genKeyEx()
+//      DeviceID_ctxGenKey() for the default DevID
+//
+int DeviceID_genKeyEx(devid_progress_cb_t p_cb, void* p_arg, devid_cancel_t* p_cancel)
+{
+  return DeviceID_ctxGenKey(&gDevID, p_cb, p_arg, p_cancel);
+}
+
+//
+//      DeviceID_ctxGenKey()
+//      Generate Key Pair of the context and store it to the TrustStore
+//      A pre-generated key of the key pool is used if available, the pool refills in the background. 
+//      Otherwise the key is generated now: the random numbers are drawn from the shared DRBG 
+//      (DeviceRNG) which is already seeded at boot, and the generation yields at least 
+//      every DEVID_KEYGEN_YIELD_MS. 
+//      @param  - [Input] p_ctx = open DevID context
+//      @param  - [Input] p_cb = progress callback, may be NULL
+//      @param  - [Input] p_arg = argument passed to p_cb
+//      @param  - [Input] p_cancel = cancellation token, may be NULL
+//
+//      @return:    success: DEVID_OK
+//                  failure: error Message, DEVID_ERR_CANCELLED if cancelled
+//
+int DeviceID_ctxGenKey(devid_ctx_t* p_ctx, devid_progress_cb_t p_cb, void* p_arg, devid_cancel_t* p_cancel)
 {
   int ret = DEVID_FAIL;
-  char filename[] = DEVID_KEY_FILENAME;
+  mbedtls_pk_context pk;
+  keygen_hook_t hook = {
+    .p_cb = p_cb,
+    .p_arg = p_arg,
+    .p_cancel = p_cancel,
+    .p_progress = &p_ctx->progress,
+    .p_lock = &p_ctx->lock,
+  };
   
 
   
-  ESP_LOGI(TAG,"Seeding the random number generator...      Watermark: %d bytes", uxTaskGetStackHighWaterMark(NULL));
-  mbedtls_entropy_init(&gEntropy);
-  gDevIDKeyGen = true;
-  if ((ret = mbedtls_ctr_drbg_seed(&gCtr_drbg, mbedtls_entropy_func, &gEntropy,
-                                     (const unsigned char *) p_seed,
-                                     strlen(p_seed))) != 0) 
-  {
-       ESP_LOGE(TAG, " failed\n  !  mbedtls_ctr_drbg_seed returned %d", ret);
+  if (!p_ctx->open) 
+  {
+      ESP_LOGE(TAG, " failed\n  !  DevID context not open");
       ret = DEVID_ERR_KEYGEN;
   }
+  else if (KeyPool_pop(p_ctx->keyfile) == KEYPOOL_OK)
+  {
+    ESP_LOGI(TAG,"Keyfile %s taken from key pool .....  ", p_ctx->keyfile);  
+    _progress_done(p_ctx);
+    ret = DEVID_OK;
+  }
   else
   {
-     ESP_LOGI(TAG,"Generating the keypair  ...                 Watermark: %d bytes", uxTaskGetStackHighWaterMark(NULL));
-    if ((ret = mbedtls_pk_setup(&pk, mbedtls_pk_info_from_type((mbedtls_pk_type_t) gOpt.type))) != 0) 
+    unsigned char *output_buf = (unsigned char *)malloc(sizeof(unsigned char) * 16000);  
+    if (output_buf == NULL)
     {
-      ESP_LOGE(TAG," failed\n  !  mbedtls_pk_setup returned -0x%04x", (unsigned int) -ret);
-      ret = DEVID_ERR_KEYGEN;
+      ESP_LOGE(TAG, " failed\n  !  no memory for the key PEM");
+      return DEVID_ERR_KEYGEN;
     }
-    else
+    memset(output_buf,0x00,16000);
+    mbedtls_pk_init(&pk);
+    ret = _gen_key_pem(&pk, &hook, output_buf, 16000);
+    mbedtls_pk_free(&pk);
+    if (ret == DEVID_OK)
     {
-      ret = mbedtls_rsa_gen_key(mbedtls_pk_rsa(pk),mbedtls_ctr_drbg_random,&gCtr_drbg,gOpt.rsa_keysize,DEVID_EXPONENT);
-      if (ret != 0)
+      size_t len = 0;
+
+      len = strlen((char*)output_buf);
+      if(TPwrite(p_ctx->keyfile,output_buf,len) != TP_OK)
       {
-        ESP_LOGE(TAG," failed  !  mbedtls_rsa_gen_key returned -0x%04x", (unsigned int) -ret);
+        ESP_LOGI(TAG,"Error write file : ");  
         ret = DEVID_ERR_KEYGEN;
       }
       else
       {
-        unsigned char *output_buf = (unsigned char *)malloc(sizeof(unsigned char) * 16000);  
-        memset(output_buf,0x00,16000);
-        if ((ret = mbedtls_pk_write_key_pem(&pk, output_buf, 16000)) != 0) 
-        {
-          ESP_LOGE(TAG," failed  !  mbedtls_pk_write_key_pem returned -0x%04x", (unsigned int) -ret);
-          ret = DEVID_ERR_KEYGEN;
-        }
-        else
-        {
-          size_t len = 0;
-
-          len = strlen((char*)output_buf);
-          if(TPwrite(filename,output_buf,len) != TP_OK)
-          {
-            ESP_LOGI(TAG,"Error write file : ");  
-            ret = DEVID_ERR_KEYGEN;
-          }
-          else
-          {
-            ESP_LOGI(TAG,"Keyfile saved .....  ");  
-            ret = DEVID_OK;
-          }
-        }
-        free(output_buf);
+        ESP_LOGI(TAG,"Keyfile %s saved .....  ", p_ctx->keyfile);  
+        taskENTER_CRITICAL(&p_ctx->lock);
+        p_ctx->progress.done = true;
+        taskEXIT_CRITICAL(&p_ctx->lock);
+        ret = DEVID_OK;
       }
     }
+    // the buffer holds the private key in the clear
+    mbedtls_platform_zeroize(output_buf, 16000);
+    free(output_buf);
+  }
+  return ret;
+}
+
+//
+//      DeviceID_resumeKey()
+//      DeviceID_ctxResumeKey() for the default DevID
+//
+int DeviceID_resumeKey(void)
+{
+  return DeviceID_ctxResumeKey(&gDevID);
+}
+
+//
+//      DeviceID_ctxResumeKey()
+//      continue with the key of an interrupted personalisation instead of generating a new 
+//      one. The stored key is parsed once, so a torn TrustStore write is not taken for a key.
+//      @param  - [Input] p_ctx = open DevID context
+//
+//      @return:    success: DEVID_OK, the key is reported as ready
+//                  failure: DEVID_ERR_KEYGEN, no usable key stored
+//
+int DeviceID_ctxResumeKey(devid_ctx_t* p_ctx)
+{
+  int ret = DEVID_ERR_KEYGEN;
+  unsigned char *p_buf = NULL;
+  uint16_t buflen = 0;
+  mbedtls_pk_context tmp;
+
+  if (!p_ctx->open || TPexists(p_ctx->keyfile) != TP_OK || _load_file(p_ctx->keyfile, &p_buf, &buflen) != DEVID_OK)
+    return DEVID_ERR_KEYGEN;
+  mbedtls_pk_init(&tmp);
+  if ((ret = mbedtls_pk_parse_key(&tmp, p_buf, strlen((char*) p_buf) + 1, NULL, 0, DeviceRNG_random, NULL)) != 0)
+  {
+    ESP_LOGE(TAG," stored key not usable  !  mbedtls_pk_parse_key returned -0x%04x", (unsigned int) -ret);
+    ret = DEVID_ERR_KEYGEN;
   }
+  else
+  {
+    ESP_LOGI(TAG,"Keyfile %s of the previous run resumed", p_ctx->keyfile);
+    _progress_done(p_ctx);
+    ret = DEVID_OK;
+  }
+  mbedtls_pk_free(&tmp);
+  free(p_buf);
+  return ret;
+}
+
+//
+//      DeviceID_genKeyPEM()
+//      Generate a Key Pair with the DevID parameters into a buffer, without touching the 
+//      DevID context. Used by the background key pool producer. 
+//      @param  - [Output] p_buf = buffer for the PEM encoded private key
+//      @param  - [Input] buflen = size of p_buf 
+//      @param  - [Input] p_cancel = cancellation token, may be NULL
+//
+//      @return:    success: DEVID_OK
+//                  failure: error Message, DEVID_ERR_CANCELLED if cancelled
+//
+int DeviceID_genKeyPEM(unsigned char* p_buf, size_t buflen, devid_cancel_t* p_cancel)
+{
+  int ret = DEVID_FAIL;
+  mbedtls_pk_context key;
+  devid_keygen_progress_t progress;
+  portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+  keygen_hook_t hook = {
+    .p_cancel = p_cancel,
+    .p_progress = &progress,
+    .p_lock = &lock,
+  };
+
+  mbedtls_pk_init(&key);
+  memset(p_buf, 0x00, buflen);
+  ret = _gen_key_pem(&key, &hook, p_buf, buflen);
+  mbedtls_pk_free(&key);
   return ret;
 }
   
 //
-//      DeviceID_genCSR()
-//      generate the DevID CSR 
-//      Default value for Algorithm, key usage, are set in header file
+//      _printable()
+//      @return:    true if p_value only has characters of the ASN.1 PrintableString 
+//                  (X.680: A-Z a-z 0-9 space ' ( ) + , - . / : = ?)
+//
+static bool _printable(const char* p_value)
+{
+  for (; *p_value != 0x00; p_value++)
+  {
+    char c = *p_value;
+    if ((c < 'A' || c > 'Z') && (c < 'a' || c > 'z') && (c < '0' || c > '9') && strchr(" '()+,-./:=?", c) == NULL)
+      return false;
+  }
+  return true;
+}
+
+//
+//      _add_rdn()
+//      append one RDN to the subject list of the CSR. The value is stored as it is, 
+//      no string parsing or escaping takes place. 
+//      @param  - [Input] p_list = the named data list of the CSR subject
+//      @param  - [Input] p_oid / oid_len = the attribute type
+//      @param  - [Input] tag = the ASN.1 string type of the value
+//      @param  - [Input] p_value = NUL terminated value, NULL is skipped
+//      @return:    success: DEVID_OK
+//                  failure: DEVID_ERR_SUBJECT, also for a PrintableString value with 
+//                           other characters
+//
+static int _add_rdn(mbedtls_asn1_named_data** p_list, const char* p_oid, size_t oid_len, int tag, const char* p_value)
+{
+  mbedtls_asn1_named_data *p_cur;
+
+  if (p_value == NULL || p_value[0] == 0x00)
+    return DEVID_OK;
+  if (tag == MBEDTLS_ASN1_PRINTABLE_STRING && !_printable(p_value))
+  {
+    ESP_LOGE(TAG," failed  !  not a PrintableString: %s", p_value);
+    return DEVID_ERR_SUBJECT;
+  }
+  p_cur = mbedtls_asn1_store_named_data(p_list, p_oid, oid_len, (const unsigned char*) p_value, strlen(p_value));
+  if (p_cur == NULL)
+    return DEVID_ERR_SUBJECT;
+  p_cur->val.tag = tag;
+  return DEVID_OK;
+}
+
+//
+//      _set_subject()
+//      write the typed subject directly into the ASN.1 name list of the CSR.
+//      mbedtls_asn1_store_named_data() prepends and mbedtls writes the list backwards, 
+//      so the RDNs appear in the CSR in the order they are added here. 
+//      @param  - [Input] p_req = the CSR write context
+//      @param  - [Input] p_subject = the typed subject 
+//      @return:    success: DEVID_OK
+//                  failure: DEVID_ERR_SUBJECT
+//
+static int _set_subject(mbedtls_x509write_csr* p_req, const devid_subject_t* p_subject)
+{
+  int ret = DEVID_OK;
+  mbedtls_asn1_named_data **p_list = &p_req->MBEDTLS_PRIVATE(subject);
+
+  mbedtls_asn1_free_named_data_list(p_list);
+  if ((ret = _add_rdn(p_list, MBEDTLS_OID_AT_CN, MBEDTLS_OID_SIZE(MBEDTLS_OID_AT_CN), MBEDTLS_ASN1_UTF8_STRING, p_subject->p_cn)) != DEVID_OK ||
+      (ret = _add_rdn(p_list, MBEDTLS_OID_AT_ORGANIZATION, MBEDTLS_OID_SIZE(MBEDTLS_OID_AT_ORGANIZATION), MBEDTLS_ASN1_UTF8_STRING, p_subject->p_o)) != DEVID_OK ||
+      (ret = _add_rdn(p_list, MBEDTLS_OID_AT_ORG_UNIT, MBEDTLS_OID_SIZE(MBEDTLS_OID_AT_ORG_UNIT), MBEDTLS_ASN1_UTF8_STRING, p_subject->p_ou)) != DEVID_OK ||
+      (ret = _add_rdn(p_list, MBEDTLS_OID_AT_COUNTRY, MBEDTLS_OID_SIZE(MBEDTLS_OID_AT_COUNTRY), MBEDTLS_ASN1_PRINTABLE_STRING, p_subject->p_c)) != DEVID_OK ||
+      (ret = _add_rdn(p_list, MBEDTLS_OID_AT_SERIAL_NUMBER, MBEDTLS_OID_SIZE(MBEDTLS_OID_AT_SERIAL_NUMBER), MBEDTLS_ASN1_PRINTABLE_STRING, p_subject->p_sn)) != DEVID_OK)
+  {
+    ESP_LOGE(TAG," failed  !  could not store subject RDN");
+  }
+  return ret;
+}
+
+//
+//      _write_san()
+//      encode the GeneralNames SEQUENCE of the subjectAltName extension. 
+//      ASN.1 is written from the end of the buffer, so the entries are processed backwards.
+//      @param  - [Input] p_buf / buflen = the work buffer
+//      @param  - [Input] p_san / cnt = the SAN entries, IP lengths checked by _set_extensions()
+//      @param  - [Output] p_start = start of the encoded extension value within p_buf
+//      @return:    success: length of the encoded value
+//                  failure: negative mbedtls error 
+//
+static int _write_san(unsigned char* p_buf, size_t buflen, const devid_san_t* p_san, uint8_t cnt, unsigned char** p_start)
+{
+  int ret = 0;
+  size_t len = 0;
+  unsigned char *c = p_buf + buflen;
+
+  for (int i = cnt - 1; i >= 0; i--)
+  {
+    size_t entry = 0;
+    MBEDTLS_ASN1_CHK_ADD(entry, mbedtls_asn1_write_raw_buffer(&c, p_buf, p_san[i].p_value, p_san[i].len));
+    MBEDTLS_ASN1_CHK_ADD(entry, mbedtls_asn1_write_len(&c, p_buf, entry));
+    MBEDTLS_ASN1_CHK_ADD(entry, mbedtls_asn1_write_tag(&c, p_buf, MBEDTLS_ASN1_CONTEXT_SPECIFIC | p_san[i].type));
+    len += entry;
+  }
+  MBEDTLS_ASN1_CHK_ADD(len, mbedtls_asn1_write_len(&c, p_buf, len));
+  MBEDTLS_ASN1_CHK_ADD(len, mbedtls_asn1_write_tag(&c, p_buf, MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE));
+  *p_start = c;
+  return (int) len;
+}
+
+//
+//      _set_extensions()
+//      add subjectAltName and the custom extensions of the subject to the CSR 
+//      @param  - [Input] p_req = the CSR write context
+//      @param  - [Input] p_subject = the typed subject 
+//      @return:    success: DEVID_OK
+//                  failure: DEVID_ERR_SUBJECT
+//
+static int _set_extensions(mbedtls_x509write_csr* p_req, const devid_subject_t* p_subject)
+{
+  int ret = DEVID_OK;
+
+  if (p_subject->san_cnt > 0)
+  {
+    // worst case per entry: tag + 3 length bytes, plus the outer SEQUENCE header
+    size_t buflen = 6;
+    unsigned char *p_start = NULL;
+    for (int i = 0; i < p_subject->san_cnt; i++)
+    {
+      // iPAddress is the IPv4 or IPv6 address in network order, nothing else
+      if (p_subject->p_san[i].type == DEVID_SAN_IP && p_subject->p_san[i].len != 4 && p_subject->p_san[i].len != 16)
+      {
+        ESP_LOGE(TAG," failed  !  IP SAN of %u bytes", (unsigned int) p_subject->p_san[i].len);
+        return DEVID_ERR_SUBJECT;
+      }
+      buflen += p_subject->p_san[i].len + 4;
+    }
+
+    unsigned char *p_sanbuf = (unsigned char *)malloc(buflen);
+    if (p_sanbuf == NULL)
+      return DEVID_ERR_SUBJECT;
+    int len = _write_san(p_sanbuf, buflen, p_subject->p_san, p_subject->san_cnt, &p_start);
+    int err = len;
+    if (len >= 0)
+      err = mbedtls_x509write_csr_set_extension(p_req, MBEDTLS_OID_SUBJECT_ALT_NAME, MBEDTLS_OID_SIZE(MBEDTLS_OID_SUBJECT_ALT_NAME),
+                                                0, p_start, len);
+    if (err != 0)
+    {
+      ESP_LOGE(TAG," failed  !  could not write subjectAltName: -0x%04x", (unsigned int) -err);
+      ret = DEVID_ERR_SUBJECT;
+    }
+    free(p_sanbuf);
+  }
+  for (int i = 0; i < p_subject->ext_cnt && ret == DEVID_OK; i++)
+  {
+    const devid_ext_t *p_ext = &p_subject->p_ext[i];
+    if (mbedtls_x509write_csr_set_extension(p_req, p_ext->p_oid, p_ext->oid_len, p_ext->critical, p_ext->p_value, p_ext->len) != 0)
+    {
+      ESP_LOGE(TAG," failed  !  could not write extension %d", i);
+      ret = DEVID_ERR_SUBJECT;
+    }
+  }
+  return ret;
+}
+
+//
+//      DeviceID_ctxGenCSR()
+//      generate the CSR of a DevID context as PEM or DER (DER is moved to the start of p_csrbuf)
+//      @param  - [Input] p_ctx = open DevID context, its key is used
 //      @param  - [Input] p_csrbuf  = pointer to the buffer where the csr is stored
 //      @param  - [Input] csrbuflen = size of of the csrbuffer    
-//      @param  - [Input] p_subname = the subject name buffer string
-//      @param  - [Input] p_subaltname = the subject alternative name buffer
+//      @param  - [Input] p_subject = typed subject, SAN and extensions; NULL uses the default subject
+//      @param  - [Input] format = DEVID_FORMAT_PEM or DEVID_FORMAT_DER
+//      @param  - [Output] p_olen = length of the CSR, without the NUL of the PEM
 //      @return:    success: DEVID_OK
 //                  failure: error Message
 //
-
-
-int DeviceID_genCSR(unsigned char* p_csrbuf, uint16_t csrbuflen, char* p_subname, char* p_subaltname)
+int DeviceID_ctxGenCSR(devid_ctx_t* p_ctx, unsigned char* p_csrbuf, uint16_t csrbuflen, const devid_subject_t* p_subject, 
+                       int format, size_t* p_olen)
 {
   int ret = DEVID_FAIL;
-  char filename[] = DEVID_KEY_FILENAME;
+  mbedtls_x509write_csr *p_req = &p_ctx->req;
   mbedtls_pk_context tmp;
-  unsigned char *output_buf = (unsigned char *)malloc(sizeof(unsigned char) * 16000);  
 
+  if (!p_ctx->open)
+  {
+    ESP_LOGE(TAG, " failed\n  !  DevID context not open");
+    return DEVID_ERR_CSRGEN;
+  }
+  unsigned char *output_buf = (unsigned char *)malloc(sizeof(unsigned char) * 16000);  
   
-  ESP_LOGI(TAG,"generate CSR........                        Watermark: %d bytes", uxTaskGetStackHighWaterMark(NULL));
-  gOpt.type = DEVID_TYPE;
-  gOpt.rsa_keysize = DEVID_RSA_KEYSIZE;
-  gOpt.format = DEVID_FORMAT;
-  gOpt.md_alg = DEVID_MD_ALG;
-  //gOpt.subject_name = DEVID_SUBJECT_NAME;
-  gOpt.subject_name = p_subname;
-
-  gOpt.subjectalt_name = p_subaltname;
-  ESP_LOGI(TAG, "output_buf len: %d",sizeof(output_buf));
+  PLOG(TAG,"generate CSR........                        Watermark: %u bytes", uxTaskGetStackHighWaterMark(NULL));
   memset(output_buf,0x00,16000);
   uint16_t buflen = 16000;
 
-  if (TPread(filename,output_buf,&buflen) == TP_OK)
+  if (TPread(p_ctx->keyfile,output_buf,&buflen) == TP_OK)
   {
     mbedtls_pk_init(&tmp);   
-    ret = mbedtls_pk_parse_key(&tmp,output_buf,buflen+1,NULL,0,mbedtls_ctr_drbg_random, &gCtr_drbg);
+    int64_t start = esp_timer_get_time();
+    ret = mbedtls_pk_parse_key(&tmp,output_buf,buflen+1,NULL,0,DeviceRNG_random, NULL);
+    PMETRIC_SINCE(PMETRIC_OP_PARSE, start);
     if (ret !=0)
     {
        ESP_LOGI(TAG,"faild to parse keyfile: -0x%04x\n",(unsigned int) -ret);
@@ -240,20 +666,57 @@ int DeviceID_genCSR(unsigned char* p_csrbuf, uint16_t csrbuflen, char* p_subname
     }
     else
     {
-      ESP_LOGI(TAG,"Keyfile read ");             
+      PLOG(TAG,"Keyfile read ");             
       memset(output_buf,0x00,16000);
-      mbedtls_x509write_csr_set_md_alg( &req, MBEDTLS_MD_SHA256);
-      mbedtls_x509write_csr_set_key_usage( &req, MBEDTLS_X509_KU_DIGITAL_SIGNATURE );
-      ESP_LOGI(TAG,"Set sub name:   %s",gOpt.subject_name);
-      mbedtls_x509write_csr_set_subject_name(&req,gOpt.subject_name);
-      mbedtls_x509write_csr_set_key( &req, &tmp );
-      ESP_LOGI(TAG,"after mbedtls_x509write_csr_set_key...        Watermark: %d bytes", uxTaskGetStackHighWaterMark(NULL));
-      int mbedResult;
-      mbedResult = mbedtls_x509write_csr_pem(&req, p_csrbuf, csrbuflen, mbedtls_ctr_drbg_random, &gCtr_drbg);
-      if ( mbedResult != 0){
-          ESP_LOGE(TAG," failed\n  !  mbedtls_x509write_csr_pem returned -0x%04x", (unsigned int) -ret);
+      // drop the extensions of a previous request, the context is reused for every CSR
+      mbedtls_asn1_free_named_data_list(&p_req->MBEDTLS_PRIVATE(extensions));
+      mbedtls_x509write_csr_set_md_alg(p_req, DEVID_MD_ALG);
+      mbedtls_x509write_csr_set_key_usage(p_req, MBEDTLS_X509_KU_DIGITAL_SIGNATURE );
+      if (p_subject == NULL)
+      {
+        ESP_LOGI(TAG,"Set default sub name:   %s",p_ctx->p_subject_name);
+        ret = (mbedtls_x509write_csr_set_subject_name(p_req,p_ctx->p_subject_name) == 0) ? DEVID_OK : DEVID_ERR_SUBJECT;
+      }
+      else
+      {
+        ret = _set_subject(p_req, p_subject);
+        if (ret == DEVID_OK)
+          ret = _set_extensions(p_req, p_subject);
+      }
+      if (ret != DEVID_OK)
+      {
+        ret = DEVID_ERR_CSRGEN;
+      }
+      else
+      {
+        mbedtls_x509write_csr_set_key(p_req, &tmp );
+        PLOG(TAG,"after mbedtls_x509write_csr_set_key...        Watermark: %u bytes", uxTaskGetStackHighWaterMark(NULL));
+        int mbedResult;
+        start = esp_timer_get_time();
+        if (format == DEVID_FORMAT_DER)
+        {
+          // the DER writer fills the buffer from the end
+          mbedResult = mbedtls_x509write_csr_der(p_req, p_csrbuf, csrbuflen, DeviceRNG_random, NULL);
+          if (mbedResult > 0)
+          {
+            memmove(p_csrbuf, p_csrbuf + csrbuflen - mbedResult, mbedResult);
+            *p_olen = mbedResult;
+            mbedResult = 0;
+          }
+        }
+        else
+        {
+          mbedResult = mbedtls_x509write_csr_pem(p_req, p_csrbuf, csrbuflen, DeviceRNG_random, NULL);
+          if (mbedResult == 0)
+            *p_olen = strlen((char*) p_csrbuf);
+        }
+        PMETRIC_SINCE(PMETRIC_OP_SIGN, start);
+        if ( mbedResult != 0){
+            ESP_LOGE(TAG," failed\n  !  mbedtls_x509write_csr returned -0x%04x", (unsigned int) -mbedResult);
+            ret = DEVID_ERR_CSRGEN;
+        }
+        PLOG(TAG,"after mbedtls_x509write_csr...                Watermark: %u bytes", uxTaskGetStackHighWaterMark(NULL));
       }
-      ESP_LOGI(TAG,"after mbedtls_x509write_csr_pem...            Watermark: %d bytes", uxTaskGetStackHighWaterMark(NULL));
     }
     mbedtls_pk_free(&tmp);   
   }
@@ -270,47 +733,493 @@ int DeviceID_genCSR(unsigned char* p_csrbuf, uint16_t csrbuflen, char* p_subname
 
 
 //
-//      DeviceID_storeCert()
-//      store the DeviID in the TrustStore area 
-//      @param  - [Input] p_devID  = pointer to the buffer for the DevID 
-//      @param  - [Input] devIDlen = size of of the p_devID buffer    
+//      DeviceID_genCSR()
+//      generate the DevID CSR (PEM)
+//      Default value for Algorithm, key usage, are set in header file
+//      @param  - [Input] p_csrbuf  = pointer to the buffer where the csr is stored
+//      @param  - [Input] csrbuflen = size of of the csrbuffer    
+//      @param  - [Input] p_subject = typed subject, SAN and extensions; NULL uses DEVID_SUBJECT_NAME
 //      @return:    success: DEVID_OK
 //                  failure: error Message
 //
+int DeviceID_genCSR(unsigned char* p_csrbuf, uint16_t csrbuflen, const devid_subject_t* p_subject)
+{
+  size_t olen = 0;
+  return DeviceID_ctxGenCSR(&gDevID, p_csrbuf, csrbuflen, p_subject, DEVID_FORMAT_PEM, &olen);
+}
 
+//
+//      DeviceID_genCSRDER()
+//      generate the DevID CSR as DER, e.g. for a binary (CBOR) transport
+//      @param  - [Input] p_csrbuf  = pointer to the buffer where the csr is stored
+//      @param  - [Input] csrbuflen = size of of the csrbuffer    
+//      @param  - [Input] p_subject = typed subject, SAN and extensions; NULL uses DEVID_SUBJECT_NAME
+//      @param  - [Output] p_olen = length of the DER at the start of p_csrbuf
+//      @return:    success: DEVID_OK
+//                  failure: error Message
+//
+int DeviceID_genCSRDER(unsigned char* p_csrbuf, uint16_t csrbuflen, const devid_subject_t* p_subject, size_t* p_olen)
+{
+  return DeviceID_ctxGenCSR(&gDevID, p_csrbuf, csrbuflen, p_subject, DEVID_FORMAT_DER, p_olen);
+}
 
-int DeviceID_storeCert(unsigned char* p_devID, uint16_t devIDlen)
+
+
+//
+//      _load_file()
+//      read a TrustStore file into a new, NUL terminated buffer 
+//      @param  - [Input] p_filename = the TrustStore file
+//      @param  - [Output] pp_buf = the allocated buffer, to be freed by the caller
+//      @param  - [Output] p_len = length of the (block padded) file content
+//      @return:    success: DEVID_OK
+//                  failure: DEVID_FAIL
+//
+static int _load_file(char* p_filename, unsigned char** pp_buf, uint16_t* p_len)
+{
+  *pp_buf = (unsigned char *)calloc(DEVID_FILEBUF_SIZE + 1, 1);
+  *p_len = DEVID_FILEBUF_SIZE;
+  if (*pp_buf == NULL)
+    return DEVID_FAIL;
+  if (TPread(p_filename, *pp_buf, p_len) != TP_OK)
+  {
+    free(*pp_buf);
+    *pp_buf = NULL;
+    return DEVID_FAIL;
+  }
+  return DEVID_OK;
+}
+
+//
+//      _load_ca()
+//      load the trust anchor of the DevID chain: the CA bundle built into the firmware 
+//      (CONFIG_OT_DEVID_CA_BUNDLE), otherwise the bundle pre-provisioned in the TrustStore 
+//      by DeviceID_storeCA(). Never taken from the DevIDfinal request, the peer would 
+//      supply the anchor of its own certificate.
+//      @param  - [Output] pp_buf = NUL terminated PEM bundle, free() it
+//      @param  - [Output] p_len = length of the bundle without the NUL
+//      @return:    success: DEVID_OK
+//                  failure: DEVID_ERR_VERIFY, no anchor available
+//
+static int _load_ca(unsigned char** pp_buf, uint16_t* p_len)
+{
+#ifdef CONFIG_OT_DEVID_CA_BUNDLE
+  size_t len = devid_ca_pem_end - devid_ca_pem_start;       // incl. the NUL of the TEXT embed
+
+  *pp_buf = (unsigned char *)malloc(len);
+  if (*pp_buf == NULL)
+    return DEVID_FAIL;
+  memcpy(*pp_buf, devid_ca_pem_start, len);
+  *p_len = len - 1;
+  return DEVID_OK;
+#else
+  char cafile[] = DEVID_CA_FILENAME;
+
+  *pp_buf = NULL;
+  if (TPexists(cafile) != TP_OK)
+    return DEVID_ERR_VERIFY;
+  return _load_file(cafile, pp_buf, p_len);
+#endif
+}
+
+//
+//      _chain_digest()
+//      digest over the DevID certificate and the CA bundle it was verified against: 
+//      SHA-256( leaf DER | CA bundle ). The bundle is hashed as loaded, so any 
+//      change to it invalidates the digest.
+//      @param  - [Input] p_der / derlen = the DevID certificate 
+//      @param  - [Output] p_digest = 32 byte SHA-256
+//
+static void _chain_digest(const unsigned char* p_der, size_t derlen, unsigned char* p_digest)
+{
+  mbedtls_sha256_context sha;
+  unsigned char *p_ca = NULL;
+  uint16_t calen = 0;
+
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_update(&sha, p_der, derlen);
+  if (_load_ca(&p_ca, &calen) == DEVID_OK)
+  {
+    mbedtls_sha256_update(&sha, p_ca, calen);
+    free(p_ca);
+  }
+  mbedtls_sha256_finish(&sha, p_digest);
+  mbedtls_sha256_free(&sha);
+}
+
+//
+//      _verify_cert()
+//      check the certificate against the resident key of the context and, if a trust 
+//      anchor is available (_load_ca()), build and verify the chain. 
+//      @param  - [Input] p_ctx = the DevID context
+//      @param  - [Input] p_crt = the parsed DevID certificate (intermediates chained behind it)
+//      @param  - [Output] p_flags = DEVID_DIGEST_ANCHORED if verified against the CA bundle 
+//      @return:    success: DEVID_OK
+//                  failure: DEVID_ERR_VERIFY
+//
+static int _verify_cert(devid_ctx_t* p_ctx, mbedtls_x509_crt* p_crt, uint32_t* p_flags)
+{
+  int ret = DEVID_ERR_VERIFY;
+  unsigned char *p_buf = NULL;
+  uint16_t len = 0;
+  mbedtls_pk_context key;
+
+  *p_flags = 0;
+  mbedtls_pk_init(&key);
+  if (_load_file(p_ctx->keyfile, &p_buf, &len) != DEVID_OK)
+  {
+    ESP_LOGE(TAG," verify failed  !  DevID key not found");
+  }
+  else if (mbedtls_pk_parse_key(&key, p_buf, len + 1, NULL, 0, DeviceRNG_random, NULL) != 0 ||
+           mbedtls_pk_check_pair(&p_crt->pk, &key, DeviceRNG_random, NULL) != 0)
+  {
+    ESP_LOGE(TAG," verify failed  !  certificate does not match the DevID key");
+  }
+  else
+  {
+    ret = DEVID_OK;
+  }
+  if (p_buf != NULL)
+  {
+    memset(p_buf, 0x00, len);
+    free(p_buf);
+    p_buf = NULL;
+  }
+  mbedtls_pk_free(&key);
+
+  if (ret == DEVID_OK && _load_ca(&p_buf, &len) == DEVID_OK)
+  {
+    mbedtls_x509_crt ca;
+    uint32_t vflags = 0;
+
+    mbedtls_x509_crt_init(&ca);
+    if (mbedtls_x509_crt_parse(&ca, p_buf, len + 1) < 0)
+    {
+      ESP_LOGE(TAG," verify failed  !  stored CA bundle could not be parsed");
+      ret = DEVID_ERR_VERIFY;
+    }
+    else if (mbedtls_x509_crt_verify(p_crt, &ca, NULL, NULL, &vflags, NULL, NULL) != 0)
+    {
+      ESP_LOGE(TAG," verify failed  !  chain flags 0x%08" PRIx32, vflags);
+      ret = DEVID_ERR_VERIFY;
+    }
+    else
+    {
+      *p_flags |= DEVID_DIGEST_ANCHORED;
+    }
+    mbedtls_x509_crt_free(&ca);
+    free(p_buf);
+  }
+  else if (ret == DEVID_OK)
+  {
+#ifdef CONFIG_OT_DEVID_REQUIRE_CA
+    ESP_LOGE(TAG," verify failed  !  no CA bundle");
+    ret = DEVID_ERR_VERIFY;
+#else
+    ESP_LOGI(TAG,"no CA bundle, chain not verified");
+#endif
+  }
+  return ret;
+}
+
+//
+//      _store_crt()
+//      verify a parsed DevID (chain) and store the leaf as PEM plus the chain digest
+//      @param  - [Input] p_ctx = the DevID context, gives key and file names
+//      @param  - [Input] p_crt = parsed DevID, leaf first
+//      @param  - [Input] p_buf / buflen = scratch buffer for the PEM
+//
+static int _store_crt(devid_ctx_t* p_ctx, mbedtls_x509_crt* p_crt, unsigned char* p_buf, size_t buflen)
 {
   int ret = DEVID_FAIL;
-  char filename[] = DEVID_CERT_FILENAME;
+  char *filename = p_ctx->certfile;
+  char *digestfile = p_ctx->digestfile;
   size_t olen = 0;
+  devid_digest_t digest;
+  int64_t start = esp_timer_get_time();
 
-  unsigned char *output_buf = (unsigned char *)malloc(sizeof(unsigned char) * 16000);  
-  memset(output_buf,0x00,16000);
-  if ((ret = mbedtls_pem_write_buffer(DEVID_CERTHEADER,DEVID_CERTFOOTER,p_devID,devIDlen,output_buf,16000,&olen)) != 0)
+  if ((ret = _verify_cert(p_ctx, p_crt, &digest.flags)) != DEVID_OK)
+  {
+    ret = DEVID_ERR_VERIFY;
+  }
+  else if ((ret = mbedtls_pem_write_buffer(DEVID_CERTHEADER,DEVID_CERTFOOTER,p_crt->raw.p,p_crt->raw.len,p_buf,buflen,&olen)) != 0)
   {
     ESP_LOGE(TAG," convert Cert failed\n  !  mbedtls_pem_write_buffer returned -0x%04x", (unsigned int) -ret);
     ret = DEVID_ERR_WRITE_CERT;
   }
   else
   {
-    if(TPwrite(filename,output_buf,olen) != TP_OK)
+    // olen includes the terminating NUL
+    if(TPwrite(filename,p_buf,olen - 1) != TP_OK)
     {
       ESP_LOGI(TAG,"Error write file : ");  
-      ret = DEVID_ERR_KEYGEN;
+      ret = DEVID_ERR_WRITE_CERT;
     }
     else
     {
       
       ESP_LOGI(TAG,"DevID Stored Name: %s ",filename);
-      ESP_LOGI(TAG,"DevID Stored Name: \n%s ",output_buf);
+      ESP_LOGD(TAG,"DevID Stored Name: \n%s ",p_buf);
+      digest.magic = DEVID_DIGEST_MAGIC;
+      _chain_digest(p_crt->raw.p, p_crt->raw.len, digest.sha256);
+      if (TPwrite(digestfile, (unsigned char*) &digest, sizeof(digest)) != TP_OK)
+        ESP_LOGI(TAG,"Error write chain digest, consumers will verify at runtime");  
       ret = DEVID_OK;
     }
   }
+  PMETRIC_SINCE(PMETRIC_OP_STORE, start);
+  return ret;
+}
+
+//
+//      DeviceID_storeCert()
+//      DeviceID_ctxStoreCert() for the default DevID
+//
+int DeviceID_storeCert(unsigned char* p_devID, uint16_t devIDlen)
+{
+  return DeviceID_ctxStoreCert(&gDevID, p_devID, devIDlen);
+}
+
+//
+//      DeviceID_ctxStoreCert()
+//      parse and verify the DevID of a context and store it in the TrustStore area. The certificate must 
+//      match the resident DevID key and, if a CA bundle is stored, chain up to it. A digest 
+//      of the verified chain is stored next to the certificate (see DeviceID_checkCert()).
+//      @param  - [Input] p_ctx = the DevID context
+//      @param  - [Input] p_devID  = the DevID, base64 DER (optionally followed by base64 
+//                                   intermediates separated by ',') or PEM
+//      @param  - [Input] devIDlen = size of of the p_devID buffer    
+//      @return:    success: DEVID_OK
+//                  failure: error Message
+//
+int DeviceID_ctxStoreCert(devid_ctx_t* p_ctx, unsigned char* p_devID, uint16_t devIDlen)
+{
+  int ret = DEVID_FAIL;
+  size_t olen = 0;
+  mbedtls_x509_crt crt;
+
+  unsigned char *output_buf = (unsigned char *)malloc(sizeof(unsigned char) * 16000);  
+  int64_t start = esp_timer_get_time();
+  memset(output_buf,0x00,16000);
+  mbedtls_x509_crt_init(&crt);
+
+  if (devIDlen > 10 && memcmp(p_devID, "-----BEGIN", 10) == 0)
+  {
+    memcpy(output_buf, p_devID, MIN(devIDlen, 16000 - 1));
+    ret = mbedtls_x509_crt_parse(&crt, output_buf, strlen((char*)output_buf) + 1);
+  }
+  else
+  {
+    // base64 DER, leaf first; intermediates may follow separated by ','
+    size_t pos = 0;
+    ret = 0;
+    while (pos < devIDlen && ret == 0)
+    {
+      size_t end = pos;
+      while (end < devIDlen && p_devID[end] != ',')
+        end++;
+      if ((ret = mbedtls_base64_decode(output_buf, 16000, &olen, p_devID + pos, end - pos)) == 0)
+        ret = mbedtls_x509_crt_parse_der(&crt, output_buf, olen);
+      pos = end + 1;
+    }
+  }
+  PMETRIC_SINCE(PMETRIC_OP_PARSE, start);
+  if (ret != 0)
+  {
+    ESP_LOGE(TAG," parse Cert failed\n  !  returned -0x%04x", (unsigned int) -ret);
+    ret = DEVID_ERR_WRITE_CERT;
+  }
+  else
+  {
+    ret = _store_crt(p_ctx, &crt, output_buf, 16000);
+  }
+  mbedtls_x509_crt_free(&crt);
   free(output_buf);
   return ret;
 }
 
+//
+//      DeviceID_storeCertDER()
+//      DeviceID_ctxStoreCertDER() for the default DevID
+//
+int DeviceID_storeCertDER(const unsigned char* p_der, size_t derlen)
+{
+  return DeviceID_ctxStoreCertDER(&gDevID, p_der, derlen);
+}
 
+//
+//      DeviceID_ctxStoreCertDER()
+//      as DeviceID_ctxStoreCert() for raw DER: the leaf, optionally followed by the 
+//      DER of the intermediates (concatenated)
+//      @param  - [Input] p_ctx = the DevID context
+//      @param  - [Input] p_der  = the DER chain
+//      @param  - [Input] derlen = length of p_der
+//      @return:    success: DEVID_OK
+//                  failure: error Message
+//
+int DeviceID_ctxStoreCertDER(devid_ctx_t* p_ctx, const unsigned char* p_der, size_t derlen)
+{
+  int ret = 0;
+  mbedtls_x509_crt crt;
+  unsigned char *p = (unsigned char*) p_der;
+  const unsigned char *end = p_der + derlen;
+  size_t len;
+  int64_t start = esp_timer_get_time();
 
+  mbedtls_x509_crt_init(&crt);
+  while (p < end && ret == 0)
+  {
+    // every certificate is one SEQUENCE; its header gives the size
+    unsigned char *p_cert = p;
+    if ((ret = mbedtls_asn1_get_tag(&p, end, &len, MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE)) == 0)
+    {
+      ret = mbedtls_x509_crt_parse_der(&crt, p_cert, (p - p_cert) + len);
+      p += len;
+    }
+  }
+  PMETRIC_SINCE(PMETRIC_OP_PARSE, start);
+  if (ret != 0 || derlen == 0)
+  {
+    ESP_LOGE(TAG," parse Cert failed\n  !  returned -0x%04x", (unsigned int) -ret);
+    ret = DEVID_ERR_WRITE_CERT;
+  }
+  else
+  {
+    unsigned char *output_buf = (unsigned char *)malloc(DEVID_FILEBUF_SIZE);
+    ret = (output_buf == NULL) ? DEVID_FAIL : _store_crt(p_ctx, &crt, output_buf, DEVID_FILEBUF_SIZE);
+    free(output_buf);
+  }
+  mbedtls_x509_crt_free(&crt);
+  return ret;
+}
+
+//
+//      DeviceID_storeCA()
+//      pre-provision the CA bundle (PEM, one or more certificates) the DevID chain is verified 
+//      against, e.g. at the factory before the personalisation. Only from an authenticated 
+//      channel, never from the DevIDfinal request. A bundle built into the firmware 
+//      (CONFIG_OT_DEVID_CA_BUNDLE) takes precedence. At most DEVID_FILEBUF_SIZE bytes.
+//      @param  - [Input] p_ca  = the PEM bundle
+//      @param  - [Input] calen = length of p_ca    
+//      @return:    success: DEVID_OK
+//                  failure: error Message
+//
+int DeviceID_storeCA(unsigned char* p_ca, uint16_t calen)
+{
+  int ret = DEVID_FAIL;
+  char filename[] = DEVID_CA_FILENAME;
+  mbedtls_x509_crt ca;
+  unsigned char *p_buf = NULL;
+
+  // _load_ca() reads at most DEVID_FILEBUF_SIZE, a larger bundle would later count as "no CA"
+  if (calen > DEVID_FILEBUF_SIZE)
+  {
+    ESP_LOGE(TAG," CA bundle too large  !  %u bytes, max. %d", calen, DEVID_FILEBUF_SIZE);
+    return DEVID_ERR_VERIFY;
+  }
+  p_buf = (unsigned char *)calloc(calen + 1, 1);
+  if (p_buf == NULL)
+    return DEVID_FAIL;
+  memcpy(p_buf, p_ca, calen);
+  mbedtls_x509_crt_init(&ca);
+  if ((ret = mbedtls_x509_crt_parse(&ca, p_buf, calen + 1)) != 0)
+  {
+    ESP_LOGE(TAG," parse CA bundle failed\n  !  returned -0x%04x", (unsigned int) -ret);
+    ret = DEVID_ERR_VERIFY;
+  }
+  else if (TPwrite(filename, p_buf, calen) != TP_OK)
+  {
+    ESP_LOGI(TAG,"Error write file : ");  
+    ret = DEVID_ERR_WRITE_CERT;
+  }
+  else
+  {
+    ESP_LOGI(TAG,"CA bundle stored");
+    ret = DEVID_OK;
+  }
+  mbedtls_x509_crt_free(&ca);
+  free(p_buf);
+  return ret;
+}
 
+//
+//      DeviceID_checkCert()
+//      DeviceID_ctxCheckCert() for the default DevID, no open context needed
+//
+int DeviceID_checkCert(mbedtls_x509_crt* p_crt)
+{
+  devid_ctx_t ctx = {
+    .keyfile = DEVID_KEY_FILENAME,
+    .certfile = DEVID_CERT_FILENAME,
+    .digestfile = DEVID_DIGEST_FILENAME,
+  };
+
+  return DeviceID_ctxCheckCert(&ctx, p_crt);
+}
+
+//
+//      DeviceID_ctxCheckCert()
+//      load the stored DevID of a context and compare it with the digest written by 
+//      DeviceID_ctxStoreCert(). Only on a match of a digest with DEVID_DIGEST_ANCHORED the 
+//      chain was verified at store time and the caller can skip the re-verification 
+//      (e.g. on every TLS handshake); a DevID stored without a CA bundle is never anchored.
+//      Only the file names of the context are used, it does not need to be open.
+//      @param  - [Input] p_ctx = the DevID context
+//      @param  - [Output] p_crt = initialized certificate context, receives the DevID
+//      @return:    success: DEVID_OK, certificate loaded, digest matches and is anchored
+//                  failure: DEVID_ERR_VERIFY (certificate loaded, verify it yourself), 
+//                           error Message if the certificate could not be loaded
+//
+int DeviceID_ctxCheckCert(devid_ctx_t* p_ctx, mbedtls_x509_crt* p_crt)
+{
+  int ret = DEVID_FAIL;
+  char *filename = p_ctx->certfile;
+  char *digestfile = p_ctx->digestfile;
+  unsigned char *p_buf = NULL;
+  uint16_t len = 0;
+  devid_digest_t stored;
+  uint16_t storedlen = sizeof(stored) + 16;
+  unsigned char digestbuf[sizeof(devid_digest_t) + 16];
+  unsigned char sha256[32];
+
+  if (_load_file(filename, &p_buf, &len) != DEVID_OK)
+    return DEVID_ERR_WRITE_CERT;
+  if (mbedtls_x509_crt_parse(p_crt, p_buf, len + 1) != 0)
+  {
+    free(p_buf);
+    return DEVID_ERR_WRITE_CERT;
+  }
+  free(p_buf);
+
+  ret = DEVID_ERR_VERIFY;
+  if (TPread(digestfile, digestbuf, &storedlen) == TP_OK)
+  {
+    memcpy(&stored, digestbuf, sizeof(stored));
+    _chain_digest(p_crt->raw.p, p_crt->raw.len, sha256);
+    if (stored.magic == DEVID_DIGEST_MAGIC && memcmp(stored.sha256, sha256, sizeof(sha256)) == 0 &&
+        (stored.flags & DEVID_DIGEST_ANCHORED))
+      ret = DEVID_OK;
+  }
+  return ret;
+}
+
+//
+//      DeviceID_provisioned()
+//      cheap check of the default DevID for the boot fast path: key and certificate 
+//      exist and their first block decrypts to a PEM header. Nothing is parsed and 
+//      no DevID context is needed, the TrustStore must be initialized.
+//      @return:    success: DEVID_OK
+//                  failure: DEVID_ERR_KEYGEN no usable key, 
+//                           DEVID_ERR_WRITE_CERT key ok but no certificate
+//
+int DeviceID_provisioned(void)
+{
+  char keyfile[] = DEVID_KEY_FILENAME;
+  char certfile[] = DEVID_CERT_FILENAME;
+
+  if (TPcheckHeader(keyfile, DEVID_KEYHEADER) != TP_OK)
+    return DEVID_ERR_KEYGEN;
+  if (TPcheckHeader(certfile, DEVID_CERTHEADER) != TP_OK)
+    return DEVID_ERR_WRITE_CERT;
+  return DEVID_OK;
+}
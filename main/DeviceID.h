@@ -23,6 +23,7 @@
 #include <string.h>
 #include "esp_task_wdt.h"
 #include "esp_err.h"
+#include "freertos/FreeRTOS.h"
 #include "mbedtls/rsa.h"
 #include "mbedtls/pk.h"
 #include "mbedtls/sha1.h"
@@ -33,10 +34,12 @@
 #include "mbedtls/x509.h"
 #include "mbedtls/pem.h"
 #include "mbedtls/x509_csr.h"
+#include "mbedtls/x509_crt.h"
 #include "mbedtls/error.h"
 #include "mbedtls/md.h"
 #include "mbedtls/entropy.h"
 #include "mbedtls/bignum.h"
+#include "mbedtls/asn1write.h"
 
 /***********      Global definition       ************/
 #define DEVID_FORMAT_PEM        0
@@ -46,6 +49,11 @@
 #define DEVID_EXPONENT          65537
 #define DEVID_KEY_FILENAME      "DevID.key"
 #define DEVID_CERT_FILENAME		"DevID.crt"
+#define DEVID_CA_FILENAME		"CA.crt"
+#define DEVID_DIGEST_FILENAME	"DevID.dig"
+#define DEVID_DIGEST_MAGIC		0x44564431              // "DVD1"
+#define DEVID_DIGEST_ANCHORED	0x00000001              // chain verified against the CA bundle (trust anchor)
+#define DEVID_FILEBUF_SIZE		8192
 #define DEVID_FORMAT            DEVID_FORMAT_PEM
 #define DEVID_MD_ALG            MBEDTLS_MD_SHA256
 //#define DEVID_SUBJECT_NAME      "CN=wrover-dps-99,O=DycodeX,C=ID,serialNumber=0123456"
@@ -53,6 +61,7 @@
 #define DEVID_SUBJECT_NAME      "CN=1-ev8DpE0WaJ,O=Campus Schwarzwald,serialNumber=1-ev8DpE0WaJ"
 #define DEVID_CERTHEADER		"-----BEGIN CERTIFICATE-----\n"
 #define DEVID_CERTFOOTER		"-----END CERTIFICATE-----\n"
+#define DEVID_KEYHEADER			"-----BEGIN "                       // PEM key, RSA or PKCS#8
 
 
 
@@ -64,12 +73,17 @@
 #define DEVID_ERR_KEYGEN					0x4302					// Error during key generation phase
 #define DEVID_ERR_CSRGEN					0x4303					// Error durign CSR generation 
 #define DEVID_ERR_WRITE_CERT				0x4304					// Error during conversion
+#define DEVID_ERR_SUBJECT					0x4305					// Error while building subject / extensions
+#define DEVID_ERR_CANCELLED					0x4306					// Key generation cancelled by the caller
+#define DEVID_ERR_VERIFY					0x4307					// Certificate does not match key or chain
 
 
 
 /***********      DevID X.509  definition       ************/
 // standard usage: Configuration made via menuconfig
 #define DEVID_C         CONFIG_OT_DEVID_C
+#define DEVID_KEYGEN_YIELD_MS       CONFIG_OT_KEYGEN_YIELD_MS       // max. time between two yields during keygen
+#define DEVID_KEYGEN_YIELD_TICKS    CONFIG_OT_KEYGEN_YIELD_TICKS    // ticks passed to vTaskDelay() on every yield
 
 
 
@@ -78,14 +92,134 @@
 
 
 
-/***********      function declaration       ************/
+/***********      DevID CSR subject definition       ************/
+
+// GeneralName choices supported in the subjectAltName extension (RFC 5280 tag numbers)
+typedef enum
+{
+    DEVID_SAN_DNS = 2,                      // dNSName                  [2] IA5String
+    DEVID_SAN_URI = 6,                      // uniformResourceIdentifier [6] IA5String
+    DEVID_SAN_IP  = 7                       // iPAddress                [7] OCTET STRING (4 or 16 bytes)
+} devid_san_type_t;
+
+typedef struct
+{
+    devid_san_type_t type;
+    const unsigned char* p_value;           // raw value; for DEVID_SAN_IP the network order address bytes
+    size_t len;
+} devid_san_t;
+
+typedef struct
+{
+    const char* p_oid;                      // OID in DER form, e.g. MBEDTLS_OID_BASIC_CONSTRAINTS
+    size_t oid_len;
+    int critical;
+    const unsigned char* p_value;           // DER encoded extnValue content
+    size_t len;
+} devid_ext_t;
+
+// Typed CSR subject. All strings are NUL terminated, NULL fields are left out.
+// The RDNs are written in the order CN, O, OU, C, serialNumber.
+typedef struct
+{
+    const char* p_cn;
+    const char* p_o;
+    const char* p_ou;
+    const char* p_c;
+    const char* p_sn;
+    const devid_san_t* p_san;
+    uint8_t san_cnt;
+    const devid_ext_t* p_ext;
+    uint8_t ext_cnt;
+} devid_subject_t;
+
+
+
+/***********      DevID key generation progress       ************/
+
+typedef struct
+{
+    uint32_t candidates;                    // prime sized RNG draws: prime candidates and Miller-Rabin witnesses
+    uint32_t draws;                         // all RNG draws of the key generation
+    uint32_t yields;                        // cooperative yields so far
+    int64_t  elapsed_us;                    // time since the key generation started
+    bool     running;
+    bool     done;                          // last key generation finished successfully
+} devid_keygen_progress_t;
+
+// called from the key generation task on every prime candidate
+typedef void (*devid_progress_cb_t)(const devid_keygen_progress_t* p_progress, void* p_arg);
+
+// cancellation token; set cancel from any task to stop a running key generation
+typedef struct
+{
+    volatile bool cancel;
+} devid_cancel_t;
+
+
+
+// verified-chain digest, stored as DEVID_DIGEST_FILENAME next to the DevID
+typedef struct
+{
+    uint32_t magic;
+    uint32_t flags;
+    unsigned char sha256[32];
+} devid_digest_t;
+
+
+
+/***********      DevID context       ************/
+#define DEVID_ID_MAX            8                   // identity name, stored as "<id>.key", "<id>.crt", "<id>.dig"
+#define DEVID_NAME_SIZE         (DEVID_ID_MAX + 5)  // TrustStore path is limited to 30 chars incl. TP_BASE_PATH
+
+// One device identity: CSR writer, TrustStore file names and key generation progress.
+// Different contexts can be used from different tasks (both cores) in parallel, one 
+// context by one task at a time. The progress has a spinlock per context, so parallel 
+// key generations do not contend; DRBG (DeviceRNG) and TrustStore are shared and lock 
+// internally, they serialise the RNG draws and file access. The CA bundle is common 
+// to all identities.
+typedef struct
+{
+    mbedtls_x509write_csr req;
+    char keyfile[DEVID_NAME_SIZE];
+    char certfile[DEVID_NAME_SIZE];
+    char digestfile[DEVID_NAME_SIZE];
+    const char* p_subject_name;             // used if no typed subject is given
+    devid_keygen_progress_t progress;
+    portMUX_TYPE lock;                      // guards progress, set up by DeviceID_ctxOpen()
+    bool open;
+} devid_ctx_t;
+
 
 
-//int DeviceID_open(void);
+/***********      function declaration       ************/
+
+// context API, p_id = NULL opens the default DevID
+int DeviceID_ctxOpen(devid_ctx_t* p_ctx, const char* p_id);
+int DeviceID_ctxGenKey(devid_ctx_t* p_ctx, devid_progress_cb_t p_cb, void* p_arg, devid_cancel_t* p_cancel);
+int DeviceID_ctxResumeKey(devid_ctx_t* p_ctx);
+void DeviceID_ctxGetKeygenProgress(devid_ctx_t* p_ctx, devid_keygen_progress_t* p_progress);
+int DeviceID_ctxGenCSR(devid_ctx_t* p_ctx, unsigned char* p_csrbuf, uint16_t csrbuflen, const devid_subject_t* p_subject, 
+                       int format, size_t* p_olen);
+int DeviceID_ctxStoreCert(devid_ctx_t* p_ctx, unsigned char* p_devID, uint16_t devIDlen);
+int DeviceID_ctxStoreCertDER(devid_ctx_t* p_ctx, const unsigned char* p_der, size_t derlen);
+int DeviceID_ctxCheckCert(devid_ctx_t* p_ctx, mbedtls_x509_crt* p_crt);
+int DeviceID_ctxClose(devid_ctx_t* p_ctx);
+
+// default DevID (one context owned by DeviceID.c)
 int DeviceID_open(void);
-int DeviceID_genKey(char* p_seed);
-int DeviceID_genCSR(unsigned char* p_csrbuf, uint16_t csrbuflen, char* p_subname, char* p_subaltname);
+int DeviceID_genKey(void);
+int DeviceID_genKeyEx(devid_progress_cb_t p_cb, void* p_arg, devid_cancel_t* p_cancel);
+int DeviceID_resumeKey(void);
+int DeviceID_genKeyPEM(unsigned char* p_buf, size_t buflen, devid_cancel_t* p_cancel);
+void DeviceID_getKeygenProgress(devid_keygen_progress_t* p_progress);
+int DeviceID_genCSR(unsigned char* p_csrbuf, uint16_t csrbuflen, const devid_subject_t* p_subject);
+int DeviceID_genCSRDER(unsigned char* p_csrbuf, uint16_t csrbuflen, const devid_subject_t* p_subject, size_t* p_olen);
 int DeviceID_storeCert(unsigned char* p_devID, uint16_t devIDlen);
+int DeviceID_storeCertDER(const unsigned char* p_der, size_t derlen);
+int DeviceID_storeCA(unsigned char* p_ca, uint16_t calen);
+int DeviceID_checkCert(mbedtls_x509_crt* p_crt);
+int DeviceID_provisioned(void);
 int DeviceID_close(void);
 
 
@@ -0,0 +1,243 @@
+///
+//  DeviceRNG.c
+//  Shared deterministic random bit generator (CTR_DRBG) for the ESP32.
+//  The generator is seeded once during boot, so the entropy gathering does 
+//  not hit the key generation. All consumers (key generation, key parsing, 
+//  CSR signing) draw from the same instance; access is serialized by a mutex.
+//  Prediction resistance and the reseed interval are set via menuconfig.
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.    
+
+
+#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#include "DeviceRNG.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_mac.h"
+#include "esp_chip_info.h"
+#include "esp_timer.h"
+#include "PersoBoot.h"
+
+
+static const char *TAG = "DeviceRNG";
+
+/***********      Global definitions       ************/
+
+static mbedtls_entropy_context gRngEntropy;
+static mbedtls_ctr_drbg_context gRngDrbg;
+static SemaphoreHandle_t gRngLock = NULL;              // protects DRBG and stats, never deleted
+static StaticSemaphore_t gRngLockBuf;
+static portMUX_TYPE gRngInitMux = portMUX_INITIALIZER_UNLOCKED;
+static volatile bool gRngSeeded = false;                // set with gRngLock taken, after the seed
+static devrng_stats_t gRngStats;
+static bool gRngSeeding = false;
+
+
+
+/***********      Local function definitions       ************/
+
+//
+//      _entropy_func()
+//      entropy callback of the DRBG. Wraps mbedtls_entropy_func() to count the 
+//      seed / reseed operations. Called with gRngLock taken.
+//
+static int _entropy_func(void* p_data, unsigned char* p_output, size_t len)
+{
+    int ret = mbedtls_entropy_func(p_data, p_output, len);
+    if (ret == 0)
+    {
+        gRngStats.entropy_cnt++;
+        gRngStats.entropy_bytes += len;
+        // the boot seed pulls entropy and nonce, only later pulls are reseeds
+        if (!gRngSeeding)
+            gRngStats.seed_cnt++;
+    }
+    return ret;
+}
+
+//
+//      _personalisation()
+//      build the device unique personalisation string: label | factory MAC | chip model and revision
+//      @return: length of the personalisation string
+//
+static size_t _personalisation(unsigned char* p_buf, size_t buflen)
+{
+    uint8_t mac[6] = {0};
+    esp_chip_info_t chip_info;
+    size_t len = strlen(DEVRNG_PERSONALISATION);
+
+    esp_chip_info(&chip_info);
+    if (esp_read_mac(mac, ESP_MAC_EFUSE_FACTORY) != ESP_OK)
+        ESP_LOGE(TAG, "Failed to read factory MAC, personalisation is not device unique");
+
+    memcpy(p_buf, DEVRNG_PERSONALISATION, len);
+    memcpy(p_buf + len, mac, sizeof(mac));
+    len += sizeof(mac);
+    p_buf[len++] = (unsigned char) chip_info.model;
+    p_buf[len++] = (unsigned char) (chip_info.revision >> 8);
+    p_buf[len++] = (unsigned char) chip_info.revision;
+    p_buf[len++] = (unsigned char) chip_info.cores;
+    assert(len <= buflen);
+    return len;
+}
+
+
+
+//
+//      _lock()
+//      create gRngLock exactly once, also for concurrent first callers
+//
+static SemaphoreHandle_t _lock(void)
+{
+    taskENTER_CRITICAL(&gRngInitMux);
+    if (gRngLock == NULL)
+        gRngLock = xSemaphoreCreateMutexStatic(&gRngLockBuf);
+    taskEXIT_CRITICAL(&gRngInitMux);
+    return gRngLock;
+}
+
+//
+//      _seed()
+//      boot seed of the DRBG; called with gRngLock taken
+//
+static esp_err_t _seed(void)
+{
+    int ret;
+    unsigned char pers[32];
+    size_t perslen;
+    int64_t start;
+
+    memset(&gRngStats, 0x00, sizeof(gRngStats));
+    mbedtls_entropy_init(&gRngEntropy);
+    mbedtls_ctr_drbg_init(&gRngDrbg);
+    perslen = _personalisation(pers, sizeof(pers));
+
+    start = esp_timer_get_time();
+    gRngSeeding = true;
+    ret = mbedtls_ctr_drbg_seed(&gRngDrbg, _entropy_func, &gRngEntropy, pers, perslen);
+    gRngSeeding = false;
+    gRngStats.boot_seed_us = esp_timer_get_time() - start;
+    if (ret != 0)
+    {
+        // stays unseeded, the next call tries again; the lock is kept, other tasks may wait on it
+        ESP_LOGE(TAG, " failed\n  !  mbedtls_ctr_drbg_seed returned -0x%04x", (unsigned int) -ret);
+        mbedtls_ctr_drbg_free(&gRngDrbg);
+        mbedtls_entropy_free(&gRngEntropy);
+        return ESP_FAIL;
+    }
+    mbedtls_ctr_drbg_set_prediction_resistance(&gRngDrbg, DEVRNG_PREDICTION_RESISTANCE);
+    mbedtls_ctr_drbg_set_reseed_interval(&gRngDrbg, DEVRNG_RESEED_INTERVAL);
+    gRngStats.prediction_resistance = (DEVRNG_PREDICTION_RESISTANCE == MBEDTLS_CTR_DRBG_PR_ON);
+    gRngStats.reseed_interval = DEVRNG_RESEED_INTERVAL;
+    PersoBoot_stamp(PBOOT_RNG_SEED);
+    ESP_LOGI(TAG, "DRBG seeded in %lld us; prediction resistance: %d reseed interval: %d",
+             gRngStats.boot_seed_us, gRngStats.prediction_resistance, gRngStats.reseed_interval);
+    return ESP_OK;
+}
+
+
+
+//
+//      DeviceRNG_init()
+//      seed the shared DRBG. Called from app_main() at boot; safe to call more than once 
+//      and from several tasks, only the first call seeds and the others wait for it.
+//
+//      @return:    success: ESP_OK
+//                  failure: ESP_ERR_NO_MEM, ESP_FAIL (seed failed)
+//
+esp_err_t DeviceRNG_init(void)
+{
+    esp_err_t ret = ESP_OK;
+    SemaphoreHandle_t lock;
+
+    if (gRngSeeded)
+        return ESP_OK;
+    if ((lock = _lock()) == NULL)
+        return ESP_ERR_NO_MEM;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (!gRngSeeded && (ret = _seed()) == ESP_OK)
+        gRngSeeded = true;
+    xSemaphoreGive(lock);
+    return ret;
+}
+
+//
+//      DeviceRNG_random()
+//      draw random bytes from the shared DRBG. Signature matches the mbedtls f_rng callback, 
+//      p_rng is ignored and may be NULL.
+//
+//      @return:    success: 0
+//                  failure: mbedtls error code 
+//
+int DeviceRNG_random(void* p_rng, unsigned char* p_output, size_t len)
+{
+    int ret;
+
+    (void) p_rng;
+    if (!gRngSeeded && DeviceRNG_init() != ESP_OK)
+        return MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED;
+
+    xSemaphoreTake(gRngLock, portMAX_DELAY);
+    ret = mbedtls_ctr_drbg_random(&gRngDrbg, p_output, len);
+    if (ret == 0)
+    {
+        gRngStats.request_cnt++;
+        gRngStats.request_bytes += len;
+    }
+    xSemaphoreGive(gRngLock);
+    return ret;
+}
+
+//
+//      DeviceRNG_reseed()
+//      force a reseed of the shared DRBG, e.g. before a long term key is generated
+//      @param  - [Input] p_additional = optional additional input, may be NULL
+//      @param  - [Input] len = length of p_additional 
+//
+//      @return:    success: ESP_OK
+//                  failure: ESP_FAIL
+//
+esp_err_t DeviceRNG_reseed(const unsigned char* p_additional, size_t len)
+{
+    int ret;
+
+    if (!gRngSeeded)
+        return DeviceRNG_init();
+
+    xSemaphoreTake(gRngLock, portMAX_DELAY);
+    ret = mbedtls_ctr_drbg_reseed(&gRngDrbg, p_additional, len);
+    xSemaphoreGive(gRngLock);
+    if (ret != 0)
+    {
+        ESP_LOGE(TAG, " failed\n  !  mbedtls_ctr_drbg_reseed returned -0x%04x", (unsigned int) -ret);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+//
+//      DeviceRNG_getStats()
+//      copy the seed and request counters of the shared DRBG
+//
+void DeviceRNG_getStats(devrng_stats_t* p_stats)
+{
+    if (!gRngSeeded)
+    {
+        memset(p_stats, 0x00, sizeof(devrng_stats_t));
+        return;
+    }
+    xSemaphoreTake(gRngLock, portMAX_DELAY);
+    memcpy(p_stats, &gRngStats, sizeof(devrng_stats_t));
+    xSemaphoreGive(gRngLock);
+}
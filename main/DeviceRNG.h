@@ -0,0 +1,67 @@
+///
+//  DeviceRNG.h
+//  Shared deterministic random bit generator (CTR_DRBG) for the ESP32
+//  The DRBG is seeded once at boot with a device unique personalisation 
+//  string and shared by all tasks that need random numbers. 
+//
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.   
+
+
+#ifndef DEVICERNG_H
+#define DEVICERNG_H
+
+#include "esp_log.h"
+#include <string.h>
+#include "esp_err.h"
+#include "mbedtls/build_info.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+
+
+/***********      Global definition       ************/
+#define DEVRNG_PERSONALISATION      "DevID-DRBG"
+#define DEVRNG_RESEED_INTERVAL      CONFIG_OT_DRBG_RESEED_INTERVAL
+#ifdef CONFIG_OT_DRBG_PREDICTION_RESISTANCE
+#define DEVRNG_PREDICTION_RESISTANCE    MBEDTLS_CTR_DRBG_PR_ON
+#else
+#define DEVRNG_PREDICTION_RESISTANCE    MBEDTLS_CTR_DRBG_PR_OFF
+#endif
+
+
+
+/***********      Type defintion        ************/
+
+typedef struct
+{
+    uint32_t seed_cnt;                      // explicit and automatic reseeds after the boot seed
+    uint32_t entropy_cnt;                   // pulls from the entropy source (boot seed included)
+    uint32_t entropy_bytes;                 // bytes drawn from the entropy source 
+    uint32_t request_cnt;                   // DeviceRNG_random() calls
+    uint64_t request_bytes;                 // bytes delivered to the callers
+    int64_t  boot_seed_us;                  // time spent for the boot seed 
+    bool     prediction_resistance;
+    int      reseed_interval;
+} devrng_stats_t;
+
+
+
+/***********      function declaration       ************/
+
+esp_err_t DeviceRNG_init(void);
+int DeviceRNG_random(void* p_rng, unsigned char* p_output, size_t len);
+esp_err_t DeviceRNG_reseed(const unsigned char* p_additional, size_t len);
+void DeviceRNG_getStats(devrng_stats_t* p_stats);
+
+
+#endif
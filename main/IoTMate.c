@@ -31,8 +31,13 @@
 #include <netdb.h>
 #include "esp_http_server.h"
 #include "esp_chip_info.h"
-#include "wifi_manager.h"
+#include "esp_timer.h"
+#include "NetConn.h"
 #include "TrustPlatform.h"
+#include "DeviceRNG.h"
+#include "KeyPool.h"
+#include "PersoLog.h"
+#include "PersoBoot.h"
 #include "espPerso.h"
 
 
@@ -48,7 +53,10 @@ void cb_connection_ok(void *pvParameter){
     esp_ip4addr_ntoa(&param->ip_info.ip, str_ip, IP4ADDR_STRLEN_MAX);
     ESP_LOGI(TAG, "\n==================================================================\n");
     ESP_LOGI(TAG, "Connected !  My IP is %s!", str_ip);
+    if (PersoBoot_stamp(PBOOT_READY))
+        PersoBoot_dump();
     TPinit();
+    KeyPool_start();
 }
 
 
@@ -59,8 +67,16 @@ void app_main(void)
 
     esp_chip_info_t chip_info;
 
+    // first: keeps the previous boot record and stamps the app_main entry
+    PersoBoot_init();
     esp_err_t ret = nvs_flash_init();
     ESP_ERROR_CHECK(ret);  
+    PersoBoot_stamp(PBOOT_NVS_INIT);
+    // deferred log drain first, the personalisation records into its ring
+    PersoLog_start();
+    PersoBoot_console();
+    // the personalisation keygen takes a key stored by an earlier boot, before the producer runs
+    KeyPool_init();
     
     esp_log_level_set("TrustPlatform",ESP_LOG_INFO);
     esp_log_level_set("wifi",ESP_LOG_ERROR);
@@ -73,11 +89,17 @@ void app_main(void)
     ESP_LOGI(TAG, "                      COM     : Wifi%s%s",(chip_info.features & CHIP_FEATURE_BT) ? "/BT" : "", 
                                                                (chip_info.features & CHIP_FEATURE_BLE) ? "/BLE" : "");
     ESP_LOGI(TAG, "                      Rev     : %d", chip_info.revision);
-    
+
+    // seed the shared DRBG now, before any task draws from it (KeyPool, PersoTLS) and off the keygen path
+    ESP_ERROR_CHECK(DeviceRNG_init());
+
     ESP_LOGI(TAG, "\n==================================================================\n");
     espPerso();
     ESP_LOGI(TAG, " Personalizsation done start IOT-MATE appe ");
-    wifi_manager_start();
-    wifi_manager_set_callback(WM_EVENT_STA_GOT_IP, &cb_connection_ok);
+    PersoBoot_stamp(PBOOT_PERSO_DONE);
+    // keeps the link of the personalisation, a provisioned boot connects here
+    if (NetConn_start() != NETCONN_OK)
+        ESP_LOGE(TAG, "WiFi init failed");
+    NetConn_onGotIP(&cb_connection_ok);
       
 }
@@ -0,0 +1,294 @@
+///
+//  KeyPool.c
+//  Pool of pre-generated DevID key pairs. A producer task running at idle 
+//  priority fills the pool slots (Pool<n>.key) in the TrustStore, so it only 
+//  consumes CPU time nobody else needs. On chips with an internal temperature 
+//  sensor the refill pauses above KEYPOOL_MAX_TEMP. DeviceID_genKey() pops a 
+//  slot instead of generating a key and wakes up the producer to refill.
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.    
+
+
+#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#include "KeyPool.h"
+#include "DeviceID.h"
+#include "TrustPlatform.h"
+#include "PersoTasks.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "soc/soc_caps.h"
+#if SOC_TEMP_SENSOR_SUPPORTED
+#include "driver/temperature_sensor.h"
+#endif
+
+
+static const char *TAG = "KeyPool";
+
+/***********      Global definitions       ************/
+
+static TaskHandle_t gPoolTask = NULL;
+static SemaphoreHandle_t gPoolLock = NULL;              // protects the slots and gPoolStats
+static devid_cancel_t gPoolCancel;
+static keypool_stats_t gPoolStats;
+static int64_t gPoolRefillUs = 0;                       // accumulated time spent refilling
+#if SOC_TEMP_SENSOR_SUPPORTED
+static temperature_sensor_handle_t gPoolTemp = NULL;
+#endif
+
+
+
+/***********      Local function definitions       ************/
+
+static void _slot_name(char* p_name, int slot)
+{
+    sprintf(p_name, KEYPOOL_FILENAME, slot);
+}
+
+//
+//      _scan_slots()
+//      count the filled slots and return the first free one; called with gPoolLock taken
+//      @return: index of the first free slot, -1 if the pool is full
+//
+static int _scan_slots(void)
+{
+    char name[16];
+    int free_slot = -1;
+
+    gPoolStats.depth = 0;
+    for (int i = 0; i < KEYPOOL_SIZE; i++)
+    {
+        _slot_name(name, i);
+        if (TPexists(name) == TP_OK)
+            gPoolStats.depth++;
+        else if (free_slot < 0)
+            free_slot = i;
+    }
+    return free_slot;
+}
+
+//
+//      _too_hot()
+//      @return: true if the chip temperature is above KEYPOOL_MAX_TEMP
+//
+static bool _too_hot(void)
+{
+#if SOC_TEMP_SENSOR_SUPPORTED
+    float celsius = 0;
+    if (gPoolTemp != NULL && temperature_sensor_get_celsius(gPoolTemp, &celsius) == ESP_OK)
+        return celsius > KEYPOOL_MAX_TEMP;
+#endif
+    return false;
+}
+
+//
+//      _producer_task()
+//      refill loop. Sleeps until a slot is free, then generates one key per round.
+//
+static void _producer_task(void* p_arg)
+{
+    char name[16];
+    unsigned char *p_key = (unsigned char *)malloc(KEYPOOL_KEYBUF_SIZE);
+    int slot;
+
+    assert(p_key != NULL);
+    while (1)
+    {
+        xSemaphoreTake(gPoolLock, portMAX_DELAY);
+        slot = _scan_slots();
+        xSemaphoreGive(gPoolLock);
+        if (slot < 0)
+        {
+            // pool full, wait for KeyPool_pop()
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        if (_too_hot())
+        {
+            xSemaphoreTake(gPoolLock, portMAX_DELAY);
+            gPoolStats.throttled++;
+            xSemaphoreGive(gPoolLock);
+            vTaskDelay(pdMS_TO_TICKS(KEYPOOL_REFILL_DELAY_MS));
+            continue;
+        }
+
+        int64_t start = esp_timer_get_time();
+        xSemaphoreTake(gPoolLock, portMAX_DELAY);
+        gPoolCancel.cancel = false;
+        gPoolStats.running = true;
+        xSemaphoreGive(gPoolLock);
+        int ret = DeviceID_genKeyPEM(p_key, KEYPOOL_KEYBUF_SIZE, &gPoolCancel);
+        xSemaphoreTake(gPoolLock, portMAX_DELAY);
+        gPoolStats.running = false;
+        if (ret == DEVID_ERR_CANCELLED)
+            gPoolStats.cancelled++;
+        xSemaphoreGive(gPoolLock);
+        if (ret == DEVID_OK)
+        {
+            _slot_name(name, slot);
+            xSemaphoreTake(gPoolLock, portMAX_DELAY);
+            if (TPwrite(name, p_key, strlen((char*)p_key)) == TP_OK)
+            {
+                gPoolStats.produced++;
+                gPoolStats.depth++;
+                gPoolStats.last_gen_us = esp_timer_get_time() - start;
+                gPoolRefillUs += gPoolStats.last_gen_us;
+                gPoolStats.refill_per_hour = (uint32_t)((gPoolStats.produced * 3600000000LL) / gPoolRefillUs);
+                ESP_LOGI(TAG, "slot %d filled in %lld ms, depth %d/%d", slot, gPoolStats.last_gen_us / 1000,
+                         gPoolStats.depth, KEYPOOL_SIZE);
+            }
+            else
+            {
+                ESP_LOGE(TAG, "Error write pool slot %d", slot);
+            }
+            xSemaphoreGive(gPoolLock);
+        }
+        memset(p_key, 0x00, KEYPOOL_KEYBUF_SIZE);
+        vTaskDelay(pdMS_TO_TICKS(KEYPOOL_REFILL_DELAY_MS));
+    }
+}
+
+
+
+//
+//      KeyPool_init()
+//      create the pool lock, so KeyPool_pop() can take the keys stored by an earlier boot 
+//      before the producer runs. Call once at startup, before any other task uses the pool. 
+//      Does nothing if the key pool is disabled in menuconfig.
+//
+//      @return:    success: KEYPOOL_OK
+//                  failure: KEYPOOL_ERR_INIT
+//
+esp_err_t KeyPool_init(void)
+{
+    if (KEYPOOL_SIZE == 0 || gPoolLock != NULL)
+        return KEYPOOL_OK;
+
+    gPoolLock = xSemaphoreCreateMutex();
+    if (gPoolLock == NULL)
+        return KEYPOOL_ERR_INIT;
+    gPoolStats.size = KEYPOOL_SIZE;
+    return KEYPOOL_OK;
+}
+
+//
+//      KeyPool_start()
+//      start the background producer. Requires an initialized TrustPlatform. 
+//      Does nothing if the key pool is disabled in menuconfig.
+//
+//      @return:    success: KEYPOOL_OK
+//                  failure: KEYPOOL_ERR_INIT
+//
+esp_err_t KeyPool_start(void)
+{
+    if (KEYPOOL_SIZE == 0 || gPoolTask != NULL)
+        return KEYPOOL_OK;
+
+    if (KeyPool_init() != KEYPOOL_OK)
+        return KEYPOOL_ERR_INIT;
+#if SOC_TEMP_SENSOR_SUPPORTED
+    temperature_sensor_config_t temp_cnf = TEMPERATURE_SENSOR_CONFIG_DEFAULT(10, 80);
+    if (temperature_sensor_install(&temp_cnf, &gPoolTemp) != ESP_OK || temperature_sensor_enable(gPoolTemp) != ESP_OK)
+    {
+        ESP_LOGI(TAG, "temperature sensor not available, refill is not temperature throttled");
+        gPoolTemp = NULL;
+    }
+#endif
+    // idle priority: the producer only gets CPU time no other task wants (on the crypto core)
+    if (xTaskCreatePinnedToCore(_producer_task, "keypool", KEYPOOL_TASK_STACK, NULL, tskIDLE_PRIORITY, &gPoolTask, 
+                                PTASK_CRYPTO_CORE) != pdPASS)
+    {
+        ESP_LOGE(TAG, "failed to start the producer task");
+        return KEYPOOL_ERR_INIT;
+    }
+    ESP_LOGI(TAG, "key pool producer started, size %d", KEYPOOL_SIZE);
+    return KEYPOOL_OK;
+}
+
+//
+//      KeyPool_pop()
+//      move one pre-generated key to the given TrustStore file and trigger the refill.
+//      Works without a running producer (keys stored by an earlier boot), needs 
+//      KeyPool_init() and an initialized TrustPlatform. If the pool is empty a running 
+//      pool keygen is cancelled, so the caller's own key generation gets the CPU.
+//      @param  - [Input] p_filename = destination file, e.g. DEVID_KEY_FILENAME
+//
+//      @return:    success: KEYPOOL_OK
+//                  failure: KEYPOOL_ERR_EMPTY, KEYPOOL_ERR_STORE
+//
+esp_err_t KeyPool_pop(char* p_filename)
+{
+    esp_err_t ret = KEYPOOL_ERR_EMPTY;
+    char name[16];
+
+    if (gPoolLock == NULL)
+        return KEYPOOL_ERR_EMPTY;
+
+    unsigned char *p_key = (unsigned char *)malloc(KEYPOOL_KEYBUF_SIZE + 16);
+    if (p_key == NULL)
+        return KEYPOOL_FAIL;
+
+    xSemaphoreTake(gPoolLock, portMAX_DELAY);
+    for (int i = 0; i < KEYPOOL_SIZE && ret == KEYPOOL_ERR_EMPTY; i++)
+    {
+        uint16_t len = KEYPOOL_KEYBUF_SIZE + 16;
+        _slot_name(name, i);
+        if (TPexists(name) != TP_OK)
+            continue;
+        memset(p_key, 0x00, len);
+        if (TPread(name, p_key, &len) != TP_OK || 
+            TPwrite(p_filename, p_key, strlen((char*)p_key)) != TP_OK)
+        {
+            ESP_LOGE(TAG, "Error moving pool slot %d", i);
+            ret = KEYPOOL_ERR_STORE;
+        }
+        else
+        {
+            TPremove(name);
+            gPoolStats.consumed++;
+            ESP_LOGI(TAG, "key taken from slot %d", i);
+            ret = KEYPOOL_OK;
+        }
+    }
+    // depth is only counted by the producer, recount for a pool without one
+    _scan_slots();
+    if (ret == KEYPOOL_ERR_EMPTY && gPoolStats.running)
+    {
+        gPoolCancel.cancel = true;
+        ESP_LOGI(TAG, "pool empty, pool keygen cancelled for the foreground keygen");
+    }
+    xSemaphoreGive(gPoolLock);
+    memset(p_key, 0x00, KEYPOOL_KEYBUF_SIZE + 16);
+    free(p_key);
+
+    if (gPoolTask != NULL)
+        xTaskNotifyGive(gPoolTask);
+    return ret;
+}
+
+//
+//      KeyPool_getStats()
+//      copy pool depth, refill rate and counters
+//
+void KeyPool_getStats(keypool_stats_t* p_stats)
+{
+    if (gPoolLock == NULL)
+    {
+        memset(p_stats, 0x00, sizeof(keypool_stats_t));
+        return;
+    }
+    xSemaphoreTake(gPoolLock, portMAX_DELAY);
+    memcpy(p_stats, &gPoolStats, sizeof(keypool_stats_t));
+    xSemaphoreGive(gPoolLock);
+}
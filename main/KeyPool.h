@@ -0,0 +1,80 @@
+///
+//  KeyPool.h
+//  Pool of pre-generated DevID key pairs in the TrustStore
+//  An idle time producer keeps up to KEYPOOL_SIZE spare key pairs encrypted 
+//  in the TrustPlatform, so a re-personalisation does not pay the RSA keygen.
+//
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.   
+
+
+#ifndef KEYPOOL_H
+#define KEYPOOL_H
+
+#include "esp_log.h"
+#include <string.h>
+#include "esp_err.h"
+
+
+/***********      Global definition       ************/
+#ifdef CONFIG_OT_KEYPOOL_ENABLE
+#define KEYPOOL_SIZE                CONFIG_OT_KEYPOOL_SIZE
+#define KEYPOOL_REFILL_DELAY_MS     CONFIG_OT_KEYPOOL_REFILL_DELAY_MS
+#define KEYPOOL_MAX_TEMP            CONFIG_OT_KEYPOOL_MAX_TEMP
+#define KEYPOOL_TASK_STACK          CONFIG_OT_TASK_KEYPOOL_STACK
+#else
+#define KEYPOOL_SIZE                0
+#define KEYPOOL_REFILL_DELAY_MS     0
+#define KEYPOOL_MAX_TEMP            0
+#define KEYPOOL_TASK_STACK          8192
+#endif
+#define KEYPOOL_FILENAME            "Pool%d.key"
+#define KEYPOOL_KEYBUF_SIZE         2048                        // PEM of a RSA 2048 key is ~1.7 KB 
+
+
+
+/***********      ERROR Codes    ************/
+#define KEYPOOL_OK                          0x0000                  // Everything ok      
+#define KEYPOOL_FAIL                        0x7300                  // Undefined Error; default Error
+#define KEYPOOL_ERR_INIT                    0x7301                  // Error while starting the producer
+#define KEYPOOL_ERR_EMPTY                   0x7302                  // No pre-generated key available
+#define KEYPOOL_ERR_STORE                   0x7303                  // Error while moving a key in the TrustStore
+
+
+
+/***********      Type defintion        ************/
+
+typedef struct
+{
+    uint8_t  depth;                         // keys currently in the pool
+    uint8_t  size;                          // configured pool size
+    uint32_t produced;                      // keys generated since boot
+    uint32_t consumed;                      // keys taken since boot
+    uint32_t throttled;                     // refill pauses due to temperature
+    uint32_t cancelled;                     // pool keygens aborted for a foreground keygen
+    int64_t  last_gen_us;                   // duration of the last pool keygen
+    uint32_t refill_per_hour;               // keys per hour over the producer run time
+    bool     running;                       // producer generating right now
+} keypool_stats_t;
+
+
+
+/***********      function declaration       ************/
+
+esp_err_t KeyPool_init(void);
+esp_err_t KeyPool_start(void);
+esp_err_t KeyPool_pop(char* p_filename);
+void KeyPool_getStats(keypool_stats_t* p_stats);
+
+
+#endif
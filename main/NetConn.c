@@ -0,0 +1,300 @@
+//
+//  NetConn.c
+//  Connectivity service of the device, shared by the personalisation and the application
+//
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#include "sdkconfig.h"
+#define LOG_LOCAL_LEVEL CONFIG_OT_LOG_LEVEL_NET
+
+#include "esp_log.h"
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+#include "esp_wifi.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
+#include "lwip/ip4_addr.h"
+
+#include "NetConn.h"
+#include "WifiCache.h"
+#include "PersoBoot.h"
+#include "PersoTasks.h"
+
+
+#define NETCONN_CONNECTED_BIT   BIT0
+#define NETCONN_FAIL_BIT        BIT1
+
+// notification bits of the cache task
+#define NETCONN_CACHE_STORE     BIT0            // got an IP: remember the AP
+#define NETCONN_CACHE_DROP      BIT1            // cached AP failed: drop it and scan
+
+#define NETCONN_TASK_STACK      PTASK_NETCONN_STACK
+#define NETCONN_TASK_PRIORITY   3               // below the event loop task, above the log drain
+
+#define WIFI_SSID   CONFIG_OT_WIFI_SSID
+#define WIFI_PW     CONFIG_OT_WIFI_PASSWORD
+#define WIFI_RETRY  CONFIG_OT_MAXIMUM_RETRY
+
+
+// Global var definition section:
+static const char *TAG = "NetConn";
+
+static EventGroupHandle_t s_event_group = NULL;
+static TaskHandle_t s_cache_task = NULL;
+static esp_netif_t *s_sta_netif = NULL;
+static int s_retry_num = 0;
+static bool s_cached = false;                   // connecting to the cached BSSID
+static bool s_up = false;                       // had an IP once: reconnect without a retry limit
+static bool s_connected = false;                // station has an IP, guarded by s_mux
+static int64_t s_start_us = 0;
+static ip_event_got_ip_t s_ip;                  // last IP event, replayed to a late subscriber
+static netconn_cb_t s_cb = NULL;
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+
+#ifdef CONFIG_OT_USE_STATIC_IP
+static void _set_static_ip(esp_netif_t *netif)
+{
+    if (esp_netif_dhcpc_stop(netif) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to stop dhcp client");
+        return;
+    }
+    esp_netif_ip_info_t ip;
+    memset(&ip, 0 , sizeof(esp_netif_ip_info_t));
+    ip.ip.addr = ipaddr_addr(CONFIG_OT_STATIC_IP_ADDR);
+    ip.netmask.addr = ipaddr_addr(CONFIG_OT_STATIC_NETMASK_ADDR);
+    ip.gw.addr = ipaddr_addr(CONFIG_OT_STATIC_GW_ADDR);
+    if (esp_netif_set_ip_info(netif, &ip) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to set ip info");
+        return;
+    }
+    ESP_LOGD(TAG, "Success to set static ip");
+}
+#endif
+
+
+//
+//      _cache_task()
+//      Wi-Fi cache writes (NVS, the station config in flash) off the default event 
+//      loop task, a flash write there holds up every other event handler
+//
+static void _cache_task(void *pvParameter)
+{
+    uint32_t bits;
+
+    for (;;)
+    {
+        xTaskNotifyWait(0, UINT32_MAX, &bits, portMAX_DELAY);
+        // a drop is always older than a store: it only follows the first, cached connect
+        if (bits & NETCONN_CACHE_DROP)
+        {
+            WifiCache_clear();
+            WifiCache_withoutBssid();
+            esp_wifi_connect();
+        }
+        if (bits & NETCONN_CACHE_STORE)
+            WifiCache_store();
+    }
+}
+
+static void _event_handler(void *p_arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    netconn_cb_t p_cb;
+
+    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
+    {
+        esp_wifi_connect();
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        PersoBoot_stamp(PBOOT_WIFI_CONNECT);
+#ifdef CONFIG_OT_USE_STATIC_IP
+        _set_static_ip(p_arg);
+#endif
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        taskENTER_CRITICAL(&s_mux);
+        s_connected = false;
+        taskEXIT_CRITICAL(&s_mux);
+        xEventGroupClearBits(s_event_group, NETCONN_CONNECTED_BIT);
+        if (s_cached) {
+            // the cached AP is gone or moved: full scan, without spending a retry
+            ESP_LOGI(TAG, "direct connect failed, full scan");
+            s_cached = false;
+            xTaskNotify(s_cache_task, NETCONN_CACHE_DROP, eSetBits);
+        } else if (s_up || s_retry_num < WIFI_RETRY) {
+            esp_wifi_connect();
+            s_retry_num++;
+            ESP_LOGI(TAG, "retry to connect to the AP");
+        } else {
+            xEventGroupSetBits(s_event_group, NETCONN_FAIL_BIT);
+        }
+        ESP_LOGI(TAG,"connect to the AP fail");
+    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
+        PersoBoot_stamp(PBOOT_WIFI_IP);
+        ESP_LOGI(TAG, "got ip:" IPSTR " after %lld ms (%s)", IP2STR(&event->ip_info.ip), 
+                 (esp_timer_get_time() - s_start_us) / 1000, s_cached ? "cached AP" : "scan");
+        xTaskNotify(s_cache_task, NETCONN_CACHE_STORE, eSetBits);
+        s_retry_num = 0;
+        taskENTER_CRITICAL(&s_mux);
+        s_ip = *event;
+        s_up = true;
+        s_connected = true;
+        p_cb = s_cb;
+        taskEXIT_CRITICAL(&s_mux);
+        xEventGroupSetBits(s_event_group, NETCONN_CONNECTED_BIT);
+        if (p_cb != NULL)
+            p_cb(event);
+    }
+}
+
+//
+//      _restart()
+//      a start after a failed connect: the driver is up, try the AP again
+//
+static void _restart(void)
+{
+    if (xEventGroupGetBits(s_event_group) & NETCONN_FAIL_BIT)
+    {
+        ESP_LOGI(TAG, "reconnect to SSID:%s", WIFI_SSID);
+        s_retry_num = 0;
+        xEventGroupClearBits(s_event_group, NETCONN_FAIL_BIT);
+        s_start_us = esp_timer_get_time();
+        esp_wifi_connect();
+    }
+}
+
+//
+//      NetConn_start()
+//      bring up event loop, station netif and WiFi driver and connect to the configured 
+//      AP, the cached BSSID first (WifiCache). Does not wait for the IP, see NetConn_wait().
+//      Every later call keeps the running link; after a failed connect it starts a new 
+//      round of OT_MAXIMUM_RETRY attempts.
+//      @return:    success: NETCONN_OK
+//                  failure: NETCONN_ERR_INIT
+//
+int NetConn_start(void)
+{
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    esp_err_t err;
+
+    if (s_event_group != NULL)
+    {
+        _restart();
+        return NETCONN_OK;
+    }
+    s_event_group = xEventGroupCreate();
+    if (s_event_group == NULL)
+        return NETCONN_ERR_INIT;
+    if (xTaskCreatePinnedToCore(_cache_task, "netconn", NETCONN_TASK_STACK, NULL, NETCONN_TASK_PRIORITY, &s_cache_task, 
+                                PTASK_NET_CORE) != pdPASS)
+    {
+        ESP_LOGE(TAG, "failed to start the cache task");
+        return NETCONN_ERR_INIT;
+    }
+
+    if ((err = esp_netif_init()) != ESP_OK || (err = esp_event_loop_create_default()) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "netif / event loop init failed: %s", esp_err_to_name(err));
+        return NETCONN_ERR_INIT;
+    }
+    s_sta_netif = esp_netif_create_default_wifi_sta();
+    if (s_sta_netif == NULL || (err = esp_wifi_init(&cfg)) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "WiFi init failed");
+        return NETCONN_ERR_INIT;
+    }
+    if (esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &_event_handler, s_sta_netif, NULL) != ESP_OK ||
+        esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &_event_handler, s_sta_netif, NULL) != ESP_OK)
+        return NETCONN_ERR_INIT;
+
+    wifi_config_t wifi_config = {
+        .sta = {
+            .ssid = WIFI_SSID,
+            .password = WIFI_PW,
+        },
+    };
+    s_cached = (WifiCache_apply(&wifi_config) == ESP_OK);
+    // keep SSID/password and the derived PMK in flash: the driver skips the PBKDF2 on reconnect
+    if (esp_wifi_set_storage(WIFI_STORAGE_FLASH) != ESP_OK ||
+        esp_wifi_set_mode(WIFI_MODE_STA) != ESP_OK ||
+        esp_wifi_set_config(WIFI_IF_STA, &wifi_config) != ESP_OK)
+        return NETCONN_ERR_INIT;
+    s_start_us = esp_timer_get_time();
+    PersoBoot_stamp(PBOOT_WIFI_START);
+    if ((err = esp_wifi_start()) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "esp_wifi_start failed: %s", esp_err_to_name(err));
+        return NETCONN_ERR_INIT;
+    }
+    ESP_LOGI(TAG, "wifi_init_sta finished.");
+    return NETCONN_OK;
+}
+
+//
+//      NetConn_wait()
+//      wait for the IP of the station, or the end of the connect attempts
+//      @param  - [Input] ticks = maximum wait, portMAX_DELAY for no limit
+//      @return:    success: NETCONN_OK
+//                  failure: NETCONN_ERR_CONNECT, NETCONN_ERR_TIMEOUT, NETCONN_FAIL (not started)
+//
+int NetConn_wait(TickType_t ticks)
+{
+    EventBits_t bits;
+
+    if (s_event_group == NULL)
+        return NETCONN_FAIL;
+    bits = xEventGroupWaitBits(s_event_group, NETCONN_CONNECTED_BIT | NETCONN_FAIL_BIT, pdFALSE, pdFALSE, ticks);
+    if (bits & NETCONN_CONNECTED_BIT)
+    {
+        ESP_LOGI(TAG, "connected to ap SSID:%s", WIFI_SSID);
+        return NETCONN_OK;
+    }
+    if (bits & NETCONN_FAIL_BIT)
+    {
+        ESP_LOGI(TAG, "Failed to connect to SSID:%s", WIFI_SSID);
+        return NETCONN_ERR_CONNECT;
+    }
+    return NETCONN_ERR_TIMEOUT;
+}
+
+//
+//      NetConn_onGotIP()
+//      set the callback of the IP event, called from the event loop task on every 
+//      (re)connect. Is the station already up, it is called at once with the last 
+//      IP event, so a subscriber after the personalisation does not miss the IP.
+//      @param  - [Input] p_cb = callback, NULL removes it
+//
+void NetConn_onGotIP(netconn_cb_t p_cb)
+{
+    ip_event_got_ip_t ip;
+    bool up;
+
+    taskENTER_CRITICAL(&s_mux);
+    s_cb = p_cb;
+    up = s_connected;
+    ip = s_ip;
+    taskEXIT_CRITICAL(&s_mux);
+    if (up && p_cb != NULL)
+        p_cb(&ip);
+}
+
+//
+//      NetConn_connected()
+//      @return:    true, the station has an IP
+//
+bool NetConn_connected(void)
+{
+    return s_connected;
+}
@@ -0,0 +1,51 @@
+//
+//  NetConn.h
+//  Connectivity service of the device: one event loop, one station netif and one 
+//  association, brought up by the personalisation and kept by the application. 
+//  The perso to app hand over does not touch the link.
+//
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#ifndef __NETCONN_H__
+#define __NETCONN_H__
+
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+
+
+/***********      ERROR Codes    ************/
+#define NETCONN_OK                          0x0000                  // Everything ok      
+#define NETCONN_FAIL                        0xD300                  // Undefined Error; default Error
+#define NETCONN_ERR_INIT                    0xD301                  // netif, event loop or WiFi driver init failed
+#define NETCONN_ERR_CONNECT                 0xD302                  // no IP after OT_MAXIMUM_RETRY attempts
+#define NETCONN_ERR_TIMEOUT                 0xD303                  // no result within the wait time
+
+
+
+/***********      Type defintion        ************/
+
+// IP callback, pvParameter is the ip_event_got_ip_t of the event
+typedef void (*netconn_cb_t)(void *pvParameter);
+
+
+
+/***********      function declaration       ************/
+int NetConn_start(void);
+int NetConn_wait(TickType_t ticks);
+void NetConn_onGotIP(netconn_cb_t p_cb);
+bool NetConn_connected(void);
+
+
+
+#endif // __NETCONN_H__
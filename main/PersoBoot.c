@@ -0,0 +1,257 @@
+//
+//  PersoBoot.c
+//  Boot profiling. Two records live in RTC_NOINIT memory: this boot and the 
+//  previous one. A record is only taken over after a software reset (panic, 
+//  watchdog, esp_restart, deep sleep); a CRC guards against the random content 
+//  after power on. Every stamp keeps the first time a phase is reached.
+//
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#include "sdkconfig.h"
+#define LOG_LOCAL_LEVEL CONFIG_OT_LOG_LEVEL_PERSO
+
+#include "PersoBoot.h"
+
+#ifdef CONFIG_OT_BOOT_PROFILE
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#ifdef CONFIG_OT_BOOT_CONSOLE
+#include "esp_console.h"
+#endif
+
+
+/***********      Global definition       ************/
+#define PBOOT_LINE_SIZE         80
+
+static const char *TAG = "PersoBoot";
+
+static const char* s_names[PBOOT_PHASE_CNT] = {
+    "app_main", "nvs_init", "tp_mount", "tp_key", "rng_seed", "wifi_start", 
+    "wifi_connect", "wifi_ip", "first_tls", "perso_done", "ready"
+};
+
+RTC_NOINIT_ATTR static pboot_record_t s_rec[2];        // PBOOT_THIS, PBOOT_PREVIOUS
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+
+static uint32_t _crc(const pboot_record_t* p_rec)
+{
+    return esp_rom_crc32_le(0, (const uint8_t*) p_rec, offsetof(pboot_record_t, crc));
+}
+
+static bool _valid(const pboot_record_t* p_rec)
+{
+    return p_rec->magic == PBOOT_MAGIC && p_rec->crc == _crc(p_rec);
+}
+
+//
+//      PersoBoot_init()
+//      first call in app_main(): keep the record of the previous boot and start a new one
+//
+void PersoBoot_init(void)
+{
+    int64_t now = esp_timer_get_time();
+    esp_reset_reason_t reason = esp_reset_reason();
+    uint32_t boot = 1;
+
+    if (reason != ESP_RST_POWERON && reason != ESP_RST_BROWNOUT && _valid(&s_rec[PBOOT_THIS]))
+    {
+        memcpy(&s_rec[PBOOT_PREVIOUS], &s_rec[PBOOT_THIS], sizeof(pboot_record_t));
+        boot = s_rec[PBOOT_THIS].boot + 1;
+    }
+    else
+    {
+        memset(&s_rec[PBOOT_PREVIOUS], 0x00, sizeof(pboot_record_t));
+    }
+    memset(&s_rec[PBOOT_THIS], 0x00, sizeof(pboot_record_t));
+    s_rec[PBOOT_THIS].magic = PBOOT_MAGIC;
+    s_rec[PBOOT_THIS].boot = boot;
+    s_rec[PBOOT_THIS].reset_reason = reason;
+    s_rec[PBOOT_THIS].stamp_us[PBOOT_APP_MAIN] = now;
+    s_rec[PBOOT_THIS].crc = _crc(&s_rec[PBOOT_THIS]);
+}
+
+//
+//      PersoBoot_stamp()
+//      stamp a phase of this boot; callable from any task, only the first stamp counts
+//      @param  - [Input] phase = the reached phase
+//      @return:    true if this was the first stamp of the phase
+//
+bool PersoBoot_stamp(pboot_phase_t phase)
+{
+    int64_t now = esp_timer_get_time();
+    bool set = false;
+
+    if (phase >= PBOOT_PHASE_CNT)
+        return false;
+    taskENTER_CRITICAL(&s_mux);
+    if (s_rec[PBOOT_THIS].magic == PBOOT_MAGIC && s_rec[PBOOT_THIS].stamp_us[phase] == 0)
+    {
+        s_rec[PBOOT_THIS].stamp_us[phase] = now;
+        s_rec[PBOOT_THIS].crc = _crc(&s_rec[PBOOT_THIS]);
+        set = true;
+    }
+    taskEXIT_CRITICAL(&s_mux);
+    return set;
+}
+
+//
+//      PersoBoot_get()
+//      copy a boot record
+//      @param  - [Input] which = PBOOT_THIS or PBOOT_PREVIOUS
+//      @param  - [Output] p_rec = the record
+//      @return:    success: PBOOT_OK
+//                  failure: PBOOT_ERR_NONE
+//
+int PersoBoot_get(int which, pboot_record_t* p_rec)
+{
+    int ret = PBOOT_ERR_NONE;
+
+    if (which != PBOOT_THIS && which != PBOOT_PREVIOUS)
+        return PBOOT_ERR_NONE;
+    taskENTER_CRITICAL(&s_mux);
+    if (_valid(&s_rec[which]))
+    {
+        memcpy(p_rec, &s_rec[which], sizeof(pboot_record_t));
+        ret = PBOOT_OK;
+    }
+    taskEXIT_CRITICAL(&s_mux);
+    return ret;
+}
+
+//
+//      PersoBoot_name()
+//      name of a phase, as used in the dump and the metrics
+//
+const char* PersoBoot_name(pboot_phase_t phase)
+{
+    return (phase < PBOOT_PHASE_CNT) ? s_names[phase] : "unknown";
+}
+
+//
+//      _line()
+//      one phase of the dump: time since start and delta to the previous reached phase
+//      @return:    false if the phase was not reached
+//
+static bool _line(const pboot_record_t* p_rec, int phase, int64_t* p_last, char* p_buf, size_t size)
+{
+    int64_t us = p_rec->stamp_us[phase];
+
+    if (us == 0)
+        return false;
+    snprintf(p_buf, size, "  %-13s %9.1f ms  +%9.1f ms", s_names[phase], us / 1000.0, (us - *p_last) / 1000.0);
+    *p_last = us;
+    return true;
+}
+
+//
+//      PersoBoot_dump()
+//      log the record of this boot, and of the previous one if there is one
+//
+void PersoBoot_dump(void)
+{
+    pboot_record_t rec;
+    char line[PBOOT_LINE_SIZE];
+
+    for (int which = PBOOT_THIS; which <= PBOOT_PREVIOUS; which++)
+    {
+        int64_t last = 0;
+
+        if (PersoBoot_get(which, &rec) != PBOOT_OK)
+            continue;
+        ESP_LOGI(TAG, "%s boot #%" PRIu32 ", reset reason %" PRIu32 ":", which == PBOOT_THIS ? "this" : "previous", 
+                 rec.boot, rec.reset_reason);
+        for (int i = 0; i < PBOOT_PHASE_CNT; i++)
+            if (_line(&rec, i, &last, line, sizeof(line)))
+                ESP_LOGI(TAG, "%s", line);
+    }
+}
+
+
+
+/***********      Console       ************/
+#ifdef CONFIG_OT_BOOT_CONSOLE
+
+//
+//      _cmd_boot()
+//      console command "boot [prev]"
+//
+static int _cmd_boot(int argc, char** argv)
+{
+    int which = (argc > 1 && strcmp(argv[1], "prev") == 0) ? PBOOT_PREVIOUS : PBOOT_THIS;
+    pboot_record_t rec;
+    char line[PBOOT_LINE_SIZE];
+    int64_t last = 0;
+
+    if (PersoBoot_get(which, &rec) != PBOOT_OK)
+    {
+        printf("no record\n");
+        return 1;
+    }
+    printf("boot #%" PRIu32 ", reset reason %" PRIu32 "\n", rec.boot, rec.reset_reason);
+    for (int i = 0; i < PBOOT_PHASE_CNT; i++)
+        if (_line(&rec, i, &last, line, sizeof(line)))
+            printf("%s\n", line);
+    return 0;
+}
+
+//
+//      PersoBoot_console()
+//      start the UART console (REPL task) with the command "boot"
+//      @return:    success: PBOOT_OK
+//                  failure: PBOOT_ERR_CONSOLE
+//
+int PersoBoot_console(void)
+{
+    esp_console_repl_t *p_repl = NULL;
+    esp_console_repl_config_t repl_cnf = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
+    esp_console_dev_uart_config_t uart_cnf = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
+    const esp_console_cmd_t cmd = {
+        .command = "boot",
+        .help = "boot phase timing of this boot, 'boot prev' for the previous boot",
+        .hint = "[prev]",
+        .func = &_cmd_boot,
+    };
+
+    repl_cnf.prompt = "iotmate>";
+    if (esp_console_new_repl_uart(&uart_cnf, &repl_cnf, &p_repl) != ESP_OK ||
+        esp_console_cmd_register(&cmd) != ESP_OK ||
+        esp_console_start_repl(p_repl) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "failed to start the console");
+        return PBOOT_ERR_CONSOLE;
+    }
+    return PBOOT_OK;
+}
+
+#else
+
+int PersoBoot_console(void)
+{
+    return PBOOT_OK;
+}
+
+#endif // CONFIG_OT_BOOT_CONSOLE
+
+#endif // CONFIG_OT_BOOT_PROFILE
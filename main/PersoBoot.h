@@ -0,0 +1,94 @@
+//
+//  PersoBoot.h
+//  Boot profiling: the first esp_timer_get_time() of every boot phase is stamped 
+//  into RTC memory that survives a software reset, so the record of the previous 
+//  boot is still available after a reboot. Dumped to the log when the device is 
+//  ready, on request via the console command "boot" and in /v1/metrics.
+//  Without CONFIG_OT_BOOT_PROFILE the stamps compile to nothing.
+//
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#ifndef __PERSOBOOT_H__
+#define __PERSOBOOT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+
+/***********      Global definition       ************/
+#define PBOOT_MAGIC             0x50425431              // "PBT1"
+#define PBOOT_THIS              0                       // record of this boot
+#define PBOOT_PREVIOUS          1                       // record of the boot before (software reset only)
+
+
+
+/***********      ERROR Codes    ************/
+#define PBOOT_OK                            0x0000                  // Everything ok      
+#define PBOOT_FAIL                          0xC300                  // Undefined Error; default Error
+#define PBOOT_ERR_NONE                      0xC301                  // No record, e.g. previous boot after power on
+#define PBOOT_ERR_CONSOLE                   0xC302                  // Console could not be started
+
+
+
+/***********      Type defintion        ************/
+
+// boot phases, in the order of a personalisation boot
+typedef enum
+{
+    PBOOT_APP_MAIN = 0,                         // app_main() entered (ROM / 2nd stage bootloader not included)
+    PBOOT_NVS_INIT,
+    PBOOT_TP_MOUNT,                             // TrustStore SPIFFS mounted
+    PBOOT_TP_KEY,                               // TrustStore system key derived
+    PBOOT_RNG_SEED,                             // shared DRBG seeded
+    PBOOT_WIFI_START,
+    PBOOT_WIFI_CONNECT,                         // associated with the AP
+    PBOOT_WIFI_IP,
+    PBOOT_FIRST_TLS,                            // first TLS session of the HTTPS endpoint
+    PBOOT_PERSO_DONE,                           // espPerso() returned: personalised or skipped
+    PBOOT_READY,                                // application got its IP
+    PBOOT_PHASE_CNT
+} pboot_phase_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t boot;                              // boots since power on
+    uint32_t reset_reason;                      // esp_reset_reason() of this boot
+    int64_t  stamp_us[PBOOT_PHASE_CNT];         // 0 = phase not reached
+    uint32_t crc;                               // over the fields above
+} pboot_record_t;
+
+
+
+/***********      function declaration       ************/
+#ifdef CONFIG_OT_BOOT_PROFILE
+void PersoBoot_init(void);
+bool PersoBoot_stamp(pboot_phase_t phase);
+int PersoBoot_get(int which, pboot_record_t* p_rec);
+const char* PersoBoot_name(pboot_phase_t phase);
+void PersoBoot_dump(void);
+int PersoBoot_console(void);
+#else
+static inline void PersoBoot_init(void) { }
+static inline bool PersoBoot_stamp(pboot_phase_t phase) { return false; }
+static inline int PersoBoot_get(int which, pboot_record_t* p_rec) { return PBOOT_ERR_NONE; }
+static inline const char* PersoBoot_name(pboot_phase_t phase) { return ""; }
+static inline void PersoBoot_dump(void) { }
+static inline int PersoBoot_console(void) { return PBOOT_OK; }
+#endif
+
+
+
+#endif // __PERSOBOOT_H__
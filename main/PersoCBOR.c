@@ -0,0 +1,269 @@
+//
+//  PersoCBOR.c
+//  Minimal CBOR (RFC 8949) encoder and decoder for the personalisation 
+//  endpoints. The decoder walks the encoded map in place and returns pointers 
+//  into it, the encoder writes into a caller buffer; neither allocates.
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#include "PersoCBOR.h"
+#include <string.h>
+
+
+/***********      Decoder       ************/
+
+typedef struct
+{
+    const uint8_t *p;
+    const uint8_t *end;
+} pcbor_cur_t;
+
+//
+//      _head()
+//      read the initial byte and argument of a data item
+//      @param  - [Output] p_major = major type
+//      @param  - [Output] p_arg = argument (length, count or value)
+//      @return:    PCBOR_OK or PCBOR_ERR_SYNTAX (truncated, indefinite length, reserved)
+//
+static int _head(pcbor_cur_t* p_cur, uint8_t* p_major, uint64_t* p_arg)
+{
+    uint8_t ai;
+    size_t n;
+
+    if (p_cur->p >= p_cur->end)
+        return PCBOR_ERR_SYNTAX;
+    *p_major = *p_cur->p >> 5;
+    ai = *p_cur->p & 0x1F;
+    p_cur->p++;
+    if (ai < 24)
+    {
+        *p_arg = ai;
+        return PCBOR_OK;
+    }
+    if (ai > 27)
+        return PCBOR_ERR_SYNTAX;
+    n = (size_t) 1 << (ai - 24);
+    if ((size_t) (p_cur->end - p_cur->p) < n)
+        return PCBOR_ERR_SYNTAX;
+    *p_arg = 0;
+    while (n--)
+        *p_arg = (*p_arg << 8) | *p_cur->p++;
+    return PCBOR_OK;
+}
+
+static int _skip_item(pcbor_cur_t* p_cur, int depth)
+{
+    uint8_t major;
+    uint64_t arg;
+    int ret = _head(p_cur, &major, &arg);
+
+    if (ret != PCBOR_OK)
+        return ret;
+    switch (major)
+    {
+        case PCBOR_MAJOR_BYTES:
+        case PCBOR_MAJOR_TEXT:
+            if (arg > (uint64_t) (p_cur->end - p_cur->p))
+                return PCBOR_ERR_SYNTAX;
+            p_cur->p += arg;
+            return PCBOR_OK;
+        case PCBOR_MAJOR_MAP:
+            if (arg > SIZE_MAX / 2)
+                return PCBOR_ERR_SYNTAX;
+            arg *= 2;
+            /* fall through */
+        case PCBOR_MAJOR_ARRAY:
+            if (depth >= PCBOR_MAX_DEPTH)
+                return PCBOR_ERR_SYNTAX;
+            while (arg-- > 0)
+            {
+                if ((ret = _skip_item(p_cur, depth + 1)) != PCBOR_OK)
+                    return ret;
+            }
+            return PCBOR_OK;
+        case PCBOR_MAJOR_TAG:
+            if (depth >= PCBOR_MAX_DEPTH)
+                return PCBOR_ERR_SYNTAX;
+            return _skip_item(p_cur, depth + 1);
+        default:
+            // integers and simple values / floats carry their value in the head
+            return PCBOR_OK;
+    }
+}
+
+//
+//      pcbor_find()
+//      locate a member of the top level map by its text key
+//      @param  - [Input] p_cbor / len = the encoded map
+//      @param  - [Input] p_key = the member name
+//      @param  - [Input] major = expected major type (PCBOR_MAJOR_TEXT or _BYTES)
+//      @param  - [Output] pp_val / p_vallen = the string content inside p_cbor
+//      @return:    success: PCBOR_OK
+//                  failure: PCBOR_ERR_NOT_FOUND, PCBOR_ERR_SYNTAX, PCBOR_ERR_TYPE
+//
+int pcbor_find(const uint8_t* p_cbor, size_t len, const char* p_key, uint8_t major, const uint8_t** pp_val, size_t* p_vallen)
+{
+    pcbor_cur_t cur = { p_cbor, p_cbor + len };
+    size_t keylen = strlen(p_key);
+    uint8_t m;
+    uint64_t pairs, arg;
+    int ret;
+
+    if ((ret = _head(&cur, &m, &pairs)) != PCBOR_OK)
+        return ret;
+    if (m != PCBOR_MAJOR_MAP)
+        return PCBOR_ERR_SYNTAX;
+    while (pairs-- > 0)
+    {
+        const uint8_t *p_item = cur.p;
+        bool match = false;
+
+        if ((ret = _head(&cur, &m, &arg)) != PCBOR_OK)
+            return ret;
+        if (m == PCBOR_MAJOR_TEXT)
+        {
+            if (arg > (uint64_t) (cur.end - cur.p))
+                return PCBOR_ERR_SYNTAX;
+            match = (arg == keylen && memcmp(cur.p, p_key, keylen) == 0);
+            cur.p += arg;
+        }
+        else
+        {
+            // non text keys are skipped
+            cur.p = p_item;
+            if ((ret = _skip_item(&cur, 0)) != PCBOR_OK)
+                return ret;
+        }
+        if (!match)
+        {
+            if ((ret = _skip_item(&cur, 0)) != PCBOR_OK)
+                return ret;
+            continue;
+        }
+        if ((ret = _head(&cur, &m, &arg)) != PCBOR_OK)
+            return ret;
+        if (m != major)
+            return PCBOR_ERR_TYPE;
+        if (arg > (uint64_t) (cur.end - cur.p))
+            return PCBOR_ERR_SYNTAX;
+        *pp_val = cur.p;
+        *p_vallen = (size_t) arg;
+        return PCBOR_OK;
+    }
+    return PCBOR_ERR_NOT_FOUND;
+}
+
+//
+//      pcbor_get_text()
+//      copy a text string member into a NUL terminated buffer
+//
+int pcbor_get_text(const uint8_t* p_cbor, size_t len, const char* p_key, char* p_out, size_t outlen)
+{
+    const uint8_t *p_val;
+    size_t vallen;
+    int ret = pcbor_find(p_cbor, len, p_key, PCBOR_MAJOR_TEXT, &p_val, &vallen);
+
+    if (ret != PCBOR_OK)
+        return ret;
+    if (vallen >= outlen)
+        return PCBOR_ERR_BUFFER;
+    memcpy(p_out, p_val, vallen);
+    p_out[vallen] = 0x00;
+    return PCBOR_OK;
+}
+
+int pcbor_get_bytes(const uint8_t* p_cbor, size_t len, const char* p_key, const uint8_t** pp_val, size_t* p_vallen)
+{
+    return pcbor_find(p_cbor, len, p_key, PCBOR_MAJOR_BYTES, pp_val, p_vallen);
+}
+
+
+
+/***********      Encoder       ************/
+
+static void _put(pcbor_writer_t* p_w, const void* p_data, size_t len)
+{
+    if (p_w->err != PCBOR_OK)
+        return;
+    if (p_w->size - p_w->len < len)
+    {
+        p_w->err = PCBOR_ERR_BUFFER;
+        return;
+    }
+    memcpy(p_w->p_buf + p_w->len, p_data, len);
+    p_w->len += len;
+}
+
+static void _put_head(pcbor_writer_t* p_w, uint8_t major, uint64_t arg)
+{
+    uint8_t head[9];
+    size_t n;
+
+    if (arg < 24)
+    {
+        head[0] = (major << 5) | (uint8_t) arg;
+        _put(p_w, head, 1);
+        return;
+    }
+    if (arg <= 0xFF)
+        n = 1;
+    else if (arg <= 0xFFFF)
+        n = 2;
+    else if (arg <= 0xFFFFFFFF)
+        n = 4;
+    else
+        n = 8;
+    head[0] = (major << 5) | (n == 1 ? 24 : n == 2 ? 25 : n == 4 ? 26 : 27);
+    for (size_t i = 0; i < n; i++)
+        head[n - i] = (uint8_t) (arg >> (8 * i));
+    _put(p_w, head, n + 1);
+}
+
+void pcbor_init(pcbor_writer_t* p_w, uint8_t* p_buf, size_t size)
+{
+    p_w->p_buf = p_buf;
+    p_w->size = size;
+    p_w->len = 0;
+    p_w->err = PCBOR_OK;
+}
+
+//
+//      pcbor_map()
+//      start a map; the caller writes pairs * (key, value) items after it
+//
+void pcbor_map(pcbor_writer_t* p_w, size_t pairs)
+{
+    _put_head(p_w, PCBOR_MAJOR_MAP, pairs);
+}
+
+void pcbor_text(pcbor_writer_t* p_w, const char* p_text)
+{
+    size_t len = strlen(p_text);
+
+    _put_head(p_w, PCBOR_MAJOR_TEXT, len);
+    _put(p_w, p_text, len);
+}
+
+void pcbor_bytes(pcbor_writer_t* p_w, const uint8_t* p_data, size_t len)
+{
+    _put_head(p_w, PCBOR_MAJOR_BYTES, len);
+    _put(p_w, p_data, len);
+}
+
+void pcbor_int(pcbor_writer_t* p_w, int64_t value)
+{
+    if (value >= 0)
+        _put_head(p_w, PCBOR_MAJOR_UINT, (uint64_t) value);
+    else
+        _put_head(p_w, PCBOR_MAJOR_NINT, (uint64_t) (-1 - value));
+}
@@ -0,0 +1,78 @@
+//
+//  PersoCBOR.h
+//  Minimal CBOR (RFC 8949) encoder and decoder for the personalisation 
+//  endpoints. Only what the flat request and response maps need: definite 
+//  length items, text and byte string members, unsigned and negative integers.
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#ifndef __PERSOCBOR_H__
+#define __PERSOCBOR_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/***********      Global definition       ************/
+#define PCBOR_CONTENT_TYPE      "application/cbor"
+#define PCBOR_MAX_DEPTH         4               // nesting skipped while searching a member
+
+#define PCBOR_MAJOR_UINT        0
+#define PCBOR_MAJOR_NINT        1
+#define PCBOR_MAJOR_BYTES       2
+#define PCBOR_MAJOR_TEXT        3
+#define PCBOR_MAJOR_ARRAY       4
+#define PCBOR_MAJOR_MAP         5
+#define PCBOR_MAJOR_TAG         6
+#define PCBOR_MAJOR_SIMPLE      7
+
+
+
+/***********      ERROR Codes    ************/
+#define PCBOR_OK                0x0000          // Everything ok      
+#define PCBOR_FAIL              0xA300          // Undefined Error; default Error
+#define PCBOR_ERR_NOT_FOUND     0xA301          // Member not found
+#define PCBOR_ERR_SYNTAX        0xA302          // Malformed or unsupported (indefinite length) CBOR
+#define PCBOR_ERR_TYPE          0xA303          // Member has another major type
+#define PCBOR_ERR_BUFFER        0xA304          // Output buffer too small
+
+
+
+/***********      Type defintion        ************/
+
+typedef struct
+{
+    uint8_t *p_buf;
+    size_t size;
+    size_t len;                                 // bytes written
+    int err;                                    // first error, later writes are dropped
+} pcbor_writer_t;
+
+
+
+/***********      function declaration       ************/
+
+int pcbor_find(const uint8_t* p_cbor, size_t len, const char* p_key, uint8_t major, const uint8_t** pp_val, size_t* p_vallen);
+int pcbor_get_text(const uint8_t* p_cbor, size_t len, const char* p_key, char* p_out, size_t outlen);
+int pcbor_get_bytes(const uint8_t* p_cbor, size_t len, const char* p_key, const uint8_t** pp_val, size_t* p_vallen);
+
+void pcbor_init(pcbor_writer_t* p_w, uint8_t* p_buf, size_t size);
+void pcbor_map(pcbor_writer_t* p_w, size_t pairs);
+void pcbor_text(pcbor_writer_t* p_w, const char* p_text);
+void pcbor_bytes(pcbor_writer_t* p_w, const uint8_t* p_data, size_t len);
+void pcbor_int(pcbor_writer_t* p_w, int64_t value);
+
+
+
+#endif // __PERSOCBOR_H__
@@ -0,0 +1,426 @@
+//
+//  PersoJSON.c
+//  Allocation free JSON handling for the personalisation REST endpoints.
+//  The request bodies are flat objects with a handful of string members, the 
+//  responses are flat objects as well. Instead of building a cJSON tree the 
+//  tokenizer walks the body once per member and the writer streams the 
+//  response in small chunks; neither allocates from the heap.
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.  
+
+#include "PersoJSON.h"
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+
+/***********      Tokenizer       ************/
+
+typedef struct
+{
+    const char *p;
+    const char *end;
+} pjson_cur_t;
+
+static void _skip_ws(pjson_cur_t* p_cur)
+{
+    while (p_cur->p < p_cur->end && (*p_cur->p == ' ' || *p_cur->p == '\t' || *p_cur->p == '\r' || *p_cur->p == '\n'))
+        p_cur->p++;
+}
+
+//
+//      _scan_string()
+//      cursor on the opening quote; moves behind the closing quote
+//      @param  - [Output] pp_raw / p_rawlen = the (still escaped) content between the quotes
+//
+static int _scan_string(pjson_cur_t* p_cur, const char** pp_raw, size_t* p_rawlen)
+{
+    const char *start;
+
+    if (p_cur->p >= p_cur->end || *p_cur->p != '"')
+        return PJSON_ERR_SYNTAX;
+    start = ++p_cur->p;
+    while (p_cur->p < p_cur->end && *p_cur->p != '"')
+    {
+        if (*p_cur->p == '\\')
+            p_cur->p++;
+        p_cur->p++;
+    }
+    if (p_cur->p >= p_cur->end)
+        return PJSON_ERR_SYNTAX;
+    *pp_raw = start;
+    *p_rawlen = p_cur->p - start;
+    p_cur->p++;
+    return PJSON_OK;
+}
+
+//
+//      _skip_value()
+//      move the cursor behind any value; nested objects / arrays are skipped by depth counting
+//
+static int _skip_value(pjson_cur_t* p_cur)
+{
+    const char *p_raw;
+    size_t rawlen;
+    int depth = 0;
+
+    do
+    {
+        _skip_ws(p_cur);
+        if (p_cur->p >= p_cur->end)
+            return PJSON_ERR_SYNTAX;
+        switch (*p_cur->p)
+        {
+            case '"':
+                if (_scan_string(p_cur, &p_raw, &rawlen) != PJSON_OK)
+                    return PJSON_ERR_SYNTAX;
+                break;
+            case '{':
+            case '[':
+                depth++;
+                p_cur->p++;
+                break;
+            case '}':
+            case ']':
+                if (depth == 0)
+                    return PJSON_ERR_SYNTAX;
+                depth--;
+                p_cur->p++;
+                break;
+            default:
+                // number, literal, ',' or ':' inside a nested value
+                p_cur->p++;
+                while (depth == 0 && p_cur->p < p_cur->end && strchr(",}] \t\r\n", *p_cur->p) == NULL)
+                    p_cur->p++;
+                break;
+        }
+    } while (depth > 0);
+    return PJSON_OK;
+}
+
+//
+//      pjson_find()
+//      locate a top level string member 
+//      @param  - [Input] p_json / len = the JSON document, need not be NUL terminated
+//      @param  - [Input] p_key = member name (compared unescaped)
+//      @param  - [Output] pp_raw / p_rawlen = escaped string content within p_json
+//      @return:    success: PJSON_OK
+//                  failure: PJSON_ERR_NOT_FOUND, PJSON_ERR_SYNTAX, PJSON_ERR_TYPE
+//
+int pjson_find(const char* p_json, size_t len, const char* p_key, const char** pp_raw, size_t* p_rawlen)
+{
+    pjson_cur_t cur = { p_json, p_json + len };
+    size_t keylen = strlen(p_key);
+
+    _skip_ws(&cur);
+    if (cur.p >= cur.end || *cur.p != '{')
+        return PJSON_ERR_SYNTAX;
+    cur.p++;
+    while (1)
+    {
+        const char *p_name;
+        size_t namelen;
+
+        _skip_ws(&cur);
+        if (cur.p < cur.end && *cur.p == '}')
+            return PJSON_ERR_NOT_FOUND;
+        if (_scan_string(&cur, &p_name, &namelen) != PJSON_OK)
+            return PJSON_ERR_SYNTAX;
+        _skip_ws(&cur);
+        if (cur.p >= cur.end || *cur.p != ':')
+            return PJSON_ERR_SYNTAX;
+        cur.p++;
+        _skip_ws(&cur);
+        if (namelen == keylen && memcmp(p_name, p_key, keylen) == 0)
+        {
+            if (cur.p >= cur.end || *cur.p != '"')
+                return PJSON_ERR_TYPE;
+            return _scan_string(&cur, pp_raw, p_rawlen);
+        }
+        if (_skip_value(&cur) != PJSON_OK)
+            return PJSON_ERR_SYNTAX;
+        _skip_ws(&cur);
+        if (cur.p < cur.end && *cur.p == ',')
+            cur.p++;
+        else if (cur.p < cur.end && *cur.p == '}')
+            return PJSON_ERR_NOT_FOUND;
+        else
+            return PJSON_ERR_SYNTAX;
+    }
+}
+
+static int _hex4(const char* p, uint32_t* p_val)
+{
+    *p_val = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        char c = p[i];
+        *p_val <<= 4;
+        if (c >= '0' && c <= '9')       *p_val |= c - '0';
+        else if (c >= 'a' && c <= 'f')  *p_val |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')  *p_val |= c - 'A' + 10;
+        else return PJSON_ERR_SYNTAX;
+    }
+    return PJSON_OK;
+}
+
+//
+//      pjson_unescape()
+//      decode the escapes of a raw string into p_out and NUL terminate it. p_out may be 
+//      p_raw (in place decoding), the output is never longer than the input.
+//      \uXXXX is decoded to UTF-8 including surrogate pairs.
+//      @return:    success: PJSON_OK
+//                  failure: PJSON_ERR_SYNTAX, PJSON_ERR_BUFFER
+//
+int pjson_unescape(const char* p_raw, size_t rawlen, char* p_out, size_t outlen, size_t* p_olen)
+{
+    const char *p = p_raw;
+    const char *end = p_raw + rawlen;
+    size_t o = 0;
+
+    while (p < end)
+    {
+        uint32_t cp;
+        char c = *p++;
+
+        if (c != '\\')
+        {
+            if (o + 1 >= outlen)
+                return PJSON_ERR_BUFFER;
+            p_out[o++] = c;
+            continue;
+        }
+        if (p >= end)
+            return PJSON_ERR_SYNTAX;
+        c = *p++;
+        switch (c)
+        {
+            case '"':  cp = '"';  break;
+            case '\\': cp = '\\'; break;
+            case '/':  cp = '/';  break;
+            case 'b':  cp = '\b'; break;
+            case 'f':  cp = '\f'; break;
+            case 'n':  cp = '\n'; break;
+            case 'r':  cp = '\r'; break;
+            case 't':  cp = '\t'; break;
+            case 'u':
+                if (end - p < 4 || _hex4(p, &cp) != PJSON_OK)
+                    return PJSON_ERR_SYNTAX;
+                p += 4;
+                if (cp >= 0xD800 && cp <= 0xDBFF)
+                {
+                    uint32_t lo;
+                    if (end - p < 6 || p[0] != '\\' || p[1] != 'u' || _hex4(p + 2, &lo) != PJSON_OK || lo < 0xDC00 || lo > 0xDFFF)
+                        return PJSON_ERR_SYNTAX;
+                    p += 6;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                }
+                break;
+            default:
+                return PJSON_ERR_SYNTAX;
+        }
+        // UTF-8 encode; never longer than the escape sequence it replaces
+        size_t need = (cp < 0x80) ? 1 : (cp < 0x800) ? 2 : (cp < 0x10000) ? 3 : 4;
+        if (o + need >= outlen)
+            return PJSON_ERR_BUFFER;
+        if (cp < 0x80)
+            p_out[o++] = (char) cp;
+        else if (cp < 0x800)
+        {
+            p_out[o++] = (char)(0xC0 | (cp >> 6));
+            p_out[o++] = (char)(0x80 | (cp & 0x3F));
+        }
+        else if (cp < 0x10000)
+        {
+            p_out[o++] = (char)(0xE0 | (cp >> 12));
+            p_out[o++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            p_out[o++] = (char)(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            p_out[o++] = (char)(0xF0 | (cp >> 18));
+            p_out[o++] = (char)(0x80 | ((cp >> 12) & 0x3F));
+            p_out[o++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            p_out[o++] = (char)(0x80 | (cp & 0x3F));
+        }
+    }
+    p_out[o] = 0x00;
+    if (p_olen != NULL)
+        *p_olen = o;
+    return PJSON_OK;
+}
+
+//
+//      pjson_get_string()
+//      copy the unescaped value of a top level string member into a fixed buffer
+//      @return:    success: PJSON_OK
+//                  failure: see pjson_find() / pjson_unescape()
+//
+int pjson_get_string(const char* p_json, size_t len, const char* p_key, char* p_out, size_t outlen)
+{
+    const char *p_raw;
+    size_t rawlen;
+    int ret = pjson_find(p_json, len, p_key, &p_raw, &rawlen);
+
+    if (ret != PJSON_OK)
+        return ret;
+    return pjson_unescape(p_raw, rawlen, p_out, outlen, NULL);
+}
+
+
+
+/***********      Writer       ************/
+
+static void _flush(pjson_writer_t* p_w)
+{
+    if (p_w->len > 0 && p_w->err == ESP_OK)
+    {
+        if (p_w->p_out == NULL)
+            p_w->err = httpd_resp_send_chunk(p_w->req, p_w->buf, p_w->len);
+        else if (p_w->olen + p_w->len < p_w->outlen)
+        {
+            memcpy(p_w->p_out + p_w->olen, p_w->buf, p_w->len);
+            p_w->olen += p_w->len;
+        }
+        else
+            p_w->err = ESP_ERR_NO_MEM;
+    }
+    p_w->len = 0;
+}
+
+static void _put(pjson_writer_t* p_w, const char* p_data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = sizeof(p_w->buf) - p_w->len;
+        if (n == 0)
+        {
+            _flush(p_w);
+            continue;
+        }
+        if (n > len)
+            n = len;
+        memcpy(p_w->buf + p_w->len, p_data, n);
+        p_w->len += n;
+        p_data += n;
+        len -= n;
+    }
+}
+
+static void _put_string(pjson_writer_t* p_w, const char* p_str)
+{
+    char esc[8];
+
+    _put(p_w, "\"", 1);
+    for (const char *p = p_str; *p; p++)
+    {
+        unsigned char c = (unsigned char) *p;
+        if (c == '"' || c == '\\')
+        {
+            esc[0] = '\\';
+            esc[1] = (char) c;
+            _put(p_w, esc, 2);
+        }
+        else if (c == '\n')
+            _put(p_w, "\\n", 2);
+        else if (c == '\r')
+            _put(p_w, "\\r", 2);
+        else if (c < 0x20)
+        {
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            _put(p_w, esc, 6);
+        }
+        else
+            _put(p_w, p, 1);
+    }
+    _put(p_w, "\"", 1);
+}
+
+static void _put_key(pjson_writer_t* p_w, const char* p_key)
+{
+    if (!p_w->first)
+        _put(p_w, ",", 1);
+    p_w->first = false;
+    _put_string(p_w, p_key);
+    _put(p_w, ":", 1);
+}
+
+//
+//      pjson_begin()
+//      start a JSON object response on req
+//
+void pjson_begin(pjson_writer_t* p_w, httpd_req_t* req)
+{
+    p_w->req = req;
+    p_w->p_out = NULL;
+    p_w->outlen = 0;
+    p_w->olen = 0;
+    p_w->len = 0;
+    p_w->first = true;
+    p_w->err = ESP_OK;
+    httpd_resp_set_type(req, "application/json");
+    _put(p_w, "{", 1);
+}
+
+//
+//      pjson_begin_buf()
+//      start a JSON object in a caller buffer, e.g. for a WebSocket frame. 
+//      pjson_end() NUL terminates it; p_w->olen is the length without the NUL.
+//
+void pjson_begin_buf(pjson_writer_t* p_w, char* p_out, size_t outlen)
+{
+    p_w->req = NULL;
+    p_w->p_out = p_out;
+    p_w->outlen = outlen;
+    p_w->olen = 0;
+    p_w->len = 0;
+    p_w->first = true;
+    p_w->err = ESP_OK;
+    _put(p_w, "{", 1);
+}
+
+void pjson_str(pjson_writer_t* p_w, const char* p_key, const char* p_value)
+{
+    _put_key(p_w, p_key);
+    _put_string(p_w, p_value);
+}
+
+void pjson_num(pjson_writer_t* p_w, const char* p_key, int64_t value)
+{
+    char num[24];
+    int n = snprintf(num, sizeof(num), "%" PRId64, value);
+
+    _put_key(p_w, p_key);
+    _put(p_w, num, n);
+}
+
+//
+//      pjson_end()
+//      close the object, flush and terminate the chunked response (or the buffer)
+//      @return:    ESP_OK, ESP_ERR_NO_MEM for a too small buffer or the first error 
+//                  of httpd_resp_send_chunk()
+//
+esp_err_t pjson_end(pjson_writer_t* p_w)
+{
+    _put(p_w, "}", 1);
+    _flush(p_w);
+    if (p_w->p_out != NULL)
+    {
+        if (p_w->outlen > 0)
+            p_w->p_out[p_w->err == ESP_OK ? p_w->olen : 0] = 0x00;
+        return p_w->err;
+    }
+    if (p_w->err == ESP_OK)
+        p_w->err = httpd_resp_send_chunk(p_w->req, NULL, 0);
+    return p_w->err;
+}
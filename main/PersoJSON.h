@@ -0,0 +1,76 @@
+//
+//  PersoJSON.h
+//  Allocation free JSON handling for the personalisation REST endpoints
+//  - pull tokenizer: finds top level string members and copies / unescapes 
+//    them into caller provided buffers 
+//  - writer: streams a flat JSON object into httpd_resp_send_chunk()
+//
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#ifndef __PERSOJSON_H__
+#define __PERSOJSON_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+
+/***********      Global definition       ************/
+#define PJSON_CHUNK_SIZE        128             // writer buffer, flushed as one HTTP chunk
+
+
+
+/***********      ERROR Codes    ************/
+#define PJSON_OK                0x0000          // Everything ok      
+#define PJSON_FAIL              0x8300          // Undefined Error; default Error
+#define PJSON_ERR_NOT_FOUND     0x8301          // Member not found
+#define PJSON_ERR_SYNTAX        0x8302          // Malformed JSON
+#define PJSON_ERR_TYPE          0x8303          // Member is not a string
+#define PJSON_ERR_BUFFER        0x8304          // Output buffer too small
+
+
+
+/***********      Type defintion        ************/
+
+typedef struct
+{
+    httpd_req_t *req;                           // chunked response, or
+    char *p_out;                                // caller buffer (pjson_begin_buf)
+    size_t outlen;
+    size_t olen;                                // bytes written to p_out
+    char buf[PJSON_CHUNK_SIZE];
+    size_t len;
+    bool first;                                 // no member written yet
+    esp_err_t err;                              // first send error, later writes are dropped
+} pjson_writer_t;
+
+
+
+/***********      function declaration       ************/
+
+int pjson_find(const char* p_json, size_t len, const char* p_key, const char** pp_raw, size_t* p_rawlen);
+int pjson_unescape(const char* p_raw, size_t rawlen, char* p_out, size_t outlen, size_t* p_olen);
+int pjson_get_string(const char* p_json, size_t len, const char* p_key, char* p_out, size_t outlen);
+
+void pjson_begin(pjson_writer_t* p_w, httpd_req_t* req);
+void pjson_begin_buf(pjson_writer_t* p_w, char* p_out, size_t outlen);
+void pjson_str(pjson_writer_t* p_w, const char* p_key, const char* p_value);
+void pjson_num(pjson_writer_t* p_w, const char* p_key, int64_t value);
+esp_err_t pjson_end(pjson_writer_t* p_w);
+
+
+
+#endif // __PERSOJSON_H__
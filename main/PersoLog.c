@@ -0,0 +1,151 @@
+//
+//  PersoLog.c
+//  Deferred binary logging. The ring holds fixed size entries (time, tag, 
+//  format pointer, arguments) under a spinlock; the drain task formats them 
+//  with the time of the record and writes them through esp_log_write(). 
+//  A full ring drops the newest entries and reports the count.
+//
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#include "sdkconfig.h"
+#define LOG_LOCAL_LEVEL CONFIG_OT_LOG_LEVEL_PERSO
+
+#include "PersoLog.h"
+
+#ifdef CONFIG_OT_PLOG_DEFERRED
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "PersoTasks.h"
+
+
+/***********      Global definition       ************/
+#define PLOG_ENTRIES            CONFIG_OT_PLOG_ENTRIES
+#define PLOG_TASK_PRIORITY      CONFIG_OT_PLOG_TASK_PRIORITY
+#define PLOG_TASK_STACK         PTASK_PLOG_STACK
+#define PLOG_FLUSH_MS           200             // drain period without notification
+#define PLOG_LINE_SIZE          192
+
+typedef struct
+{
+    int64_t us;
+    const char *p_tag;
+    const char *p_fmt;
+    uint32_t args[PLOG_MAX_ARGS];
+} plog_entry_t;
+
+static const char *TAG = "PersoLog";
+
+static plog_entry_t s_ring[PLOG_ENTRIES];
+static uint32_t s_head = 0;                     // next write
+static uint32_t s_tail = 0;                     // next read
+static uint32_t s_dropped = 0;
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t s_task = NULL;
+
+
+
+//
+//      PersoLog_record()
+//      store one entry; called by PLOG(), never blocks
+//      @param  - [Input] p_tag / p_fmt = string literals
+//      @param  - [Input] p_args / argc = integer arguments, argc <= PLOG_MAX_ARGS
+//
+void PersoLog_record(const char* p_tag, const char* p_fmt, const uint32_t* p_args, size_t argc)
+{
+    int64_t now = esp_timer_get_time();
+    bool stored = false;
+
+    taskENTER_CRITICAL(&s_mux);
+    if (s_head - s_tail < PLOG_ENTRIES)
+    {
+        plog_entry_t *p_e = &s_ring[s_head % PLOG_ENTRIES];
+        p_e->us = now;
+        p_e->p_tag = p_tag;
+        p_e->p_fmt = p_fmt;
+        memset(p_e->args, 0x00, sizeof(p_e->args));
+        memcpy(p_e->args, p_args, argc * sizeof(uint32_t));
+        s_head++;
+        stored = true;
+    }
+    else
+    {
+        s_dropped++;
+    }
+    taskEXIT_CRITICAL(&s_mux);
+    // wakes the low priority task, no preemption of the caller
+    if (stored && s_task != NULL)
+        xTaskNotifyGive(s_task);
+}
+
+//
+//      PersoLog_flush()
+//      format and print all recorded entries in the calling task, e.g. before a fault stop
+//
+void PersoLog_flush(void)
+{
+    plog_entry_t e;
+    char line[PLOG_LINE_SIZE];
+    uint32_t dropped;
+
+    for (;;)
+    {
+        taskENTER_CRITICAL(&s_mux);
+        bool empty = (s_head == s_tail);
+        if (!empty)
+            memcpy(&e, &s_ring[s_tail++ % PLOG_ENTRIES], sizeof(e));
+        dropped = s_dropped;
+        s_dropped = 0;
+        taskEXIT_CRITICAL(&s_mux);
+        if (dropped != 0)
+            ESP_LOGW(TAG, "%u entries dropped, ring full", (unsigned) dropped);
+        if (empty)
+            break;
+        // unused arguments are 0 and ignored by the format
+        snprintf(line, sizeof(line), e.p_fmt, e.args[0], e.args[1], e.args[2], e.args[3]);
+        esp_log_write(ESP_LOG_INFO, e.p_tag, LOG_FORMAT(I, "%s"), (uint32_t) (e.us / 1000), e.p_tag, line);
+    }
+}
+
+static void _drain_task(void* p_arg)
+{
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PLOG_FLUSH_MS));
+        PersoLog_flush();
+    }
+}
+
+//
+//      PersoLog_start()
+//      start the drain task; entries recorded before are kept and printed then
+//      @return:    success: PLOG_OK
+//                  failure: PLOG_ERR_TASK
+//
+int PersoLog_start(void)
+{
+    if (s_task != NULL)
+        return PLOG_OK;
+    if (xTaskCreatePinnedToCore(_drain_task, "plog", PLOG_TASK_STACK, NULL, PLOG_TASK_PRIORITY, &s_task, PTASK_NET_CORE) != pdPASS)
+    {
+        ESP_LOGE(TAG, "failed to start the drain task");
+        return PLOG_ERR_TASK;
+    }
+    return PLOG_OK;
+}
+
+#endif // CONFIG_OT_PLOG_DEFERRED
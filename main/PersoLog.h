@@ -0,0 +1,71 @@
+//
+//  PersoLog.h
+//  Deferred binary logging for the hot paths of the personalisation. PLOG() 
+//  records the format string pointer (its ID) and up to PLOG_MAX_ARGS integer 
+//  arguments into a ring buffer; a low priority task formats and prints them. 
+//  The request path no longer waits for the UART. 
+//  Without CONFIG_OT_PLOG_DEFERRED PLOG() is an ESP_LOGI().
+//
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#ifndef __PERSOLOG_H__
+#define __PERSOLOG_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "esp_log.h"
+
+
+/***********      Global definition       ************/
+#define PLOG_MAX_ARGS           4
+
+
+
+/***********      ERROR Codes    ************/
+#define PLOG_OK                 0x0000          // Everything ok      
+#define PLOG_FAIL               0xB300          // Undefined Error; default Error
+#define PLOG_ERR_TASK           0xB301          // Drain task not started
+
+
+
+/***********      function declaration       ************/
+#ifdef CONFIG_OT_PLOG_DEFERRED
+int PersoLog_start(void);
+void PersoLog_flush(void);
+void PersoLog_record(const char* p_tag, const char* p_fmt, const uint32_t* p_args, size_t argc);
+
+//
+// PLOG(tag, fmt, ...)
+// fmt and tag must be string literals (the pointer is stored), the arguments integers of 
+// at most 32 bit (%d, %u, %x); no %s, no 64 bit values. Recorded with the current time.
+//
+#define PLOG(tag, fmt, ...)                                                     \
+    do                                                                          \
+    {                                                                           \
+        const uint32_t __plog_args[] = { 0, ##__VA_ARGS__ };                    \
+        _Static_assert(sizeof(__plog_args) / sizeof(uint32_t) - 1 <= PLOG_MAX_ARGS, \
+                       "PLOG: too many arguments");                             \
+        PersoLog_record((tag), (fmt), __plog_args + 1,                          \
+                        sizeof(__plog_args) / sizeof(uint32_t) - 1);            \
+    } while (0)
+#else
+static inline int PersoLog_start(void) { return PLOG_OK; }
+static inline void PersoLog_flush(void) { }
+#define PLOG(tag, fmt, ...)     ESP_LOGI(tag, fmt, ##__VA_ARGS__)
+#endif
+
+
+
+#endif // __PERSOLOG_H__
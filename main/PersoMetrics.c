@@ -0,0 +1,395 @@
+//
+//  PersoMetrics.c
+//  Lightweight metrics of the personalisation. The probes only increment
+//  counters under a spinlock; the text export takes a snapshot and streams it
+//  through httpd_resp_send_chunk(), line by line.
+//
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#include "sdkconfig.h"
+#define LOG_LOCAL_LEVEL CONFIG_OT_LOG_LEVEL_PERSO
+
+#include "PersoMetrics.h"
+#include "PersoBoot.h"
+
+#ifdef CONFIG_OT_PERSO_METRICS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/param.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#ifdef CONFIG_OT_PERSO_JSON_BENCH
+#include "freertos/semphr.h"
+#include "cJSON.h"
+#endif
+
+
+/***********      Global definition       ************/
+#define PMETRIC_LINE_SIZE       160
+
+typedef struct
+{
+    uint32_t bucket[PMETRIC_BUCKETS + 1];       // per bucket, the last one is +Inf
+    uint32_t count;
+    int64_t sum_us;
+} pmetric_histogram_t;
+
+typedef struct
+{
+    uint32_t ops;
+    uint32_t errors;
+    uint64_t bytes;
+} pmetric_io_t;
+
+typedef struct
+{
+    uint32_t count;
+    int64_t sum_us;
+    uint64_t allocs;
+    uint64_t bytes;                             // allocated bytes, frees are not subtracted
+} pmetric_parse_t;
+
+// bucket upper bounds (us): 1 ms .. 120 s, the keygen takes seconds to minutes
+static const int64_t s_bounds_us[PMETRIC_BUCKETS] = {
+    1000, 5000, 10000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 30000000, 120000000
+};
+
+static const char* s_hist_names[PMETRIC_HIST_CNT][2] = {
+    { "perso_http_request_seconds", "uri=\"/v1/DevID/status\"" },
+    { "perso_http_request_seconds", "uri=\"/v1/DevID/genCSR\"" },
+    { "perso_http_request_seconds", "uri=\"/v1/DevID/DevIDfinal\"" },
+    { "perso_http_request_seconds", "uri=\"/v2/DevID/session\"" },
+    { "perso_http_request_seconds", "uri=\"/v1/metrics\"" },
+    { "perso_devid_op_seconds",     "op=\"keygen\"" },
+    { "perso_devid_op_seconds",     "op=\"parse\"" },
+    { "perso_devid_op_seconds",     "op=\"sign\"" },
+    { "perso_devid_op_seconds",     "op=\"store\"" },
+};
+
+static const char* s_tp_names[PMETRIC_TP_CNT] = { "read", "write" };
+static const char* s_json_names[PMETRIC_JSON_CNT] = { "pjson", "cjson" };
+
+static pmetric_histogram_t s_hist[PMETRIC_HIST_CNT];
+static pmetric_io_t s_tp[PMETRIC_TP_CNT];
+static pmetric_parse_t s_json[PMETRIC_JSON_CNT];
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+
+//
+//      PersoMetrics_observe()
+//      add a latency to a histogram; callable from any task
+//      @param  - [Input] hist = the histogram
+//      @param  - [Input] us = latency in microseconds
+//
+void PersoMetrics_observe(pmetric_hist_t hist, int64_t us)
+{
+    int i = 0;
+
+    if (hist >= PMETRIC_HIST_CNT)
+        return;
+    while (i < PMETRIC_BUCKETS && us > s_bounds_us[i])
+        i++;
+    taskENTER_CRITICAL(&s_mux);
+    s_hist[hist].bucket[i]++;
+    s_hist[hist].count++;
+    s_hist[hist].sum_us += us;
+    taskEXIT_CRITICAL(&s_mux);
+}
+
+//
+//      PersoMetrics_tpIO()
+//      count one TrustPlatform file operation
+//      @param  - [Input] dir = read or write
+//      @param  - [Input] bytes = plain text bytes of the operation
+//      @param  - [Input] ok = false counts an error (no bytes)
+//
+void PersoMetrics_tpIO(pmetric_tp_t dir, size_t bytes, bool ok)
+{
+    if (dir >= PMETRIC_TP_CNT)
+        return;
+    taskENTER_CRITICAL(&s_mux);
+    s_tp[dir].ops++;
+    if (ok)
+        s_tp[dir].bytes += bytes;
+    else
+        s_tp[dir].errors++;
+    taskEXIT_CRITICAL(&s_mux);
+}
+
+
+//
+//      PersoMetrics_json()
+//      count one request body parse
+//      @param  - [Input] parser = the parser
+//      @param  - [Input] us = parse time in microseconds
+//      @param  - [Input] allocs = heap allocations of the parse
+//      @param  - [Input] bytes = bytes of these allocations
+//
+void PersoMetrics_json(pmetric_json_t parser, int64_t us, uint32_t allocs, uint32_t bytes)
+{
+    if (parser >= PMETRIC_JSON_CNT)
+        return;
+    taskENTER_CRITICAL(&s_mux);
+    s_json[parser].count++;
+    s_json[parser].sum_us += us;
+    s_json[parser].allocs += allocs;
+    s_json[parser].bytes += bytes;
+    taskEXIT_CRITICAL(&s_mux);
+}
+
+#ifdef CONFIG_OT_PERSO_JSON_BENCH
+// the cJSON hooks are global: one bench at a time (genCSR on the crypto worker, 
+// DevIDfinal on the httpd task)
+static SemaphoreHandle_t s_bench_lock = NULL;
+static StaticSemaphore_t s_bench_lock_buf;
+static uint32_t s_bench_allocs;
+static uint32_t s_bench_bytes;
+
+static void* _bench_malloc(size_t size)
+{
+    s_bench_allocs++;
+    s_bench_bytes += size;
+    return malloc(size);
+}
+
+//
+//      PersoMetrics_cjsonBench()
+//      parse a JSON body once more the way the handlers did before PersoJSON: 
+//      cJSON_Parse(), cJSON_GetObjectItem() per member, cJSON_Delete(). Time and heap 
+//      allocations go to the cjson parser metrics. Call it before an in place 
+//      pjson_unescape() of the body.
+//      @param  - [Input] p_body = request body
+//      @param  - [Input] len = body length
+//      @param  - [Input] pp_keys = members the handler reads, NULL terminated
+//
+void PersoMetrics_cjsonBench(const char* p_body, size_t len, const char* const* pp_keys)
+{
+    cJSON_Hooks hooks = { .malloc_fn = _bench_malloc, .free_fn = free };
+    cJSON *p_root;
+    int64_t start;
+
+    taskENTER_CRITICAL(&s_mux);
+    if (s_bench_lock == NULL)
+        s_bench_lock = xSemaphoreCreateMutexStatic(&s_bench_lock_buf);
+    taskEXIT_CRITICAL(&s_mux);
+    xSemaphoreTake(s_bench_lock, portMAX_DELAY);
+
+    cJSON_InitHooks(&hooks);
+    s_bench_allocs = 0;
+    s_bench_bytes = 0;
+    start = esp_timer_get_time();
+    p_root = cJSON_ParseWithLength(p_body, len);
+    for (int i = 0; p_root != NULL && pp_keys[i] != NULL; i++)
+        cJSON_GetStringValue(cJSON_GetObjectItem(p_root, pp_keys[i]));
+    cJSON_Delete(p_root);
+    PersoMetrics_json(PMETRIC_JSON_CJSON, esp_timer_get_time() - start, s_bench_allocs, s_bench_bytes);
+    cJSON_InitHooks(NULL);
+
+    xSemaphoreGive(s_bench_lock);
+}
+#endif
+
+
+
+/***********      Export       ************/
+
+typedef struct
+{
+    httpd_req_t *req;
+    esp_err_t err;                              // first send error, later lines are dropped
+} pmetric_out_t;
+
+static void _line(pmetric_out_t* p_out, const char* p_fmt, ...) __attribute__((format(printf, 2, 3)));
+static void _line(pmetric_out_t* p_out, const char* p_fmt, ...)
+{
+    char line[PMETRIC_LINE_SIZE];
+    va_list args;
+    int len;
+
+    if (p_out->err != ESP_OK)
+        return;
+    va_start(args, p_fmt);
+    len = vsnprintf(line, sizeof(line), p_fmt, args);
+    va_end(args);
+    if (len <= 0)
+        return;
+    p_out->err = httpd_resp_send_chunk(p_out->req, line, MIN(len, (int) sizeof(line) - 1));
+}
+
+//
+//      _histogram()
+//      one histogram in the Prometheus text format (cumulative buckets, _sum, _count)
+//
+static void _histogram(pmetric_out_t* p_out, const char* p_name, const char* p_label, const pmetric_histogram_t* p_h)
+{
+    uint32_t cumulative = 0;
+
+    for (int i = 0; i < PMETRIC_BUCKETS; i++)
+    {
+        cumulative += p_h->bucket[i];
+        _line(p_out, "%s_bucket{%s,le=\"%g\"} %" PRIu32 "\n", p_name, p_label, s_bounds_us[i] / 1e6, cumulative);
+    }
+    _line(p_out, "%s_bucket{%s,le=\"+Inf\"} %" PRIu32 "\n", p_name, p_label, p_h->count);
+    _line(p_out, "%s_sum{%s} %.6f\n", p_name, p_label, p_h->sum_us / 1e6);
+    _line(p_out, "%s_count{%s} %" PRIu32 "\n", p_name, p_label, p_h->count);
+}
+
+#ifdef CONFIG_OT_PERSO_TASK_STATS
+//
+//      _task_stats()
+//      per task run time (the data of vTaskGetRunTimeStats()), core and stack low 
+//      watermark; the core utilisation is 1 - rate(IDLE run time)
+//
+static void _task_stats(pmetric_out_t* p_out)
+{
+    UBaseType_t cnt = uxTaskGetNumberOfTasks() + 2;     // tasks created in between
+    configRUN_TIME_COUNTER_TYPE total = 0;
+    TaskStatus_t *p_tasks = (TaskStatus_t*) malloc(cnt * sizeof(TaskStatus_t));
+
+    if (p_tasks == NULL)
+        return;
+    cnt = uxTaskGetSystemState(p_tasks, cnt, &total);
+    _line(p_out, "# TYPE perso_task_runtime_seconds_total counter\n");
+    for (UBaseType_t i = 0; i < cnt; i++)
+    {
+#ifdef CONFIG_FREERTOS_VTASKLIST_INCLUDE_COREID
+        if (p_tasks[i].xCoreID == tskNO_AFFINITY)
+            _line(p_out, "perso_task_runtime_seconds_total{task=\"%s\",core=\"any\"} %.6f\n", 
+                  p_tasks[i].pcTaskName, p_tasks[i].ulRunTimeCounter / 1e6);
+        else
+            _line(p_out, "perso_task_runtime_seconds_total{task=\"%s\",core=\"%d\"} %.6f\n", 
+                  p_tasks[i].pcTaskName, (int) p_tasks[i].xCoreID, p_tasks[i].ulRunTimeCounter / 1e6);
+#else
+        _line(p_out, "perso_task_runtime_seconds_total{task=\"%s\"} %.6f\n", p_tasks[i].pcTaskName, 
+              p_tasks[i].ulRunTimeCounter / 1e6);
+#endif
+    }
+    _line(p_out, "# TYPE perso_task_priority gauge\n");
+    for (UBaseType_t i = 0; i < cnt; i++)
+        _line(p_out, "perso_task_priority{task=\"%s\"} %u\n", p_tasks[i].pcTaskName, (unsigned) p_tasks[i].uxCurrentPriority);
+    // the ESP-IDF stack unit is the byte
+    _line(p_out, "# TYPE perso_task_stack_free_min_bytes gauge\n");
+    for (UBaseType_t i = 0; i < cnt; i++)
+        _line(p_out, "perso_task_stack_free_min_bytes{task=\"%s\"} %u\n", p_tasks[i].pcTaskName, 
+              (unsigned) p_tasks[i].usStackHighWaterMark);
+    _line(p_out, "# TYPE perso_runtime_seconds_total counter\n");
+    _line(p_out, "perso_runtime_seconds_total %.6f\n", total / 1e6);
+    free(p_tasks);
+}
+#endif
+
+#ifdef CONFIG_OT_BOOT_PROFILE
+//
+//      _boot()
+//      boot phases of this boot, seconds since the start of the application
+//
+static void _boot(pmetric_out_t* p_out)
+{
+    pboot_record_t rec;
+
+    if (PersoBoot_get(PBOOT_THIS, &rec) != PBOOT_OK)
+        return;
+    _line(p_out, "# TYPE perso_boot_phase_seconds gauge\n");
+    for (int i = 0; i < PBOOT_PHASE_CNT; i++)
+        if (rec.stamp_us[i] != 0)
+            _line(p_out, "perso_boot_phase_seconds{phase=\"%s\"} %.6f\n", PersoBoot_name(i), rec.stamp_us[i] / 1e6);
+    _line(p_out, "# TYPE perso_boot_count gauge\n");
+    _line(p_out, "perso_boot_count{reset_reason=\"%" PRIu32 "\"} %" PRIu32 "\n", rec.reset_reason, rec.boot);
+}
+#endif
+
+//
+//      PersoMetrics_send()
+//      send all metrics as chunked Prometheus text response
+//      @param  - [Input] req = the GET /v1/metrics request
+//      @return:    success: ESP_OK
+//                  failure: httpd send error
+//
+esp_err_t PersoMetrics_send(httpd_req_t* req)
+{
+    static pmetric_histogram_t hist[PMETRIC_HIST_CNT];     // snapshot, the handlers run one at a time
+    pmetric_io_t tp[PMETRIC_TP_CNT];
+    pmetric_parse_t json[PMETRIC_JSON_CNT];
+#ifdef CONFIG_OT_PERSO_JSON_BENCH
+    const int json_cnt = PMETRIC_JSON_CNT;
+#else
+    const int json_cnt = PMETRIC_JSON_CJSON;
+#endif
+    pmetric_out_t out = { .req = req, .err = ESP_OK };
+
+    taskENTER_CRITICAL(&s_mux);
+    memcpy(hist, s_hist, sizeof(hist));
+    memcpy(tp, s_tp, sizeof(tp));
+    memcpy(json, s_json, sizeof(json));
+    taskEXIT_CRITICAL(&s_mux);
+
+    httpd_resp_set_type(req, PMETRIC_CONTENT_TYPE);
+    for (int i = 0; i < PMETRIC_HIST_CNT; i++)
+    {
+        // TYPE once per metric family, the entries of a family are adjacent
+        if (i == 0 || strcmp(s_hist_names[i][0], s_hist_names[i - 1][0]) != 0)
+            _line(&out, "# TYPE %s histogram\n", s_hist_names[i][0]);
+        _histogram(&out, s_hist_names[i][0], s_hist_names[i][1], &hist[i]);
+    }
+    _line(&out, "# TYPE perso_tp_ops_total counter\n");
+    for (int i = 0; i < PMETRIC_TP_CNT; i++)
+        _line(&out, "perso_tp_ops_total{dir=\"%s\"} %" PRIu32 "\n", s_tp_names[i], tp[i].ops);
+    _line(&out, "# TYPE perso_tp_errors_total counter\n");
+    for (int i = 0; i < PMETRIC_TP_CNT; i++)
+        _line(&out, "perso_tp_errors_total{dir=\"%s\"} %" PRIu32 "\n", s_tp_names[i], tp[i].errors);
+    _line(&out, "# TYPE perso_tp_bytes_total counter\n");
+    for (int i = 0; i < PMETRIC_TP_CNT; i++)
+        _line(&out, "perso_tp_bytes_total{dir=\"%s\"} %" PRIu64 "\n", s_tp_names[i], tp[i].bytes);
+    _line(&out, "# TYPE perso_json_parses_total counter\n");
+    for (int i = 0; i < json_cnt; i++)
+        _line(&out, "perso_json_parses_total{parser=\"%s\"} %" PRIu32 "\n", s_json_names[i], json[i].count);
+    _line(&out, "# TYPE perso_json_parse_seconds_total counter\n");
+    for (int i = 0; i < json_cnt; i++)
+        _line(&out, "perso_json_parse_seconds_total{parser=\"%s\"} %.6f\n", s_json_names[i], json[i].sum_us / 1e6);
+    _line(&out, "# TYPE perso_json_heap_allocs_total counter\n");
+    for (int i = 0; i < json_cnt; i++)
+        _line(&out, "perso_json_heap_allocs_total{parser=\"%s\"} %" PRIu64 "\n", s_json_names[i], json[i].allocs);
+    _line(&out, "# TYPE perso_json_heap_bytes_total counter\n");
+    for (int i = 0; i < json_cnt; i++)
+        _line(&out, "perso_json_heap_bytes_total{parser=\"%s\"} %" PRIu64 "\n", s_json_names[i], json[i].bytes);
+
+    _line(&out, "# TYPE perso_heap_free_bytes gauge\n");
+    _line(&out, "perso_heap_free_bytes %" PRIu32 "\n", esp_get_free_heap_size());
+    _line(&out, "# TYPE perso_heap_min_free_bytes gauge\n");
+    _line(&out, "perso_heap_min_free_bytes{caps=\"default\"} %" PRIu32 "\n", esp_get_minimum_free_heap_size());
+    _line(&out, "perso_heap_min_free_bytes{caps=\"internal\"} %u\n", (unsigned) heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL));
+    _line(&out, "# TYPE perso_heap_largest_free_block_bytes gauge\n");
+    _line(&out, "perso_heap_largest_free_block_bytes %u\n", (unsigned) heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT));
+    _line(&out, "# TYPE perso_uptime_seconds gauge\n");
+    _line(&out, "perso_uptime_seconds %.3f\n", esp_timer_get_time() / 1e6);
+#ifdef CONFIG_OT_PERSO_TASK_STATS
+    _task_stats(&out);
+#endif
+#ifdef CONFIG_OT_BOOT_PROFILE
+    _boot(&out);
+#endif
+
+    if (out.err == ESP_OK)
+        out.err = httpd_resp_send_chunk(req, NULL, 0);
+    return out.err;
+}
+
+#endif // CONFIG_OT_PERSO_METRICS
@@ -0,0 +1,97 @@
+//
+//  PersoMetrics.h
+//  Lightweight metrics of the personalisation: fixed bucket latency histograms
+//  per URI handler and per DeviceID operation, TrustPlatform I/O counters and
+//  heap minimums and per task run time, exported in the Prometheus text format
+//  (GET /v1/metrics).
+//  Without CONFIG_OT_PERSO_METRICS all probes compile to nothing.
+//
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#ifndef __PERSOMETRICS_H__
+#define __PERSOMETRICS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_http_server.h"
+
+
+/***********      Global definition       ************/
+#define PMETRIC_CONTENT_TYPE    "text/plain; version=0.0.4"
+#define PMETRIC_BUCKETS         13              // upper bounds in PersoMetrics.c, + Inf
+
+
+
+/***********      Type defintion        ************/
+
+// latency histograms
+typedef enum
+{
+    PMETRIC_URI_STATUS = 0,
+    PMETRIC_URI_GENCSR,                         // until the CSR is sent (async: on the crypto worker)
+    PMETRIC_URI_FINAL,
+    PMETRIC_URI_SESSION,                        // one v2 WebSocket frame
+    PMETRIC_URI_METRICS,
+    PMETRIC_OP_KEYGEN,                          // RSA key generation, also the key pool producer
+    PMETRIC_OP_PARSE,                           // key parse for the CSR, DevID parse
+    PMETRIC_OP_SIGN,                            // CSR write (signature)
+    PMETRIC_OP_STORE,                           // DevID verify and TrustStore write
+    PMETRIC_HIST_CNT
+} pmetric_hist_t;
+
+// TrustPlatform I/O counters
+typedef enum
+{
+    PMETRIC_TP_READ = 0,
+    PMETRIC_TP_WRITE,
+    PMETRIC_TP_CNT
+} pmetric_tp_t;
+
+// request body parsers, cJSON only with OT_PERSO_JSON_BENCH
+typedef enum
+{
+    PMETRIC_JSON_PJSON = 0,
+    PMETRIC_JSON_CJSON,                         // the cJSON tree of the previous handlers
+    PMETRIC_JSON_CNT
+} pmetric_json_t;
+
+
+
+/***********      function declaration       ************/
+#ifdef CONFIG_OT_PERSO_METRICS
+void PersoMetrics_observe(pmetric_hist_t hist, int64_t us);
+void PersoMetrics_tpIO(pmetric_tp_t dir, size_t bytes, bool ok);
+void PersoMetrics_json(pmetric_json_t parser, int64_t us, uint32_t allocs, uint32_t bytes);
+esp_err_t PersoMetrics_send(httpd_req_t* req);
+#else
+static inline void PersoMetrics_observe(pmetric_hist_t hist, int64_t us) { }
+static inline void PersoMetrics_tpIO(pmetric_tp_t dir, size_t bytes, bool ok) { }
+static inline void PersoMetrics_json(pmetric_json_t parser, int64_t us, uint32_t allocs, uint32_t bytes) { }
+#endif
+
+#ifdef CONFIG_OT_PERSO_JSON_BENCH
+void PersoMetrics_cjsonBench(const char* p_body, size_t len, const char* const* pp_keys);
+#else
+static inline void PersoMetrics_cjsonBench(const char* p_body, size_t len, const char* const* pp_keys) { }
+#endif
+
+// latency since start_us (esp_timer_get_time())
+#define PMETRIC_SINCE(hist, start_us)   PersoMetrics_observe((hist), esp_timer_get_time() - (start_us))
+
+
+
+#endif // __PERSOMETRICS_H__
@@ -0,0 +1,231 @@
+///
+//  PersoTLS.c
+//  HTTPS transport of the personalisation endpoint
+//
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.   
+
+
+
+#include "sdkconfig.h"
+#define LOG_LOCAL_LEVEL CONFIG_OT_LOG_LEVEL_PERSO
+
+#include "esp_log.h"
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "esp_mac.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/ecp.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/sha256.h"
+#ifdef CONFIG_OT_PERSO_HTTPS
+#include "esp_https_server.h"
+#endif
+
+#include "TrustPlatform.h"
+#include "DeviceRNG.h"
+#include "PersoTLS.h"
+#include "PersoBoot.h"
+
+
+// Global var definition section:
+static const char *TAG = "PersoTLS";
+
+// the https server parses key and certificate again for every session: keep them
+static unsigned char gBootKey[PERSOTLS_BUF_SIZE];
+static unsigned char gBootCrt[PERSOTLS_BUF_SIZE];
+static char gFingerprint[PERSOTLS_FP_SIZE];
+static persotls_stats_t gStats;
+
+
+
+//
+//      _gen_bootstrap()
+//      generate the EC P-256 key and the self-signed certificate (PEM) into gBootKey / gBootCrt
+//
+static int _gen_bootstrap(void)
+{
+    int ret = PERSOTLS_OK;
+    int mbedResult;
+    mbedtls_pk_context key;
+    mbedtls_x509write_cert crt;
+    uint8_t mac[6];
+    unsigned char serial[16];
+    char subject[64];
+
+    esp_read_mac(mac, ESP_MAC_EFUSE_FACTORY);
+    snprintf(subject, sizeof(subject), "CN=IoTMate-%02X%02X%02X%02X%02X%02X,OU=bootstrap", 
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    mbedtls_pk_init(&key);
+    mbedtls_x509write_crt_init(&crt);
+
+    ESP_LOGI(TAG, "generate bootstrap key %s", subject);
+    if ((mbedResult = mbedtls_pk_setup(&key, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY))) != 0 ||
+        (mbedResult = mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(key), DeviceRNG_random, NULL)) != 0 ||
+        (mbedResult = mbedtls_pk_write_key_pem(&key, gBootKey, sizeof(gBootKey))) != 0)
+    {
+        ESP_LOGE(TAG, " failed  !  bootstrap key returned -0x%04x", (unsigned int) -mbedResult);
+        ret = PERSOTLS_ERR_KEYGEN;
+    }
+    else
+    {
+        DeviceRNG_random(NULL, serial, sizeof(serial));
+        serial[0] &= 0x7F;                                              // positive INTEGER
+        mbedtls_x509write_crt_set_version(&crt, MBEDTLS_X509_CRT_VERSION_3);
+        mbedtls_x509write_crt_set_md_alg(&crt, MBEDTLS_MD_SHA256);
+        mbedtls_x509write_crt_set_subject_key(&crt, &key);
+        mbedtls_x509write_crt_set_issuer_key(&crt, &key);
+        if ((mbedResult = mbedtls_x509write_crt_set_subject_name(&crt, subject)) != 0 ||
+            (mbedResult = mbedtls_x509write_crt_set_issuer_name(&crt, subject)) != 0 ||
+            (mbedResult = mbedtls_x509write_crt_set_serial_raw(&crt, serial, sizeof(serial))) != 0 ||
+            (mbedResult = mbedtls_x509write_crt_set_validity(&crt, PERSOTLS_NOT_BEFORE, PERSOTLS_NOT_AFTER)) != 0 ||
+            (mbedResult = mbedtls_x509write_crt_set_basic_constraints(&crt, 0, -1)) != 0 ||
+            (mbedResult = mbedtls_x509write_crt_pem(&crt, gBootCrt, sizeof(gBootCrt), DeviceRNG_random, NULL)) != 0)
+        {
+            ESP_LOGE(TAG, " failed  !  bootstrap certificate returned -0x%04x", (unsigned int) -mbedResult);
+            ret = PERSOTLS_ERR_CERT;
+        }
+    }
+    mbedtls_x509write_crt_free(&crt);
+    mbedtls_pk_free(&key);
+    if (ret == PERSOTLS_OK)
+    {
+        char keyfile[] = PERSOTLS_KEY_FILENAME;
+        char crtfile[] = PERSOTLS_CRT_FILENAME;
+        if (TPwrite(keyfile, gBootKey, strlen((char*) gBootKey)) != TP_OK ||
+            TPwrite(crtfile, gBootCrt, strlen((char*) gBootCrt)) != TP_OK)
+            ret = PERSOTLS_ERR_STORE;
+    }
+    return ret;
+}
+
+static int _load_bootstrap(void)
+{
+    char keyfile[] = PERSOTLS_KEY_FILENAME;
+    char crtfile[] = PERSOTLS_CRT_FILENAME;
+    // room for the NUL behind the (block padded) PEM
+    uint16_t keylen = sizeof(gBootKey) - 16;
+    uint16_t crtlen = sizeof(gBootCrt) - 16;
+
+    memset(gBootKey, 0x00, sizeof(gBootKey));
+    memset(gBootCrt, 0x00, sizeof(gBootCrt));
+    if (TPexists(keyfile) != TP_OK || TPexists(crtfile) != TP_OK ||
+        TPread(keyfile, gBootKey, &keylen) != TP_OK || TPread(crtfile, gBootCrt, &crtlen) != TP_OK)
+        return PERSOTLS_FAIL;
+    return PERSOTLS_OK;
+}
+
+static int _fingerprint(void)
+{
+    mbedtls_x509_crt crt;
+    unsigned char digest[32];
+    int ret = PERSOTLS_ERR_CERT;
+
+    mbedtls_x509_crt_init(&crt);
+    if (mbedtls_x509_crt_parse(&crt, gBootCrt, strlen((char*) gBootCrt) + 1) == 0 &&
+        mbedtls_sha256(crt.raw.p, crt.raw.len, digest, 0) == 0)
+    {
+        for (size_t i = 0; i < sizeof(digest); i++)
+            sprintf(&gFingerprint[2 * i], "%02x", digest[i]);
+        ret = PERSOTLS_OK;
+    }
+    mbedtls_x509_crt_free(&crt);
+    return ret;
+}
+
+//
+//      PersoTLS_init()
+//      load the bootstrap key and certificate from the TrustStore, generate them at 
+//      the first start. Needs the TrustPlatform and the DeviceRNG.
+//      @return:    success: PERSOTLS_OK
+//                  failure: PERSOTLS_ERR_KEYGEN, PERSOTLS_ERR_CERT, PERSOTLS_ERR_STORE
+//
+int PersoTLS_init(void)
+{
+    int ret = PERSOTLS_OK;
+
+    if (gFingerprint[0] != 0x00)
+        return PERSOTLS_OK;
+    if (_load_bootstrap() != PERSOTLS_OK)
+        ret = _gen_bootstrap();
+    if (ret == PERSOTLS_OK)
+        ret = _fingerprint();
+    if (ret == PERSOTLS_OK)
+        ESP_LOGI(TAG, "bootstrap certificate SHA-256: %s", gFingerprint);
+    return ret;
+}
+
+//
+//      PersoTLS_fingerprint()
+//      @return:    SHA-256 of the bootstrap certificate (hex), "" before PersoTLS_init()
+//
+const char* PersoTLS_fingerprint(void)
+{
+    return gFingerprint;
+}
+
+void PersoTLS_getStats(persotls_stats_t* p_stats)
+{
+    *p_stats = gStats;
+}
+
+#ifdef CONFIG_OT_PERSO_HTTPS
+static void _session_cb(esp_https_server_user_cb_arg_t *p_arg)
+{
+    if (p_arg->user_cb_state == HTTPD_SSL_USER_CB_SESS_CREATE)
+    {
+        gStats.sessions++;
+        gStats.open++;
+        PersoBoot_stamp(PBOOT_FIRST_TLS);
+        ESP_LOGD(TAG, "TLS session %" PRIu32 ", %" PRIu32 " open", gStats.sessions, gStats.open);
+    }
+    else if (p_arg->user_cb_state == HTTPD_SSL_USER_CB_SESS_CLOSE && gStats.open > 0)
+        gStats.open--;
+}
+#endif
+
+//
+//      PersoTLS_start()
+//      start the endpoint as HTTPS server with the bootstrap certificate
+//      @param  - [Output] p_server = the server handle
+//      @param  - [Input] p_config = the httpd profile of the plain server
+//      @return:    success: ESP_OK
+//                  failure: httpd_ssl_start() error, ESP_ERR_NOT_SUPPORTED without CONFIG_OT_PERSO_HTTPS
+//
+esp_err_t PersoTLS_start(httpd_handle_t* p_server, const httpd_config_t* p_config)
+{
+#ifdef CONFIG_OT_PERSO_HTTPS
+    httpd_ssl_config_t ssl = HTTPD_SSL_CONFIG_DEFAULT();
+
+    if (PersoTLS_init() != PERSOTLS_OK)
+        return ESP_FAIL;
+    ssl.httpd = *p_config;
+    // every TLS session holds its own record buffers: fewer sockets than plain HTTP
+    if (ssl.httpd.max_open_sockets > PERSOTLS_MAX_SESSIONS)
+        ssl.httpd.max_open_sockets = PERSOTLS_MAX_SESSIONS;
+    if (ssl.httpd.stack_size < 10240)
+        ssl.httpd.stack_size = 10240;
+    ssl.servercert = gBootCrt;
+    ssl.servercert_len = strlen((char*) gBootCrt) + 1;
+    ssl.prvtkey_pem = gBootKey;
+    ssl.prvtkey_len = strlen((char*) gBootKey) + 1;
+#ifdef CONFIG_OT_PERSO_HTTPS_TICKETS
+    ssl.session_tickets = true;
+#endif
+    ssl.user_cb = _session_cb;
+    return httpd_ssl_start(p_server, &ssl);
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
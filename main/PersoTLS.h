@@ -0,0 +1,75 @@
+///
+//  PersoTLS.h
+//  HTTPS transport of the personalisation endpoint
+//  The server authenticates with a bootstrap certificate: a self-signed 
+//  EC P-256 key pair generated on the device at the first start and kept in 
+//  the TrustStore. The station pins its SHA-256 fingerprint (log, mDNS TXT "tls").
+//  Session tickets let the follow-up connections skip the ECDHE/ECDSA handshake.
+//
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.   
+
+
+
+#ifndef PERSOTLS_H
+#define PERSOTLS_H
+
+#include "esp_log.h"
+#include <string.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+
+/***********      Global definition       ************/
+#define PERSOTLS_KEY_FILENAME       "Boot.key"
+#define PERSOTLS_CRT_FILENAME       "Boot.crt"
+#define PERSOTLS_BUF_SIZE           1024                        // PEM of a P-256 key ~230 B, of the certificate ~650 B
+#define PERSOTLS_FP_SIZE            65                          // SHA-256 hex + NUL
+#define PERSOTLS_NOT_BEFORE         "20230101000000"            // the clock is not set during the personalisation
+#define PERSOTLS_NOT_AFTER          "20491231235959"
+#ifdef CONFIG_OT_PERSO_HTTPS
+#define PERSOTLS_MAX_SESSIONS       CONFIG_OT_PERSO_HTTPS_MAX_SESSIONS
+#else
+#define PERSOTLS_MAX_SESSIONS       0
+#endif
+
+
+
+/***********      ERROR Codes    ************/
+#define PERSOTLS_OK                         0x0000                  // Everything ok      
+#define PERSOTLS_FAIL                       0x9300                  // Undefined Error; default Error
+#define PERSOTLS_ERR_KEYGEN                 0x9301                  // Error during the bootstrap key generation
+#define PERSOTLS_ERR_CERT                   0x9302                  // Error while writing or parsing the bootstrap certificate
+#define PERSOTLS_ERR_STORE                  0x9303                  // Error while storing the bootstrap key or certificate
+
+
+
+/***********      Type defintion        ************/
+
+typedef struct
+{
+    uint32_t sessions;                      // TLS sessions established
+    uint32_t open;                          // TLS sessions currently open
+} persotls_stats_t;
+
+
+
+/***********      function declaration       ************/
+int PersoTLS_init(void);
+const char* PersoTLS_fingerprint(void);
+esp_err_t PersoTLS_start(httpd_handle_t* p_server, const httpd_config_t* p_config);
+void PersoTLS_getStats(persotls_stats_t* p_stats);
+
+
+
+#endif // PERSOTLS_H
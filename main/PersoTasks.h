@@ -0,0 +1,49 @@
+//
+//  PersoTasks.h
+//  Task placement of the personalisation: core, priority and stack of the tasks 
+//  created in main/. With the split profile the RSA work (keygen, key pool, CSR 
+//  worker) runs on the APP_CPU and the network side (httpd, log drain) on the 
+//  PRO_CPU, where ESP-IDF places the WiFi task by default.
+//
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#ifndef __PERSOTASKS_H__
+#define __PERSOTASKS_H__
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+
+/***********      Global definition       ************/
+#define PTASK_CORE_PRO          0
+#define PTASK_CORE_APP          1
+
+#ifdef CONFIG_OT_TASK_PROFILE_SPLIT
+#define PTASK_CRYPTO_CORE       PTASK_CORE_APP          // DevID keygen, key pool producer, CSR worker
+#define PTASK_NET_CORE          PTASK_CORE_PRO          // deferred log drain, Wi-Fi cache; httpd see OT_PERSO_HTTPD_CORE
+#else
+#define PTASK_CRYPTO_CORE       tskNO_AFFINITY
+#define PTASK_NET_CORE          tskNO_AFFINITY
+#endif
+
+#define PTASK_CRYPTO_PRIORITY   CONFIG_OT_TASK_CRYPTO_PRIORITY
+#define PTASK_CRYPTO_STACK      CONFIG_OT_TASK_CRYPTO_STACK
+#define PTASK_KEYGEN_STACK      CONFIG_OT_TASK_KEYGEN_STACK
+#define PTASK_KEYPOOL_STACK     CONFIG_OT_TASK_KEYPOOL_STACK
+#define PTASK_PLOG_STACK        CONFIG_OT_TASK_PLOG_STACK
+#define PTASK_NETCONN_STACK     CONFIG_OT_TASK_NETCONN_STACK
+
+
+
+#endif // __PERSOTASKS_H__
@@ -20,7 +20,17 @@
 // License.    
 
 
+#include "sdkconfig.h"
+#define LOG_LOCAL_LEVEL CONFIG_OT_LOG_LEVEL_TP
+
 #include "TrustPlatform.h"
+#include "PersoMetrics.h"
+#include "PersoBoot.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <unistd.h>
 
 
 /***********      Global definitions       ************/
@@ -30,6 +40,9 @@ static const char *TAG = "TrustPlatform";
 uint8_t gSYS_KEY[32];
 bool gINT; 
 mbedtls_aes_context aes;
+static SemaphoreHandle_t gTPLock = NULL;        // serializes file access and the shared AES context
+static StaticSemaphore_t gTPLockBuf;
+static portMUX_TYPE gTPInitMux = portMUX_INITIALIZER_UNLOCKED;
 
 
 
@@ -88,6 +101,19 @@ static void directoryTP(char* p_path)
 }
 
 
+//
+//      _lock()
+//      create gTPLock exactly once, also for concurrent first callers of TPinit()
+//
+static SemaphoreHandle_t _lock(void)
+{
+    taskENTER_CRITICAL(&gTPInitMux);
+    if (gTPLock == NULL)
+        gTPLock = xSemaphoreCreateMutexStatic(&gTPLockBuf);
+    taskEXIT_CRITICAL(&gTPInitMux);
+    return gTPLock;
+}
+
 static void init_aes()
 {
     mbedtls_aes_init(&aes);
@@ -119,10 +145,8 @@ static int get_qtd_blocks(size_t input_size)
 }
 
 static void print_hex(unsigned char *buf, int len){
-    for(int i = 0; i < len; i++){
-        printf("%02x ", buf[i]);
-    }
-    printf("\n");
+    // debug level: compiled out below CONFIG_OT_LOG_LEVEL_TP 4, no raw printf on the UART
+    ESP_LOG_BUFFER_HEX_LEVEL(TAG, buf, len, ESP_LOG_DEBUG);
 }
 
 
@@ -200,6 +224,18 @@ esp_err_t TPinit(void)
     ESP_LOGI(TAG, "\n==================================================================");
     ESP_LOGI(TAG, "Start TPinit");
     
+    if (gINT == TP_INIT)
+    {
+        ESP_LOGI(TAG, " TP already initialized");
+        return TP_OK;
+    }
+    // a second caller waits for the first mount and key derivation
+    xSemaphoreTake(_lock(), portMAX_DELAY);
+    if (gINT == TP_INIT)
+    {
+        xSemaphoreGive(gTPLock);
+        return TP_OK;
+    }
     gINT = TP_NOT_INIT;
     // Start to register SPIFFS partition if not found format SPIFFS and generatate struct
     ret = esp_vfs_spiffs_register(&_vTPstore.tp_cnf);
@@ -216,20 +252,20 @@ esp_err_t TPinit(void)
     }
     esp_spiffs_info(_vTPstore.tp_cnf.partition_label, &total, &used);
     ESP_LOGI(TAG, "SPIFFS partition: Name: %s, free bytes: %zd, used bytes: %zd",_vTPstore.tp_cnf.partition_label,total,used);
+    // the store is kept across reboots (key pool, DevID); it is only formatted if the mount fails
     directoryTP(_vTPstore.tp_cnf.base_path);
-    
-    esp_spiffs_format(_vTPstore.tp_cnf.partition_label);
-    ESP_LOGI(TAG, "SPIFFS partition after format: Name: %s, free bytes: %zd, used bytes: %zd",_vTPstore.tp_cnf.partition_label,total,used);
-    directoryTP(_vTPstore.tp_cnf.base_path);
+    PersoBoot_stamp(PBOOT_TP_MOUNT);
     
     // Derive Sytem AES Key and store in Temp Buffer
     // memset buffer
     ret =  _derive_sys_Key(gSYS_KEY);
     if (ret == TP_OK)
     {
+        PersoBoot_stamp(PBOOT_TP_KEY);
         init_aes();
         gINT = TP_INIT;
     }
+    xSemaphoreGive(gTPLock);
     ESP_LOGI(TAG, " TP init ready with status: %s; Code: %#04X",esp_err_to_name(ret), ret);
     return ret; 
 }
@@ -254,10 +290,11 @@ esp_err_t TPread(char* p_filename, unsigned char* p_buffer, uint16_t* p_len)
     unsigned char *p_readbuf;
     int filesize = 0;
   
-    if (TP_INIT)
+    if (gINT == TP_INIT)
     {
+        xSemaphoreTake(gTPLock, portMAX_DELAY);
         sprintf(tmbuffer,"%s/%s",TP_BASE_PATH,p_filename);
-        ESP_LOGI (TAG," Read File:%s LEN buffer %d",tmbuffer, output_len);
+        ESP_LOGD (TAG," Read File:%s LEN buffer %d",tmbuffer, output_len);
         FILE* file = fopen(tmbuffer,"r");
         if (file == NULL)
         {
@@ -267,7 +304,7 @@ esp_err_t TPread(char* p_filename, unsigned char* p_buffer, uint16_t* p_len)
         {
             fseek(file, 0,SEEK_END);
             filesize = ftell(file);
-            ESP_LOGI (TAG," Read File LEN:  %d",filesize);
+            ESP_LOGD (TAG," Read File LEN:  %d",filesize);
             rewind(file);
             if (*p_len >= filesize)
             {
@@ -293,6 +330,8 @@ esp_err_t TPread(char* p_filename, unsigned char* p_buffer, uint16_t* p_len)
             }        
             fclose(file);    
         }
+        xSemaphoreGive(gTPLock);
+        PersoMetrics_tpIO(PMETRIC_TP_READ, (ret == TP_OK) ? filesize : 0, ret == TP_OK);
     }
     return(ret);
 }
@@ -320,13 +359,13 @@ esp_err_t TPwrite(char* p_filename, unsigned char* p_buffer, uint16_t len)
     unsigned char *p_writebuf;
     
   
-    if (TP_INIT)
+    if (gINT == TP_INIT)
     {
-     
+        xSemaphoreTake(gTPLock, portMAX_DELAY);
         p_writebuf = (unsigned char*)malloc(output_len);
         sprintf(tmbuffer,"%s/%s",TP_BASE_PATH,p_filename);
         aes_encrypt(p_buffer,len,p_writebuf);
-        ESP_LOGI (TAG," Write File:%s LEN buffer %d",tmbuffer, output_len);
+        ESP_LOGD (TAG," Write File:%s LEN buffer %d",tmbuffer, output_len);
         FILE* file = fopen(tmbuffer,"w");
         if (file == NULL)
         {
@@ -339,6 +378,117 @@ esp_err_t TPwrite(char* p_filename, unsigned char* p_buffer, uint16_t len)
             ret = TP_OK;
         }
         free(p_writebuf);
+        xSemaphoreGive(gTPLock);
+        PersoMetrics_tpIO(PMETRIC_TP_WRITE, len, ret == TP_OK);
+    }
+    return(ret);
+}
+
+
+//
+//      TPexists()
+//      check if a file exists in the TrustStore 
+//
+//      @param  - [Input] p_filename = the name of the file
+//
+//      @return:    success: TP_OK
+//                  failure: TP_ERR_FILE_NOT_EXIST
+//
+
+esp_err_t TPexists(char* p_filename)
+{
+    char tmbuffer[30];
+    struct stat st;
+
+    if (gINT != TP_INIT)
+        return TP_ERR_INIT;
+    sprintf(tmbuffer,"%s/%s",TP_BASE_PATH,p_filename);
+    if (stat(tmbuffer, &st) != 0 || st.st_size == 0)
+        return TP_ERR_FILE_NOT_EXIST;
+    return TP_OK;
+}
+
+
+//
+//      TPcheckHeader()
+//      cheap content check: only the first AES block is read and decrypted (CBC with a 
+//      zero IV, so it decrypts without the rest) and compared with the expected start. 
+//      The file size must be a whole number of blocks.
+//
+//      @param  - [Input] p_filename = the name of the file
+//      @param  - [Input] p_header = expected start of the plain text, the first 16 chars count
+//
+//      @return:    success: TP_OK
+//                  failure: TP_ERR_FILE_NOT_EXIST, TP_ERR_READ_FILE, TP_ERR_HEADER
+//
+
+esp_err_t TPcheckHeader(char* p_filename, const char* p_header)
+{
+    esp_err_t ret = TP_ERR_HEADER;
+    char tmbuffer[30];
+    struct stat st;
+    unsigned char iv[16];
+    unsigned char block[16];
+    unsigned char plain[16];
+    size_t len = MIN(strlen(p_header), sizeof(plain));
+
+    if (gINT != TP_INIT)
+        return TP_ERR_INIT;
+    sprintf(tmbuffer,"%s/%s",TP_BASE_PATH,p_filename);
+    if (stat(tmbuffer, &st) != 0 || st.st_size == 0)
+        return TP_ERR_FILE_NOT_EXIST;
+    if (st.st_size % 16 != 0)
+        return TP_ERR_HEADER;
+    xSemaphoreTake(gTPLock, portMAX_DELAY);
+    FILE* file = fopen(tmbuffer,"r");
+    if (file == NULL || fread(block, 1, sizeof(block), file) != sizeof(block))
+    {
+        ret = TP_ERR_READ_FILE;
+    }
+    else
+    {
+        memset(iv, 0, sizeof(iv));
+        mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_DECRYPT, sizeof(block), iv, block, plain);
+        ret = (memcmp(plain, p_header, len) == 0) ? TP_OK : TP_ERR_HEADER;
+        memset(plain, 0, sizeof(plain));
+    }
+    if (file != NULL)
+        fclose(file);
+    xSemaphoreGive(gTPLock);
+    PersoMetrics_tpIO(PMETRIC_TP_READ, (ret == TP_OK) ? sizeof(block) : 0, ret == TP_OK);
+    return ret;
+}
+
+
+//
+//      TPremove()
+//      delete a file from the TrustStore 
+//
+//      @param  - [Input] p_filename = the name of the file to be removed
+//
+//      @return:    success: TP_OK
+//                  failure: error Message
+//
+
+esp_err_t TPremove(char* p_filename)
+{
+    esp_err_t ret = TP_FAIL;
+    char tmbuffer[30];
+
+    if (gINT == TP_INIT)
+    {
+        xSemaphoreTake(gTPLock, portMAX_DELAY);
+        sprintf(tmbuffer,"%s/%s",TP_BASE_PATH,p_filename);
+        if (unlink(tmbuffer) != 0)
+        {
+            ESP_LOGE(TAG,"Failed to remove file: %s",tmbuffer);
+            ret = TP_ERR_FILE_NOT_EXIST;
+        }
+        else
+        {
+            ret = TP_OK;
+        }
+        xSemaphoreGive(gTPLock);
     }
     return(ret);
 }
@@ -50,6 +50,7 @@
 #define TP_ERR_COULD_NOT_OPEN_FILE      0x5303                  // Error while trying to open file
 #define TP_ERR_READ_FILE                0x5304                  // Error during read file
 #define TP_ERR_BUFFER_TO_SMALL          0x5305                  // Error given Buffer is to small     
+#define TP_ERR_HEADER                   0x5306                  // File content does not start as expected
 
 
 //      Trust Platform definition
@@ -75,6 +76,9 @@ typedef struct
 esp_err_t TPinit(void);
 esp_err_t TPread(char* p_filename, unsigned char* p_buffer, uint16_t* p_len);
 esp_err_t TPwrite(char* p_filename, unsigned char* p_buffer, uint16_t len);
+esp_err_t TPexists(char* p_filename);
+esp_err_t TPcheckHeader(char* p_filename, const char* p_header);
+esp_err_t TPremove(char* p_filename);
 
 
 
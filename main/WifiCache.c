@@ -0,0 +1,143 @@
+///
+//  WifiCache.c
+//  Fast reconnect cache of the WiFi station
+//
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.   
+
+
+
+#include "sdkconfig.h"
+#define LOG_LOCAL_LEVEL CONFIG_OT_LOG_LEVEL_NET
+
+#include "esp_log.h"
+#include <string.h>
+#include "nvs.h"
+#include "esp_wifi.h"
+
+#include "WifiCache.h"
+
+
+// Global var definition section:
+static const char *TAG = "WifiCache";
+
+
+
+static esp_err_t _load(wifi_cache_t* p_cache)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(wifi_cache_t);
+    esp_err_t err = nvs_open(WIFICACHE_NAMESPACE, NVS_READONLY, &nvs);
+
+    if (err != ESP_OK)
+        return err;
+    err = nvs_get_blob(nvs, WIFICACHE_KEY, p_cache, &len);
+    nvs_close(nvs);
+    if (err == ESP_OK && (len != sizeof(wifi_cache_t) || p_cache->magic != WIFICACHE_MAGIC))
+        err = ESP_ERR_INVALID_VERSION;
+    return err;
+}
+
+//
+//      WifiCache_apply()
+//      pre-set BSSID and channel of the cached AP in a station config. Only applied 
+//      if the cache belongs to the configured SSID.
+//      @param  - [Input/Output] p_config = station config with SSID
+//      @return:    success: ESP_OK, the config is a direct connect now
+//                  failure: ESP_ERR_NOT_FOUND, no matching cache entry
+//
+esp_err_t WifiCache_apply(wifi_config_t* p_config)
+{
+    wifi_cache_t cache;
+
+    if (_load(&cache) != ESP_OK ||
+        strncmp(cache.ssid, (const char*) p_config->sta.ssid, sizeof(p_config->sta.ssid)) != 0 ||
+        cache.channel == 0)
+        return ESP_ERR_NOT_FOUND;
+    memcpy(p_config->sta.bssid, cache.bssid, sizeof(cache.bssid));
+    p_config->sta.bssid_set = true;
+    p_config->sta.channel = cache.channel;
+    p_config->sta.scan_method = WIFI_FAST_SCAN;
+    ESP_LOGI(TAG, "direct connect to " MACSTR " on channel %d", MAC2STR(cache.bssid), cache.channel);
+    return ESP_OK;
+}
+
+//
+//      WifiCache_store()
+//      remember the AP the station is associated with; call on IP_EVENT_STA_GOT_IP. 
+//      The flash is only written if BSSID or channel changed.
+//      @return:    success: ESP_OK
+//                  failure: esp_wifi / NVS error
+//
+esp_err_t WifiCache_store(void)
+{
+    wifi_ap_record_t ap;
+    wifi_cache_t cache, old;
+    nvs_handle_t nvs;
+    esp_err_t err;
+
+    err = esp_wifi_sta_get_ap_info(&ap);
+    if (err != ESP_OK)
+        return err;
+    memset(&cache, 0x00, sizeof(cache));
+    cache.magic = WIFICACHE_MAGIC;
+    memcpy(cache.ssid, ap.ssid, sizeof(cache.ssid) - 1);
+    memcpy(cache.bssid, ap.bssid, sizeof(cache.bssid));
+    cache.channel = ap.primary;
+    if (_load(&old) == ESP_OK && memcmp(&old, &cache, sizeof(cache)) == 0)
+        return ESP_OK;
+
+    err = nvs_open(WIFICACHE_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK)
+        return err;
+    err = nvs_set_blob(nvs, WIFICACHE_KEY, &cache, sizeof(cache));
+    if (err == ESP_OK)
+        err = nvs_commit(nvs);
+    nvs_close(nvs);
+    ESP_LOGI(TAG, "cached " MACSTR " channel %d: %s", MAC2STR(cache.bssid), cache.channel, esp_err_to_name(err));
+    return err;
+}
+
+//
+//      WifiCache_clear()
+//      drop the cache entry, e.g. after the direct connect failed
+//
+esp_err_t WifiCache_clear(void)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(WIFICACHE_NAMESPACE, NVS_READWRITE, &nvs);
+
+    if (err != ESP_OK)
+        return err;
+    err = nvs_erase_key(nvs, WIFICACHE_KEY);
+    if (err == ESP_OK)
+        err = nvs_commit(nvs);
+    nvs_close(nvs);
+    return err;
+}
+
+//
+//      WifiCache_withoutBssid()
+//      fall back to a full scan: remove BSSID and channel from the active station config
+//
+void WifiCache_withoutBssid(void)
+{
+    wifi_config_t config;
+
+    if (esp_wifi_get_config(WIFI_IF_STA, &config) != ESP_OK)
+        return;
+    config.sta.bssid_set = false;
+    config.sta.channel = 0;
+    config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    esp_wifi_set_config(WIFI_IF_STA, &config);
+}
@@ -0,0 +1,58 @@
+///
+//  WifiCache.h
+//  Fast reconnect cache of the WiFi station
+//  The BSSID and channel of the last AP that gave us an IP are kept in NVS, 
+//  the next connect skips the full channel scan. The PMK is cached by the 
+//  WiFi driver itself (WIFI_STORAGE_FLASH).
+//
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.   
+
+
+
+#ifndef WIFICACHE_H
+#define WIFICACHE_H
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_wifi.h"
+
+
+/***********      Global definition       ************/
+#define WIFICACHE_NAMESPACE         "wifi_cache"
+#define WIFICACHE_KEY               "ap"
+#define WIFICACHE_MAGIC             0x57434831                  // "WCH1"
+
+
+
+/***********      Type defintion        ************/
+
+typedef struct
+{
+    uint32_t magic;
+    char     ssid[33];
+    uint8_t  bssid[6];
+    uint8_t  channel;
+} wifi_cache_t;
+
+
+
+/***********      function declaration       ************/
+esp_err_t WifiCache_apply(wifi_config_t* p_config);
+esp_err_t WifiCache_store(void);
+esp_err_t WifiCache_clear(void);
+void WifiCache_withoutBssid(void);
+
+
+
+#endif // WIFICACHE_H
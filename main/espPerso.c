@@ -15,335 +15,1053 @@
 // thespecific language governing permissions and limitations under the       
 // License.  
 
-#define LOG_LOCAL_LEVEL ESP_LOG_DEBUG
+#include "sdkconfig.h"
+#define LOG_LOCAL_LEVEL CONFIG_OT_LOG_LEVEL_PERSO
 
 #include "esp_log.h"
 #include <stdio.h>
 #include <sys/param.h>
+#include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/timers.h"
 #include "freertos/event_groups.h"
+#include "freertos/queue.h"
 #include "esp_wifi.h"
 #include "esp_log.h"
 #include "nvs_flash.h"
 #include "esp_netif.h"
 #include <netdb.h>
+#include "lwip/sockets.h"
 #include "esp_http_server.h"
 #include "esp_chip_info.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#include "esp_app_desc.h"
+#ifdef CONFIG_OT_PERSO_MDNS
+#include "mdns.h"
+#endif
 
 
-#include "deviceID.h"
+#include "DeviceID.h"
+#include "TrustPlatform.h"
 
 
 #include "espPerso.h"
+#include "espPersoWS.h"
+#include "espPersoPush.h"
+#include "KeyPool.h"
+#include "NetConn.h"
+#include "PersoTLS.h"
 
-#include "cJSON.h"
+#include "PersoJSON.h"
+#include "PersoCBOR.h"
+#include "PersoMetrics.h"
+#include "PersoLog.h"
+#include "PersoTasks.h"
 
 
 
 #include "esp_heap_caps.h"
+#include "esp_system.h"
 
 
-static EventGroupHandle_t s_wifi_event_group;
+static EventGroupHandle_t s_perso_event_group;
 
-#define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT      BIT1
-#define WIFI_SSID   CONFIG_OT_WIFI_SSID
-#define WIFI_PW     CONFIG_OT_WIFI_PASSWORD
-#define WIFI_RETRY  CONFIG_OT_MAXIMUM_RETRY
+#define PERSO_FINAL_BIT    BIT0         // DevID stored and status persisted
+#define PERSO_FAULT_BIT    BIT1         // fatal error in a handler
 
 
 #define MAX_HTTP_RECV_BUFFER 512
 #define MAX_HTTP_OUTPUT_BUFFER 2048
-
+#define PERSO_MAX_BODY          CONFIG_OT_PERSO_MAX_BODY
+#define PERSO_RECV_RETRY        3
+#define PERSO_CRYPTO_QUEUE_LEN  CONFIG_OT_PERSO_CRYPTO_QUEUE_LEN
+
+#define PERSO_HTTPD_MAX_SOCKETS CONFIG_OT_PERSO_HTTPD_MAX_SOCKETS
+#define PERSO_HTTPD_STACK       CONFIG_OT_PERSO_HTTPD_STACK
+#define PERSO_HTTPD_CORE        CONFIG_OT_PERSO_HTTPD_CORE
+#define PERSO_HTTPD_PRIORITY    CONFIG_OT_PERSO_HTTPD_PRIORITY
+#define PERSO_HTTPD_KA_IDLE     CONFIG_OT_PERSO_HTTPD_KEEPALIVE_IDLE
+
+#if PERSO_HTTPD_MAX_SOCKETS > (CONFIG_LWIP_MAX_SOCKETS - 3)
+#error "OT_PERSO_HTTPD_MAX_SOCKETS exceeds LWIP_MAX_SOCKETS - 3 (httpd internal sockets)"
+#endif
+
+#define PERSO_SHUTDOWN_GRACE_MS 500                     // let the final response leave before the server stops
+#define PERSO_LOAD_LOG_MS       CONFIG_OT_PERSO_LOAD_LOG_MS
+#define PERSO_KEYGEN_TIMEOUT_S  CONFIG_OT_PERSO_KEYGEN_TIMEOUT_S
+
+#define PERSO_MDNS_SERVICE      "_devid"
+#ifdef CONFIG_OT_PERSO_HTTPS
+#define PERSO_PORT              443
+#else
+#define PERSO_PORT              80
+#endif
+#define PERSO_MDNS_PROTO        "_tcp"
+
+#define PERSO_DN_MAX            65                      // X.520 upper bound 64 + NUL
+#define PERSO_SAN_MAX           256
+
+// fixed buffers for the genCSR request members
+typedef struct
+{
+    char cn[PERSO_DN_MAX];
+    char o[PERSO_DN_MAX];
+    char ou[PERSO_DN_MAX];
+    char c[3];
+    char sn[PERSO_DN_MAX];
+    char dns[PERSO_SAN_MAX];
+    char uri[PERSO_SAN_MAX];
+    char ip[48];
+} perso_csr_fields_t;
 
 // Global var definition section:
 static const char *TAG = "PERSO";
 
-static int s_retry_num = 0;
+static const char *s_fault_reason = NULL;
+// body members of the handlers, for the cJSON comparison (OT_PERSO_JSON_BENCH)
+static const char* const s_gencsr_keys[] = { "RequestID", "CN", "O", "OU", "C", "SN", "DNS", "URI", "IP", NULL };
+static const char* const s_final_keys[] = { "CA", "DevID", NULL };
+static volatile bool s_keygen_timed_out = false;    // set by the keygen timeout timer
+static uint8_t s_stage = PERSO_STAGE_NONE;      // last committed personalisation stage
+#ifdef CONFIG_OT_PERSO_ASYNC_CSR
+static QueueHandle_t s_crypto_queue = NULL;
+#endif
 unsigned char gCertBuf[4096];
 nvs_handle_t gPERSO;
+devid_cancel_t gKeygenCancel;
 
 
 
 
-static void _set_static_ip(esp_netif_t *netif)
+//
+//      _perso_fault()
+//      single fault handler of the personalisation: log once and park the task. 
+//      The device stays unpersonalised and waits for a power cycle; the CPU is free.
+//
+static void _perso_fault(const char* p_reason, esp_err_t err)
 {
-    if (esp_netif_dhcpc_stop(netif) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to stop dhcp client");
-        return;
+    // the deferred records first, they lead up to the fault
+    PersoLog_flush();
+    ESP_LOGE(TAG, "\n############ ERROR DURING PERSO: %s (%s), STOP WORKING \n", p_reason, esp_err_to_name(err));
+    while (1)
+        vTaskDelay(portMAX_DELAY);
+}
+
+//
+//      _perso_signal_fault()
+//      report a fatal error from a handler task to espPerso(); a running keygen is 
+//      cancelled, its key would not be used anymore
+//
+static void _perso_signal_fault(const char* p_reason)
+{
+    s_fault_reason = p_reason;
+    gKeygenCancel.cancel = true;
+    xEventGroupSetBits(s_perso_event_group, PERSO_FAULT_BIT);
+}
+
+#if defined(CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS) && (PERSO_LOAD_LOG_MS > 0)
+//
+//      _log_idle_load()
+//      log the share of the idle tasks since the last call, per core. The run time 
+//      counter is clocked by esp_timer (us), the default run time stats source.
+//
+static void _log_idle_load(void)
+{
+    static uint32_t last_idle[portNUM_PROCESSORS];
+    static int64_t last_us = 0;
+    int64_t now = esp_timer_get_time();
+    TaskStatus_t status;
+
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        vTaskGetInfo(xTaskGetIdleTaskHandleForCore(core), &status, pdFALSE, eRunning);
+        if (last_us != 0)
+            ESP_LOGI(TAG, "core %d idle: %" PRIu32 " %%", core,
+                     (uint32_t) ((uint64_t) (status.ulRunTimeCounter - last_idle[core]) * 100 / (now - last_us)));
+        last_idle[core] = status.ulRunTimeCounter;
     }
-    esp_netif_ip_info_t ip;
-    memset(&ip, 0 , sizeof(esp_netif_ip_info_t));
-    ip.ip.addr = ipaddr_addr(CONFIG_OT_STATIC_IP_ADDR);
-    ip.netmask.addr = ipaddr_addr(CONFIG_OT_STATIC_NETMASK_ADDR);
-    ip.gw.addr = ipaddr_addr(CONFIG_OT_STATIC_GW_ADDR);
-    if (esp_netif_set_ip_info(netif, &ip) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to set ip info");
+    last_us = now;
+}
+#endif
+
+//
+//      _perso_wait()
+//      block until the DevID is finalised or a handler reports a fault
+//      @return:    the event bits
+//
+static EventBits_t _perso_wait(void)
+{
+    EventBits_t bits;
+    TickType_t timeout = portMAX_DELAY;
+
+#if defined(CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS) && (PERSO_LOAD_LOG_MS > 0)
+    timeout = pdMS_TO_TICKS(PERSO_LOAD_LOG_MS);
+    _log_idle_load();
+#endif
+    do
+    {
+        bits = xEventGroupWaitBits(s_perso_event_group, PERSO_FINAL_BIT | PERSO_FAULT_BIT,
+                                   pdFALSE, pdFALSE, timeout);
+#if defined(CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS) && (PERSO_LOAD_LOG_MS > 0)
+        _log_idle_load();
+#endif
+    } while ((bits & (PERSO_FINAL_BIT | PERSO_FAULT_BIT)) == 0);
+    return bits;
+}
+
+
+
+#ifdef CONFIG_OT_PERSO_MDNS
+//
+//      _mdns_start()
+//      advertise the personalisation endpoint as _devid._tcp, so the station finds 
+//      devices with DHCP addresses by browsing instead of a fixed IP
+//
+static void _mdns_start(void)
+{
+    uint8_t mac[6];
+    char chip[13];
+    char hostname[32];
+
+    if (esp_read_mac(mac, ESP_MAC_EFUSE_FACTORY) != ESP_OK || mdns_init() != ESP_OK)
+    {
+        ESP_LOGE(TAG, "mDNS init failed");
         return;
     }
-    ESP_LOGD(TAG, "Success to set static ip");
+    snprintf(chip, sizeof(chip), "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    snprintf(hostname, sizeof(hostname), "%s-%02x%02x%02x", CONFIG_OT_PERSO_MDNS_HOSTNAME, mac[3], mac[4], mac[5]);
+    mdns_hostname_set(hostname);
+    mdns_instance_name_set(hostname);
+
+    mdns_txt_item_t txt[] = {
+        { "chip", chip },
+        { "key",  espPerso_keyReady() ? "ready" : "keygen" },
+        { "fw",   esp_app_get_description()->version },
+        { "path", "/v1/DevID" },
+        { "tls",  PersoTLS_fingerprint() },
+    };
+    // without HTTPS the empty "tls" record is left out
+    size_t txtcnt = sizeof(txt) / sizeof(txt[0]);
+    if (PersoTLS_fingerprint()[0] == 0x00)
+        txtcnt--;
+    if (mdns_service_add(NULL, PERSO_MDNS_SERVICE, PERSO_MDNS_PROTO, PERSO_PORT, txt, txtcnt) != ESP_OK)
+        ESP_LOGE(TAG, "mDNS service add failed");
+    else
+        ESP_LOGI(TAG, "mDNS: %s.local, %s.%s chip=%s", hostname, PERSO_MDNS_SERVICE, PERSO_MDNS_PROTO, chip);
+}
+#endif
+
+//
+//      _mdns_key_state()
+//      update the key TXT record: keygen, ready or personalised
+//
+static void _mdns_key_state(const char* p_state)
+{
+#ifdef CONFIG_OT_PERSO_MDNS
+    mdns_service_txt_item_set(PERSO_MDNS_SERVICE, PERSO_MDNS_PROTO, "key", p_state);
+#endif
 }
 
 
-static void wifi_event_handler(void *p_arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+
+//
+//      _stage_name()
+//
+static const char* _stage_name(uint8_t stage)
+{
+    switch (stage)
+    {
+        case PERSO_STAGE_KEY_READY:     return "key-ready";
+        case PERSO_STAGE_CSR_ISSUED:    return "csr-issued";
+        case PERSO_STAGE_CERT_STORED:   return "cert-stored";
+        default:                        return "none";
+    }
+}
+
+//
+//      _stage_commit()
+//      persist a personalisation stage; a reboot resumes at the last committed stage
+//      @return:    success: ESP_OK
+//                  failure: NVS error, the stage in RAM is left unchanged
+//
+static esp_err_t _stage_commit(uint8_t stage)
 {
+    esp_err_t err = nvs_set_u8(gPERSO, "status", stage);
 
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
+    if (err == ESP_OK)
+        err = nvs_commit(gPERSO);
+    if (err != ESP_OK)
     {
-        esp_wifi_connect();
-    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
-        _set_static_ip(p_arg);
-    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < WIFI_RETRY) {
-            esp_wifi_connect();
-            s_retry_num++;
-            ESP_LOGI(TAG, "retry to connect to the AP");
-        } else {
-            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
-        }
-        ESP_LOGI(TAG,"connect to the AP fail");
-    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-        s_retry_num = 0;
-        xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        ESP_LOGE(TAG, "stage %s not committed: %s", _stage_name(stage), esp_err_to_name(err));
+        return err;
     }
+    ESP_LOGI(TAG, "stage %s committed", _stage_name(stage));
+    s_stage = stage;
+    return ESP_OK;
+}
+
+//
+//      _csr_cached()
+//      answer a repeated genCSR (same RequestID and format) with the CSR issued before, 
+//      also across a reboot
+//      @return:    true if p_csr / p_olen hold the cached CSR
+//
+static bool _csr_cached(const char* p_reqid, perso_format_t fmt, unsigned char* p_csr, uint16_t csrlen, size_t* p_olen)
+{
+    char stored[PERSO_REQID_MAX];
+    size_t len = sizeof(stored);
+    uint8_t stored_fmt = 0xFF;
+
+    if (p_reqid == NULL || s_stage != PERSO_STAGE_CSR_ISSUED ||
+        nvs_get_str(gPERSO, "req_id", stored, &len) != ESP_OK || strcmp(stored, p_reqid) != 0 ||
+        nvs_get_u8(gPERSO, "csr_fmt", &stored_fmt) != ESP_OK || stored_fmt != fmt)
+        return false;
+    len = csrlen - 1;
+    if (nvs_get_blob(gPERSO, "csr", p_csr, &len) != ESP_OK)
+        return false;
+    p_csr[len] = 0x00;
+    *p_olen = len;
+    return true;
+}
+
+//
+//      _csr_commit()
+//      cache an issued CSR with its RequestID and commit CSR_ISSUED. The RequestID is 
+//      removed first, a torn update never pairs an old ID with a new CSR.
+//
+static void _csr_commit(const char* p_reqid, perso_format_t fmt, const unsigned char* p_csr, size_t olen)
+{
+    esp_err_t err = nvs_erase_key(gPERSO, "req_id");
+
+    if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND)
+        err = nvs_set_blob(gPERSO, "csr", p_csr, olen);
+    if (err == ESP_OK)
+        err = nvs_set_u8(gPERSO, "csr_fmt", fmt);
+    if (err == ESP_OK)
+        err = nvs_set_str(gPERSO, "req_id", (p_reqid != NULL) ? p_reqid : "");
+    if (err == ESP_OK)
+        _stage_commit(PERSO_STAGE_CSR_ISSUED);
+    else
+        ESP_LOGE(TAG, "CSR not cached: %s", esp_err_to_name(err));
+}
+
 
 
+//
+//      _body_field()
+//      copy a top level string member of a JSON or CBOR body into a fixed buffer 
+//      @return: p_buf, or NULL if the member is absent, empty, not a string or too long
+//
+static const char* _body_field(const char* p_body, size_t len, perso_format_t fmt, const char* p_name, char* p_buf, size_t buflen)
+{
+    bool found, toolong;
+    int ret;
 
+    if (fmt == PERSO_FMT_CBOR)
+    {
+        ret = pcbor_get_text((const uint8_t*) p_body, len, p_name, p_buf, buflen);
+        found = (ret == PCBOR_OK);
+        toolong = (ret == PCBOR_ERR_BUFFER);
+    }
+    else
+    {
+        ret = pjson_get_string(p_body, len, p_name, p_buf, buflen);
+        found = (ret == PJSON_OK);
+        toolong = (ret == PJSON_ERR_BUFFER);
+    }
+    if (toolong)
+        ESP_LOGI(TAG, "ignore %s: longer than %d bytes", p_name, buflen - 1);
+    if (!found || p_buf[0] == 0x00)
+        return NULL;
+    return p_buf;
 }
 
+static void _add_san_raw(devid_subject_t* p_subject, devid_san_t* p_san, devid_san_type_t type, const uint8_t* p_value, size_t len)
+{
+    p_san[p_subject->san_cnt].type = type;
+    p_san[p_subject->san_cnt].p_value = p_value;
+    p_san[p_subject->san_cnt].len = len;
+    p_subject->san_cnt++;
+}
 
-void wifi_connection()
+static void _add_san(devid_subject_t* p_subject, devid_san_t* p_san, devid_san_type_t type, const char* p_value)
 {
-    
-    s_wifi_event_group = xEventGroupCreate();
-
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_t *sta_netif = esp_netif_create_default_wifi_sta();
-    assert(sta_netif);
-
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-
-    esp_event_handler_instance_t instance_any_id;
-    esp_event_handler_instance_t instance_got_ip;
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &wifi_event_handler,
-                                                        sta_netif,
-                                                        &instance_any_id));
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                        IP_EVENT_STA_GOT_IP,
-                                                        &wifi_event_handler,
-                                                        sta_netif,
-                                                        &instance_got_ip));
-
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = WIFI_SSID,
-            .password = WIFI_PW,
-        },
-    };
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
-    ESP_ERROR_CHECK(esp_wifi_start() );
-    ESP_LOGI(TAG, "wifi_init_sta finished.");
+    if (p_value != NULL)
+        _add_san_raw(p_subject, p_san, type, (const uint8_t*) p_value, strlen(p_value));
+}
+
+
+
+//
+//      _recv_body()
+//      read the complete request body into a right-sized, NUL terminated buffer. 
+//      httpd_req_recv() may return less than requested (TCP segments), so it loops until 
+//      content_len is reached; socket timeouts are retried PERSO_RECV_RETRY times.
+//      On failure the error response is sent.
+//      @param  - [Input] req = the request
+//      @param  - [Output] pp_body = allocated body, to be freed by the caller
+//      @param  - [Output] p_len = body length without the NUL
+//      @return:    success: ESP_OK
+//                  failure: ESP_FAIL
+//
+static esp_err_t _recv_body(httpd_req_t *req, char** pp_body, size_t* p_len)
+{
+    size_t total = req->content_len;
+    size_t received = 0;
+    int retry = 0;
 
-    /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-     * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
-    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-            WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-            pdFALSE,
-            pdFALSE,
-            portMAX_DELAY);
+    *pp_body = NULL;
+    *p_len = 0;
+    if (total == 0)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "empty body");
+        return ESP_FAIL;
+    }
+    if (total > PERSO_MAX_BODY)
+    {
+        ESP_LOGI(TAG, "body of %d bytes exceeds %d", total, PERSO_MAX_BODY);
+        httpd_resp_set_status(req, "413 Payload Too Large");
+        httpd_resp_send(req, NULL, 0);
+        return ESP_FAIL;
+    }
+    char *p_body = (char*)malloc(total + 1);
+    if (p_body == NULL)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    while (received < total)
+    {
+        int ret = httpd_req_recv(req, p_body + received, total - received);
+        if (ret == HTTPD_SOCK_ERR_TIMEOUT && ++retry <= PERSO_RECV_RETRY)
+            continue;
+        if (ret <= 0)
+        {   /* 0 return value indicates connection closed */
+            if (ret == HTTPD_SOCK_ERR_TIMEOUT)
+                httpd_resp_send_408(req);
+            free(p_body);
+            return ESP_FAIL;
+        }
+        received += ret;
+    }
+    p_body[received] = 0x00;
+    *pp_body = p_body;
+    *p_len = received;
+    return ESP_OK;
+}
+
+//
+//      espPerso_keyReady()
+//      @return:    true once the DevID key is generated
+//
+bool espPerso_keyReady(void)
+{
+    devid_keygen_progress_t progress;
+    DeviceID_getKeygenProgress(&progress);
+    return progress.done;
+}
+
+//
+//      _keygen_progress()
+//      progress callback of the DevID key generation; logs every 16th prime candidate
+//
+static void _keygen_progress(const devid_keygen_progress_t* p_progress, void* p_arg)
+{
+    if ((p_progress->candidates % 16) == 0)
+        ESP_LOGI(TAG, "keygen: %" PRIu32 " candidates tested, %lld ms", p_progress->candidates, p_progress->elapsed_us / 1000);
+}
+
+#ifdef CONFIG_OT_TASK_PROFILE_SPLIT
+typedef struct
+{
+    TaskHandle_t waiter;
+    int ret;
+} perso_keygen_t;
 
-    /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-     * happened. */
-    if (bits & WIFI_CONNECTED_BIT) 
+static void _keygen_task(void* p_arg)
+{
+    perso_keygen_t *p_kg = (perso_keygen_t*) p_arg;
+
+    p_kg->ret = DeviceID_genKeyEx(_keygen_progress, NULL, &gKeygenCancel);
+    xTaskNotifyGive(p_kg->waiter);
+    vTaskDelete(NULL);
+}
+#endif
+
+#if PERSO_KEYGEN_TIMEOUT_S > 0
+//
+//      _keygen_timeout()
+//      only cancels the keygen; the fault follows from its result, so a timeout racing 
+//      a finished keygen does not fault a device with a valid key
+//
+static void _keygen_timeout(void* p_arg)
+{
+    s_keygen_timed_out = true;
+    gKeygenCancel.cancel = true;
+}
+#endif
+
+//
+//      _gen_key()
+//      generate the DevID key. With the split task placement the keygen runs on a 
+//      task on the crypto core, the main task (PRO_CPU) waits for it. The keygen is 
+//      cancelled by a handler fault or after PERSO_KEYGEN_TIMEOUT_S.
+//      @return:    success: DEVID_OK
+//                  failure: DeviceID_genKeyEx() error, DEVID_ERR_CANCELLED
+//
+static int _gen_key(void)
+{
+    int ret = DEVID_FAIL;
+    esp_timer_handle_t timer = NULL;
+#if PERSO_KEYGEN_TIMEOUT_S > 0
+    const esp_timer_create_args_t timer_args = { .callback = _keygen_timeout, .name = "keygen_timeout" };
+
+    s_keygen_timed_out = false;
+    if (esp_timer_create(&timer_args, &timer) == ESP_OK)
+        esp_timer_start_once(timer, PERSO_KEYGEN_TIMEOUT_S * 1000000LL);
+#endif
+#ifdef CONFIG_OT_TASK_PROFILE_SPLIT
+    perso_keygen_t kg = { .waiter = xTaskGetCurrentTaskHandle(), .ret = DEVID_FAIL };
+
+    if (xTaskCreatePinnedToCore(_keygen_task, "perso_keygen", PTASK_KEYGEN_STACK, &kg, uxTaskPriorityGet(NULL), NULL, 
+                                PTASK_CRYPTO_CORE) == pdPASS)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        ret = kg.ret;
+    }
+    else
     {
-        ESP_LOGI(TAG, "connected to ap SSID:%s", WIFI_SSID);
-    } else if (bits & WIFI_FAIL_BIT) 
+        ESP_LOGI(TAG, "keygen task not started, generating on the main task");
+        ret = DeviceID_genKeyEx(_keygen_progress, NULL, &gKeygenCancel);
+    }
+#else
+    ret = DeviceID_genKeyEx(_keygen_progress, NULL, &gKeygenCancel);
+#endif
+    if (timer != NULL)
     {
-        ESP_LOGI(TAG, "Failed to connect to SSID:%s",WIFI_SSID);
-    } else 
+        esp_timer_stop(timer);
+        esp_timer_delete(timer);
+    }
+    if (ret == DEVID_ERR_CANCELLED && s_keygen_timed_out && s_fault_reason == NULL)
+        s_fault_reason = "keygen timeout";
+    else if (ret == DEVID_OK && s_keygen_timed_out)
+        gKeygenCancel.cancel = false;
+    return ret;
+}
+
+//
+//      espPerso_status()
+//      write the status members (v1 status response, v2 status message)
+//      @param  - [Input] p_w = started writer
+//      @return:    true if the key is ready
+//
+bool espPerso_status(pjson_writer_t* p_w)
+{
+    devid_keygen_progress_t progress;
+
+    DeviceID_getKeygenProgress(&progress);
+    pjson_str(p_w,"stage",_stage_name(s_stage));
+    if (progress.done)
     {
-        ESP_LOGE(TAG, "UNEXPECTED EVENT");
+        pjson_str(p_w,"status","Ready");
     }
+    else
+    {
+        pjson_str(p_w,"status",progress.running ? "KeyGen" : "Busy");
+        pjson_num(p_w,"candidates",progress.candidates);
+        pjson_num(p_w,"elapsed_ms",progress.elapsed_us / 1000);
+    }
+    // low watermark for the line simulation / capacity planning (tools/perso_line.py)
+    pjson_num(p_w,"heap_min",esp_get_minimum_free_heap_size());
+    return progress.done;
 }
 
 
 
-/* Our URI handler function to be called during GET /uri request */
+//
+//      _req_format()
+//      body format of a request (Content-Type) or the wanted response format (Accept)
+//
+static perso_format_t _req_format(httpd_req_t *req, const char* p_header)
+{
+    char value[48];
 
-esp_err_t status_handler(httpd_req_t *req)
+    if (httpd_req_get_hdr_value_str(req, p_header, value, sizeof(value)) == ESP_OK &&
+        strstr(value, PCBOR_CONTENT_TYPE) != NULL)
+        return PERSO_FMT_CBOR;
+    return PERSO_FMT_JSON;
+}
+
+static esp_err_t _send_cbor(httpd_req_t *req, pcbor_writer_t* p_w)
+{
+    if (p_w->err != PCBOR_OK)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, PCBOR_CONTENT_TYPE);
+    return httpd_resp_send(req, (const char*) p_w->p_buf, p_w->len);
+}
+
+
+
+static esp_err_t _status(httpd_req_t *req)
 {
     int ret = ESP_FAIL;
-    cJSON *rspJSN = NULL;
+    pjson_writer_t rsp;
     
-    ESP_LOGI(TAG, "\n==================================================================");
-    ESP_LOGI(TAG, "GET: v1/DevID/status");
-    rspJSN = cJSON_CreateObject();
-    cJSON_AddStringToObject(rspJSN,"status","Ready");
-    char *rsp_json_string = cJSON_Print(rspJSN);
-    ESP_LOGI(TAG," GET response: %s",rsp_json_string);
-    if(httpd_resp_send(req, rsp_json_string  , HTTPD_RESP_USE_STRLEN)!= ESP_OK)
+    PLOG(TAG, "GET: v1/DevID/status");
+    if (!espPerso_keyReady())
+    {
+        // key generation still running: report live progress with 503, so the station
+        // treats the device as not ready yet and polls again
+        httpd_resp_set_status(req, "503 Service Unavailable");
+    }
+    if (_req_format(req, "Accept") == PERSO_FMT_CBOR)
+    {
+        devid_keygen_progress_t progress;
+        uint8_t buf[128];
+        pcbor_writer_t w;
+
+        DeviceID_getKeygenProgress(&progress);
+        pcbor_init(&w, buf, sizeof(buf));
+        pcbor_map(&w, progress.done ? 3 : 5);
+        pcbor_text(&w, "stage");
+        pcbor_text(&w, _stage_name(s_stage));
+        pcbor_text(&w, "status");
+        pcbor_text(&w, progress.done ? "Ready" : (progress.running ? "KeyGen" : "Busy"));
+        if (!progress.done)
+        {
+            pcbor_text(&w, "candidates");
+            pcbor_int(&w, progress.candidates);
+            pcbor_text(&w, "elapsed_ms");
+            pcbor_int(&w, progress.elapsed_us / 1000);
+        }
+        // the members of espPerso_status()
+        pcbor_text(&w, "heap_min");
+        pcbor_int(&w, esp_get_minimum_free_heap_size());
+        return _send_cbor(req, &w);
+    }
+    pjson_begin(&rsp, req);
+    espPerso_status(&rsp);
+    if(pjson_end(&rsp)!= ESP_OK)
         ESP_LOGI(TAG," ERRRO Sending response ");
     else
         ret = ESP_OK;
-    free(rsp_json_string);
-    cJSON_Delete(rspJSN);
     return ret;
 }
 
-/* Our URI handler function to be called during POST /uri request */
-esp_err_t genCSR_handler(httpd_req_t *req)
+/* Our URI handler function to be called during GET /uri request */
+esp_err_t status_handler(httpd_req_t *req)
+{
+    int64_t start = esp_timer_get_time();
+    esp_err_t ret = _status(req);
+
+    PMETRIC_SINCE(PMETRIC_URI_STATUS, start);
+    return ret;
+}
+
+//
+//      espPerso_genCSR()
+//      build the subject from the genCSR members and generate the CSR: PEM for a JSON, 
+//      DER for a CBOR request. Runs on the crypto worker (async mode) or on the httpd task.
+//      @param  - [Input] p_body = request body
+//      @param  - [Input] len = body length
+//      @param  - [Input] fmt = body format
+//      @param  - [Output] p_csr = CSR buffer
+//      @param  - [Input] csrlen = size of the CSR buffer
+//      @param  - [Output] p_olen = CSR length (PEM without NUL)
+//      A request with the RequestID of the issued CSR is answered from the NVS cache.
+//      @return:    success: DEVID_OK
+//                  failure: DeviceID_genCSR() error
+//
+int espPerso_genCSR(const char* p_body, size_t len, perso_format_t fmt, unsigned char* p_csr, uint16_t csrlen, size_t* p_olen)
 {
-    /* Destination buffer for content of HTTP POST request.
-     * httpd_req_recv() accepts char* only, but content could
-     * as well be any binary data (needs type casting).
-     * In case of string data, null termination will be absent, and
-     * content length would give length of string */
-    char content[100];
-    char subname[300];
-
-    /* Truncate if content length larger than the buffer */
-    size_t recv_size = MIN(req->content_len, sizeof(content));
-    ESP_LOGI(TAG, "\n==================================================================");
-    ESP_LOGI(TAG, "POST: v1/DevID/genCSR");
-
-    int ret = httpd_req_recv(req, content, recv_size);
-    if (ret <= 0) 
-    {   /* 0 return value indicates connection closed */
-        /* Check if timeout occurred */
-        if (ret == HTTPD_SOCK_ERR_TIMEOUT) 
+    perso_csr_fields_t fields;
+    devid_subject_t subject;
+    devid_san_t san[3];
+    uint8_t ipaddr[16];
+    char reqid[PERSO_REQID_MAX];
+    int ret;
+    int64_t start = esp_timer_get_time();
+    int64_t parse_us, parse_start;
+
+    if (fmt == PERSO_FMT_JSON)
+        PersoMetrics_cjsonBench(p_body, len, s_gencsr_keys);
+    // a retried request gets the CSR it was issued before, the key is never signed twice for it
+    parse_start = esp_timer_get_time();
+    const char *p_reqid = _body_field(p_body, len, fmt, "RequestID", reqid, sizeof(reqid));
+    parse_us = esp_timer_get_time() - parse_start;
+    if (_csr_cached(p_reqid, fmt, p_csr, csrlen, p_olen))
+    {
+        ESP_LOGI(TAG, "genCSR %s repeated, cached CSR", p_reqid);
+        return DEVID_OK;
+    }
+    parse_start = esp_timer_get_time();
+    memset(&subject, 0x00, sizeof(subject));
+    subject.p_cn = _body_field(p_body, len, fmt, "CN", fields.cn, sizeof(fields.cn));
+    subject.p_o  = _body_field(p_body, len, fmt, "O", fields.o, sizeof(fields.o));
+    subject.p_ou = _body_field(p_body, len, fmt, "OU", fields.ou, sizeof(fields.ou));
+    subject.p_c  = _body_field(p_body, len, fmt, "C", fields.c, sizeof(fields.c));
+    subject.p_sn = _body_field(p_body, len, fmt, "SN", fields.sn, sizeof(fields.sn));
+    subject.p_san = san;
+    _add_san(&subject, san, DEVID_SAN_DNS, _body_field(p_body, len, fmt, "DNS", fields.dns, sizeof(fields.dns)));
+    _add_san(&subject, san, DEVID_SAN_URI, _body_field(p_body, len, fmt, "URI", fields.uri, sizeof(fields.uri)));
+    const char *ip = _body_field(p_body, len, fmt, "IP", fields.ip, sizeof(fields.ip));
+    if (fmt == PERSO_FMT_JSON)
+        PersoMetrics_json(PMETRIC_JSON_PJSON, parse_us + esp_timer_get_time() - parse_start, 0, 0);
+    if (ip != NULL)
+    {
+        if (inet_pton(AF_INET, ip, ipaddr) == 1)
+            _add_san_raw(&subject, san, DEVID_SAN_IP, ipaddr, 4);
+        else if (inet_pton(AF_INET6, ip, ipaddr) == 1)
+            _add_san_raw(&subject, san, DEVID_SAN_IP, ipaddr, 16);
+        else
+            ESP_LOGI(TAG, "ignore invalid IP SAN: %s", ip);
+    }
+    ESP_LOGD(TAG, "subject CN=%s O=%s SN=%s SAN entries=%d", subject.p_cn ? subject.p_cn : "",
+             subject.p_o ? subject.p_o : "", subject.p_sn ? subject.p_sn : "", subject.san_cnt);
+    PLOG(TAG, "genCSR: body %u bytes (CBOR %d), parsed in %u us", len, fmt == PERSO_FMT_CBOR, 
+         (unsigned) (esp_timer_get_time() - start));
+
+    if (fmt == PERSO_FMT_CBOR)
+        ret = DeviceID_genCSRDER(p_csr, csrlen, &subject, p_olen);
+    else
+    {
+        ret = DeviceID_genCSR(p_csr, csrlen, &subject);
+        *p_olen = (ret == DEVID_OK) ? strlen((char*) p_csr) : 0;
+    }
+    if (ret == DEVID_OK)
+        _csr_commit(p_reqid, fmt, p_csr, *p_olen);
+    return ret;
+}
+
+//
+//      _gen_csr_respond()
+//      v1 genCSR job: generate the CSR and send it as response
+//
+static void _gen_csr_respond(perso_job_t* p_job)
+{
+    size_t olen = 0;
+
+    if (espPerso_genCSR(p_job->p_body, p_job->len, p_job->fmt, gCertBuf, sizeof(gCertBuf), &olen) != DEVID_OK)
+        httpd_resp_send_err(p_job->req, HTTPD_500_INTERNAL_SERVER_ERROR, "CSR generation failed");
+    else if (p_job->fmt == PERSO_FMT_CBOR)
+    {
+        // {"CSR": h'DER'}: map and key header fit into the PJSON_CHUNK_SIZE spare bytes
+        uint8_t *p_rsp = (uint8_t*) malloc(olen + PJSON_CHUNK_SIZE);
+        pcbor_writer_t w;
+        if (p_rsp == NULL)
+            httpd_resp_send_500(p_job->req);
+        else
         {
-            /* In case of timeout one can choose to retry calling
-             * httpd_req_recv(), but to keep it simple, here we
-             * respond with an HTTP 408 (Request Timeout) error */
-            httpd_resp_send_408(req);
+            pcbor_init(&w, p_rsp, olen + PJSON_CHUNK_SIZE);
+            pcbor_map(&w, 1);
+            pcbor_text(&w, "CSR");
+            pcbor_bytes(&w, gCertBuf, olen);
+            PLOG(TAG, "CSR: %u bytes DER, %u bytes CBOR", olen, w.len);
+            _send_cbor(p_job->req, &w);
+            free(p_rsp);
         }
-        /* In case of error, returning ESP_FAIL will
-         * ensure that the underlying socket is closed */
+    }
+    else
+    {
+        ESP_LOGD(TAG,"CSR Buffer: %s",gCertBuf);
+        PLOG(TAG, "CSR: %u bytes PEM", olen);
+        httpd_resp_send(p_job->req,(char*)gCertBuf, olen);
+    }
+    free(p_job->p_body);
+#ifdef CONFIG_OT_PERSO_ASYNC_CSR
+    httpd_req_async_handler_complete(p_job->req);
+#endif
+    PMETRIC_SINCE(PMETRIC_URI_GENCSR, p_job->start_us);
+}
+
+#ifdef CONFIG_OT_PERSO_ASYNC_CSR
+//
+//      _crypto_worker()
+//      takes crypto jobs from the queue, so TrustPlatform decrypt, key parse and RSA sign 
+//      do not block the httpd task. The job function sends the response.
+//
+static void _crypto_worker(void *p_arg)
+{
+    perso_job_t job;
+
+    while (1)
+    {
+        if (xQueueReceive(s_crypto_queue, &job, portMAX_DELAY) != pdTRUE)
+            continue;
+        PLOG(TAG, "crypto worker: job, %u waiting", uxQueueMessagesWaiting(s_crypto_queue));
+        job.p_fn(&job);
+    }
+}
+
+//
+//      _crypto_worker_start()
+//      create the job queue and the crypto worker once
+//
+static esp_err_t _crypto_worker_start(void)
+{
+    if (s_crypto_queue != NULL)
+        return ESP_OK;
+    s_crypto_queue = xQueueCreate(PERSO_CRYPTO_QUEUE_LEN, sizeof(perso_job_t));
+    if (s_crypto_queue == NULL)
+        return ESP_FAIL;
+    if (xTaskCreatePinnedToCore(_crypto_worker, "perso_crypto", PTASK_CRYPTO_STACK, NULL, PTASK_CRYPTO_PRIORITY, NULL, 
+                                PTASK_CRYPTO_CORE) != pdPASS)
+        return ESP_FAIL;
+    return ESP_OK;
+}
+#endif
+
+//
+//      espPerso_queueJob()
+//      hand a job to the crypto worker; the job is copied
+//      @return:    success: ESP_OK
+//                  failure: ESP_FAIL queue full, ESP_ERR_NOT_SUPPORTED without 
+//                           CONFIG_OT_PERSO_ASYNC_CSR (run p_fn inline)
+//
+esp_err_t espPerso_queueJob(perso_job_t* p_job)
+{
+#ifdef CONFIG_OT_PERSO_ASYNC_CSR
+    if (s_crypto_queue == NULL || xQueueSend(s_crypto_queue, p_job, 0) != pdTRUE)
+    {
+        ESP_LOGI(TAG, "crypto queue full, reject job");
         return ESP_FAIL;
     }
-    else 
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/* Our URI handler function to be called during POST /uri request */
+esp_err_t genCSR_handler(httpd_req_t *req)
+{
+    perso_job_t job = { .p_fn = _gen_csr_respond, .req = req, .fmt = _req_format(req, "Content-Type"), 
+                        .start_us = esp_timer_get_time() };
+
+    PLOG(TAG, "POST: v1/DevID/genCSR");
+
+    if (!espPerso_keyReady())
     {
-        cJSON *msgBuf = cJSON_Parse(content);
-        subname[0] = 0x00;
-     
-        if (cJSON_GetObjectItem(msgBuf, "CN")) 
-        {
-            char *cn = cJSON_GetObjectItem(msgBuf,"CN")->valuestring;
-            strcat (subname,"CN=");
-            strcat (subname,cn);
-            strcat (subname, ",");
-            ESP_LOGI(TAG, "subname= %s",subname);
-            free(cn);
-        }
-        if (cJSON_GetObjectItem(msgBuf, "O")) 
-        {
-            char *o = cJSON_GetObjectItem(msgBuf,"O")->valuestring;
-            strcat (subname,"O=");
-            strcat (subname,o);
-            strcat (subname, ",");
-            ESP_LOGI(TAG, "subname= %s",subname);
-            free(o);   
-        }
-        if (cJSON_GetObjectItem(msgBuf, "SN")) 
-        {
-            char *sn = cJSON_GetObjectItem(msgBuf,"SN")->valuestring;
-            strcat (subname,"serialNumber=");
-            strcat (subname,sn);
-            //strcat (subname, ",");
-            ESP_LOGI(TAG, "subname= %s",subname);
-            free(sn);   
-        }
-        ret = DeviceID_genCSR(gCertBuf, 4096, subname, subname);
-        //cJSON_Delete(msgBuf);
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_send(req, "key generation in progress", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+
+    if (_recv_body(req, &job.p_body, &job.len) != ESP_OK) 
+    {   /* the error response is sent already; ESP_FAIL closes the socket */
+        return ESP_FAIL;
     }
 
-    ESP_LOGI(TAG,"CSR Buffer: %s",gCertBuf);
-    httpd_resp_send(req,(char*)gCertBuf, HTTPD_RESP_USE_STRLEN);
+#ifdef CONFIG_OT_PERSO_ASYNC_CSR
+    // hand the crypto over to the worker; the httpd task is free for the next request
+    if (httpd_req_async_handler_begin(req, &job.req) != ESP_OK)
+    {
+        free(job.p_body);
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    if (espPerso_queueJob(&job) != ESP_OK)
+    {
+        httpd_resp_set_status(job.req, "503 Service Unavailable");
+        httpd_resp_send(job.req, "busy", HTTPD_RESP_USE_STRLEN);
+        free(job.p_body);
+        httpd_req_async_handler_complete(job.req);
+    }
+#else
+    _gen_csr_respond(&job);
+#endif
+    return ESP_OK;
+}
+
+//
+//      _finalize_cbor()
+//      store the DevID (bytes: DER chain, or text like the JSON member) of a CBOR DevIDfinal 
+//      body. A "CA" member is ignored, the trust anchor never comes from the request.
+//
+static esp_err_t _finalize_cbor(const uint8_t* p_body, size_t len, const char** pp_reason)
+{
+    const uint8_t *p_ca = NULL, *p_devID = NULL;
+    size_t calen = 0, devIDlen = 0;
+    int ret;
+    int64_t start = esp_timer_get_time();
+
+    if (pcbor_find(p_body, len, "CA", PCBOR_MAJOR_TEXT, &p_ca, &calen) == PCBOR_OK)
+        ESP_LOGW(TAG, "DevIDfinal: CA member ignored");
+    bool der = (pcbor_get_bytes(p_body, len, "DevID", &p_devID, &devIDlen) == PCBOR_OK);
+    if (!der && pcbor_find(p_body, len, "DevID", PCBOR_MAJOR_TEXT, &p_devID, &devIDlen) != PCBOR_OK)
+        p_devID = NULL;
+    PLOG(TAG, "DevIDfinal CBOR: body %u bytes, DevID %u bytes (DER %d), parsed in %u us", len, devIDlen, 
+         der, (unsigned) (esp_timer_get_time() - start));
+
+    if (p_devID == NULL)
+    {
+        *pp_reason = "DevID missing";
+        return ESP_FAIL;
+    }
+    ret = der ? DeviceID_storeCertDER(p_devID, devIDlen) : DeviceID_storeCert((unsigned char*) p_devID, devIDlen);
+    if (ret != DEVID_OK)
+    {
+        *pp_reason = "DevID rejected";
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+//
+//      _finalize_json()
+//      store the DevID of a JSON DevIDfinal body. The body is unescaped in place. A "CA" 
+//      member is ignored, the trust anchor never comes from the request.
+//
+static esp_err_t _finalize_json(char* p_body, size_t len, const char** pp_reason)
+{
+    char *devID = NULL;
+    size_t devIDlen = 0;
+    const char *p_raw;
+    size_t rawlen = 0;
+    int64_t start;
+
+    PersoMetrics_cjsonBench(p_body, len, s_final_keys);
+    start = esp_timer_get_time();
+    if (pjson_find(p_body, len, "CA", &p_raw, &rawlen) == PJSON_OK)
+        ESP_LOGW(TAG, "DevIDfinal: CA member ignored");
+    if (pjson_find(p_body, len, "DevID", &p_raw, &rawlen) == PJSON_OK)
+        devID = (char*) p_raw;
+    devIDlen = rawlen;
+    if (devID != NULL && pjson_unescape(devID, devIDlen, devID, devIDlen + 1, &devIDlen) != PJSON_OK)
+    {
+        *pp_reason = "malformed JSON";
+        return ESP_FAIL;
+    }
+    PersoMetrics_json(PMETRIC_JSON_PJSON, esp_timer_get_time() - start, 0, 0);
+    PLOG(TAG, "DevIDfinal JSON: body %u bytes, DevID %u bytes, parsed in %u us", len, devIDlen, 
+         (unsigned) (esp_timer_get_time() - start));
+ 
+    if (devID == NULL) 
+    {
+        ESP_LOGI(TAG, "No value DevID found"); 
+        *pp_reason = "DevID missing";
+        return ESP_FAIL;
+    }
+    ESP_LOGD(TAG, "DevID : %s",devID); 
+    if(DeviceID_storeCert((unsigned char*) devID, devIDlen)!= 0)
+    {
+        *pp_reason = "DevID rejected";
+        return ESP_FAIL;
+    }
     return ESP_OK;
 }
 
+//
+//      espPerso_finalize()
+//      store the DevID of a DevIDfinal body and mark the 
+//      device personalised. Once stored, a repeated call succeeds without storing again.
+//      @param  - [Input] p_body = NUL terminated request body, modified (JSON unescape)
+//      @param  - [Input] len = body length
+//      @param  - [Input] fmt = body format
+//      @param  - [Output] pp_reason = error text for the response
+//      @return:    success: ESP_OK
+//                  failure: ESP_FAIL
+//
+esp_err_t espPerso_finalize(char* p_body, size_t len, perso_format_t fmt, const char** pp_reason)
+{
+    esp_err_t ret;
 
+    if (s_stage == PERSO_STAGE_CERT_STORED)
+    {
+        // retry of a DevIDfinal whose response got lost
+        ESP_LOGI(TAG, "DevID already stored, repeat the response");
+        return ESP_OK;
+    }
+    if (fmt == PERSO_FMT_CBOR)
+        ret = _finalize_cbor((const uint8_t*) p_body, len, pp_reason);
+    else
+        ret = _finalize_json(p_body, len, pp_reason);
+    if (ret != ESP_OK)
+        return ret;
 
-esp_err_t devIDfinal_handler(httpd_req_t *req)
+    if (_stage_commit(PERSO_STAGE_CERT_STORED) != ESP_OK)
+    {
+        _perso_signal_fault("status not stored");
+        *pp_reason = "status not stored";
+        return ESP_FAIL;
+    }
+    _mdns_key_state("personalised");
+    xEventGroupSetBits(s_perso_event_group, PERSO_FINAL_BIT);
+    return ESP_OK;
+}
+
+static esp_err_t _devIDfinal(httpd_req_t *req)
 {
     
-    cJSON *rspJSN = NULL;
-    char* content = (char*)malloc(2000);
+    pjson_writer_t rsp;
+    char *content = NULL;
+    size_t content_len = 0;
+    const char *reason = NULL;
+    perso_format_t fmt = _req_format(req, "Content-Type");
         
-    /* Truncate if content length larger than the buffer */
-    size_t recv_size = MIN(req->content_len, 2000);
-    ESP_LOGI(TAG, "\n==================================================================");
-        ESP_LOGI(TAG, "POST: v1/DevID/DevIDfinal: recv_size len: %d",recv_size);
-
-    int ret = httpd_req_recv(req, content, recv_size);
-    if (ret <= 0) 
-    {   /* 0 return value indicates connection closed */
-        /* Check if timeout occurred */
-        if (ret == HTTPD_SOCK_ERR_TIMEOUT) 
-        {
-            /* In case of timeout one can choose to retry calling
-             * httpd_req_recv(), but to keep it simple, here we
-             * respond with an HTTP 408 (Request Timeout) error */
-            httpd_resp_send_408(req);
-        }
-        /* In case of error, returning ESP_FAIL will
-         * ensure that the underlying socket is closed */
+    PLOG(TAG, "POST: v1/DevID/DevIDfinal: content len: %u",req->content_len);
+
+    if (_recv_body(req, &content, &content_len) != ESP_OK) 
+    {   /* the error response is sent already; ESP_FAIL closes the socket */
         return ESP_FAIL;
     }
-    else 
+    PLOG(TAG, "Message recieved");
+    if (espPerso_finalize(content, content_len, fmt, &reason) != ESP_OK)
     {
-        ESP_LOGI(TAG, "Message recieved");
-        cJSON *msgBuf = cJSON_Parse(content);
-     
-        if (cJSON_GetObjectItem(msgBuf, "DevID")) 
-        {
-            char *devIDder = cJSON_GetObjectItem(msgBuf,"DevID")->valuestring;
-            ESP_LOGI(TAG, "DevID : %s",devIDder); 
-            if(DeviceID_storeCert((unsigned char*) devIDder, strlen(devIDder))!= 0)
-                return ESP_FAIL;
-        }
-        else
-        {
-            ESP_LOGI(TAG, "No value DevID found"); 
-            return ESP_FAIL;
-        }
-        cJSON_Delete(msgBuf);
-        ESP_LOGI(TAG, "Ready generate final response");
-
-        rspJSN = cJSON_CreateObject();
-        cJSON_AddStringToObject(rspJSN,"status","Init");
-        char *rsp_json_string = cJSON_Print(rspJSN);
-        ESP_LOGI(TAG," POST response: %s",rsp_json_string);
-        if(httpd_resp_send(req, rsp_json_string  , HTTPD_RESP_USE_STRLEN)!= ESP_OK)
-        {
-            ESP_LOGI(TAG," ERRRO Sending response ");
-            return ESP_FAIL;
-        }
-        uint8_t state = INIT;
-        if( nvs_set_u8(gPERSO, "status", state) != ESP_OK)
-        {
-            while(1)
-            {
-              ESP_LOGI(TAG, "\n############ ERROR DURING PERSO STOP WORKING \n");
-            }
+        free(content);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, reason);
+        return ESP_FAIL;
+    }
+    free(content);
+    PLOG(TAG, "Ready generate final response");
 
-        }
-        nvs_close(gPERSO);
-        free(rsp_json_string);
-        cJSON_Delete(rspJSN);
+    if (fmt == PERSO_FMT_CBOR)
+    {
+        uint8_t buf[24];
+        pcbor_writer_t w;
+
+        pcbor_init(&w, buf, sizeof(buf));
+        pcbor_map(&w, 1);
+        pcbor_text(&w, "status");
+        pcbor_text(&w, "Init");
+        return _send_cbor(req, &w);
+    }
+    pjson_begin(&rsp, req);
+    pjson_str(&rsp,"status","Init");
+    if(pjson_end(&rsp)!= ESP_OK)
+    {
+        ESP_LOGI(TAG," ERRRO Sending response ");
+        return ESP_FAIL;
     }
     return ESP_OK;
 }
 
+esp_err_t devIDfinal_handler(httpd_req_t *req)
+{
+    int64_t start = esp_timer_get_time();
+    esp_err_t ret = _devIDfinal(req);
+
+    PMETRIC_SINCE(PMETRIC_URI_FINAL, start);
+    return ret;
+}
+
+#ifdef CONFIG_OT_PERSO_METRICS
+/* GET /v1/metrics: Prometheus text format, scraped by the station */
+esp_err_t metrics_handler(httpd_req_t *req)
+{
+    int64_t start = esp_timer_get_time();
+    esp_err_t ret = PersoMetrics_send(req);
+
+    PMETRIC_SINCE(PMETRIC_URI_METRICS, start);
+    return ret;
+}
+#endif
+
 
 /* URI handler structure for GET /uri */
 httpd_uri_t uri_status = {
@@ -367,21 +1085,63 @@ httpd_uri_t uri_devIDfinal = {
     .handler  = devIDfinal_handler,
     .user_ctx = NULL
 };
+#ifdef CONFIG_OT_PERSO_METRICS
+/* URI handler structure for GET /uri */
+httpd_uri_t uri_metrics = {
+    .uri      = "/v1/metrics", 
+    .method   = HTTP_GET,
+    .handler  = metrics_handler,
+    .user_ctx = NULL
+};
+#endif
 
 /* Function for starting the webserver */
 httpd_handle_t start_webserver(void)
 {
-    /* Generate default configuration */
+#ifdef CONFIG_OT_PERSO_ASYNC_CSR
+    if (_crypto_worker_start() != ESP_OK)
+    {
+        ESP_LOGE(TAG, "failed to start crypto worker");
+        return NULL;
+    }
+#endif
+
+    /* Generate default configuration, tuned for several stations with kept alive connections */
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.max_open_sockets = PERSO_HTTPD_MAX_SOCKETS;
+#ifdef CONFIG_OT_PERSO_HTTPD_LRU_PURGE
+    config.lru_purge_enable = true;
+#endif
+    config.stack_size = PERSO_HTTPD_STACK;
+    config.task_priority = PERSO_HTTPD_PRIORITY;
+    config.core_id = (PERSO_HTTPD_CORE < 0) ? tskNO_AFFINITY : PERSO_HTTPD_CORE;
+#if PERSO_HTTPD_KA_IDLE > 0
+    config.keep_alive_enable = true;
+    config.keep_alive_idle = PERSO_HTTPD_KA_IDLE;
+    config.keep_alive_interval = PERSO_HTTPD_KA_IDLE;
+    config.keep_alive_count = 3;
+#endif
+    ESP_LOGI(TAG, "httpd: %d sockets, LRU purge %d, stack %d, core %d", config.max_open_sockets, 
+             config.lru_purge_enable, config.stack_size, (int) config.core_id);
     /* Empty handle to esp_http_server */
     httpd_handle_t server = NULL;
     /* Start the httpd server */
+#ifdef CONFIG_OT_PERSO_HTTPS
+    if (PersoTLS_start(&server, &config) == ESP_OK) 
+#else
     if (httpd_start(&server, &config) == ESP_OK) 
+#endif
     {
         /* Register URI handlers */
         httpd_register_uri_handler(server, &uri_status);
         httpd_register_uri_handler(server, &uri_gencsr);
         httpd_register_uri_handler(server, &uri_devIDfinal);
+#ifdef CONFIG_OT_PERSO_METRICS
+        httpd_register_uri_handler(server, &uri_metrics);
+#endif
+#ifdef CONFIG_OT_PERSO_V2_SESSION
+        espPersoWS_register(server);
+#endif
     }
     /* If server failed to start, handle will be NULL */
     if (server == NULL){
@@ -401,78 +1161,103 @@ httpd_handle_t start_webserver(void)
 void espPerso(void)
 {
     int ret = DEVID_ERR_INIT;
-    const char *p_init_seed = "gen_key";
     esp_err_t err; 
-    bool do_perso = false;
+    httpd_handle_t server = NULL;
     
 
     err = nvs_open("status",NVS_READWRITE,&gPERSO);
     if (err != ESP_OK)
+        _perso_fault("open status", err);
+    err = nvs_get_u8(gPERSO,"status",&s_stage);
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+        s_stage = PERSO_STAGE_NONE;
+    else if (err != ESP_OK)
+        _perso_fault("read status", err);
+    ESP_LOGI(TAG, "personalisation stage: %s", _stage_name(s_stage));
+
+    // provisioned fast path: NVS says stored, the TrustStore headers confirm it; 
+    // no keygen, no WiFi, no endpoint
+    if (s_stage == PERSO_STAGE_CERT_STORED)
     {
-        while(1)
+        if (TPinit() != TP_OK)
+            _perso_fault("TrustStore", ESP_FAIL);
+        ret = DeviceID_provisioned();
+        if (ret == DEVID_OK)
         {
-          ESP_LOGI(TAG, "\n############ ERROR DURING Open Status !! STOP WORKING \n");
+            ESP_LOGI(TAG, "provisioned, personalisation skipped");
+        }
+        else if (ret == DEVID_ERR_WRITE_CERT)
+        {
+            ESP_LOGE(TAG, "status stored but no DevID, personalise again with the stored key");
+            s_stage = PERSO_STAGE_KEY_READY;
+        }
+        else
+        {
+            ESP_LOGE(TAG, "status stored but no DevID key, personalise again");
+            s_stage = PERSO_STAGE_NONE;
         }
     }
-    uint8_t state = NOT_INIT;
 
-    err= nvs_get_u8(gPERSO,"status",&state);
-    switch (err) 
-    {
-            case ESP_OK:
-                ESP_LOGI(TAG,"Done\n");
-                ESP_LOGI(TAG,"Restart counter = %d", state);
-                if (state ==NOT_INIT)
-                    do_perso = true;
-                else
-                    do_perso = false;
-                
-                break;
-            case ESP_ERR_NVS_NOT_FOUND:
-                ESP_LOGI(TAG,"The value is not initialized yet!\n");
-                state = NOT_INIT;
-                err = nvs_set_u8(gPERSO, "status", state);    
-                do_perso = true;
-                break;
-            default :
-                ESP_LOGI(TAG,"Error (%s) reading!\n", esp_err_to_name(err));
-                while(1)
-                {
-                  ESP_LOGI(TAG, "\n############ ERROR DURING read status PERSO STOP WORKING \n");
-                }
-    }
-
-
-// Dummy to run everytime into the Perso routing
-
-    do_perso = true;
-
-// Dummy to run everytime into the Perso routing    
-
-    if (do_perso == true)
+    if (s_stage != PERSO_STAGE_CERT_STORED)
     {
+        s_perso_event_group = xEventGroupCreate();
+        if (s_perso_event_group == NULL)
+            _perso_fault("event group", ESP_ERR_NO_MEM);
         ret = DeviceID_open();
         if( ret == DEVID_OK)
         {
             ESP_LOGI(TAG, "\n==================================================================\n");
-            ret = DeviceID_genKey(p_init_seed);
+            // bring up the REST endpoint first, so the station sees the keygen progress
+            // the link stays up for the application, see NetConn
+            if (NetConn_start() != NETCONN_OK)
+                _perso_fault("WiFi", ESP_FAIL);
+            NetConn_wait(portMAX_DELAY);
+#ifdef CONFIG_OT_PERSO_HTTPS
+            // bootstrap certificate first: its fingerprint goes into the mDNS record
+            if (PersoTLS_init() != PERSOTLS_OK)
+                _perso_fault("bootstrap certificate", ESP_FAIL);
+#endif
+#ifdef CONFIG_OT_PERSO_MDNS
+            _mdns_start();
+#endif
+            server = start_webserver();
+            ESP_LOGI(TAG, "\n==================================================================\n");
+            // resume with the key of an interrupted run, the keygen is the most expensive step
+            if (s_stage != PERSO_STAGE_NONE && DeviceID_resumeKey() == DEVID_OK)
+                ret = DEVID_OK;
+            else if ((ret = _gen_key()) == DEVID_OK)
+                _stage_commit(PERSO_STAGE_KEY_READY);
             if( ret == DEVID_OK)
             {
-                ESP_LOGI(TAG, "\n==================================================================\n");
-                wifi_connection();
-                start_webserver();
-                while(1);
+                _mdns_key_state("ready");
+#ifdef CONFIG_OT_PERSO_V2_SESSION
+                // push csr-ready to the open v2 sessions
+                espPersoWS_keyReady();
+#endif
+                // refill the key pool while the device waits for the station
+                KeyPool_start();
+#ifdef CONFIG_OT_PERSO_PUSH
+                if (espPersoPush_run() != ESP_OK)
+                    ESP_LOGI(TAG, "push failed, wait for the station");
+#endif
+                // sleep until a handler stored the DevID (or failed fatally)
+                if (_perso_wait() & PERSO_FAULT_BIT)
+                    _perso_fault(s_fault_reason, ESP_FAIL);
+
+                ESP_LOGI(TAG, "DevID stored, hand over to the application");
+                vTaskDelay(pdMS_TO_TICKS(PERSO_SHUTDOWN_GRACE_MS));
+                // httpd_stop() waits for a running handler, so the final response is sent
+                if (server != NULL)
+                    httpd_stop(server);
+#ifdef CONFIG_OT_PERSO_MDNS
+                mdns_free();
+#endif
                 DeviceID_close();
             }
         }
         if (ret != DEVID_OK)
-        {
-            while(1)
-            {
-              ESP_LOGI(TAG, "\n############ ERROR DURING  PERSO STOP WORKING \n");
-            }
-        
-        }
+            _perso_fault((ret == DEVID_ERR_CANCELLED && s_fault_reason != NULL) ? s_fault_reason : "DeviceID", ret);
     }
+    nvs_close(gPERSO);
 
 }
@@ -18,6 +18,10 @@
 #ifndef __ESPPERSO_H__
 #define __ESPPERSO_H__
 
+#include <stdbool.h>
+#include "nvs.h"
+#include "esp_http_server.h"
+#include "PersoJSON.h"
 
 
 // State Definition for the Main Process Task 
@@ -38,6 +42,37 @@ enum STATE
 #define NOT_INIT             0xFF
 #define INIT                 0x00   
 
+// personalisation stages, persisted as NVS "status"; the end points keep the NOT_INIT / INIT 
+// values, so a device personalised by an older firmware reads as CERT_STORED
+#define PERSO_STAGE_NONE            NOT_INIT        // nothing committed, start with the keygen
+#define PERSO_STAGE_KEY_READY       0x01            // DevID key in the TrustStore
+#define PERSO_STAGE_CSR_ISSUED      0x02            // CSR sent, cached with its RequestID
+#define PERSO_STAGE_CERT_STORED     INIT            // DevID stored, device personalised
+
+#define PERSO_REQID_MAX             65              // RequestID member of genCSR, incl. NUL
+
+
+// body format of a request, negotiated by Content-Type / Accept
+typedef enum
+{
+    PERSO_FMT_JSON = 0,
+    PERSO_FMT_CBOR                      // application/cbor, certificates as DER byte strings
+} perso_format_t;
+
+// crypto job, executed by the crypto worker (or inline without CONFIG_OT_PERSO_ASYNC_CSR)
+typedef struct perso_job perso_job_t;
+struct perso_job
+{
+    void (*p_fn)(perso_job_t* p_job);   // job function, must free p_body
+    httpd_req_t *req;                   // v1: async copy of the request
+    httpd_handle_t hd;                  // v2: server and socket of the session
+    int fd;
+    char *p_body;                       // NUL terminated request body, owned by the job
+    size_t len;
+    perso_format_t fmt;                 // body and response format
+    int64_t start_us;                   // request start, for the latency metrics
+};
+
 
 
 //
@@ -58,11 +93,17 @@ enum STATE
 
 // Global var definition
 extern nvs_handle_t gPERSO;
+extern unsigned char gCertBuf[4096];            // CSR buffer of the crypto jobs
 
 
 
 /***********      function declaration       ************/
 void espPerso(void);
+bool espPerso_keyReady(void);
+bool espPerso_status(pjson_writer_t* p_w);
+int espPerso_genCSR(const char* p_body, size_t len, perso_format_t fmt, unsigned char* p_csr, uint16_t csrlen, size_t* p_olen);
+esp_err_t espPerso_finalize(char* p_body, size_t len, perso_format_t fmt, const char** pp_reason);
+esp_err_t espPerso_queueJob(perso_job_t* p_job);
 
 
 
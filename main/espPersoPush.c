@@ -0,0 +1,265 @@
+//
+//  espPersoPush.c
+//  Push mode of the personalisation. Once the key is ready the device POSTs 
+//  {"SN":<factory MAC>,"CSR":<PEM>} to CTRL_COMP_URL:CTRL_COMP_PORT and 
+//  expects the DevIDfinal body {"DevID":..} in the response, so the 
+//  station never has to scan for or poll the device.
+//  Connection errors, timeouts, 408, 429 and 5xx are retried with an 
+//  exponential, jittered backoff; other status codes end the push.
+//
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#include "sdkconfig.h"
+#define LOG_LOCAL_LEVEL CONFIG_OT_LOG_LEVEL_PERSO
+
+#include "esp_log.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "esp_mac.h"
+#include "esp_random.h"
+#include "esp_http_client.h"
+
+#include "DeviceID.h"
+#include "espPerso.h"
+#include "espPersoPush.h"
+#include "PersoJSON.h"
+
+#ifdef CONFIG_OT_PERSO_PUSH
+
+#define PERSO_PUSH_RETRIES      CONFIG_OT_PERSO_PUSH_RETRIES
+#define PERSO_PUSH_BACKOFF_MS   CONFIG_OT_PERSO_PUSH_BACKOFF_MS
+#define PERSO_PUSH_BACKOFF_MAX  CONFIG_OT_PERSO_PUSH_BACKOFF_MAX_MS
+#define PERSO_PUSH_TIMEOUT_MS   CONFIG_OT_PERSO_PUSH_TIMEOUT_MS
+#define PERSO_PUSH_MAX_RSP      CONFIG_OT_PERSO_MAX_BODY
+
+
+// Global var definition section:
+static const char *TAG = "PERSO_PUSH";
+
+
+
+//
+//      _backoff_ms()
+//      exponential backoff with equal jitter: a random delay in [cap/2, cap], 
+//      cap = base * 2^(attempt-1) up to the Kconfig maximum. The jitter keeps the 
+//      devices of a power cycled line from retrying in lock step.
+//
+static uint32_t _backoff_ms(int attempt)
+{
+    uint32_t cap = PERSO_PUSH_BACKOFF_MS;
+
+    while (--attempt > 0 && cap < PERSO_PUSH_BACKOFF_MAX)
+        cap *= 2;
+    if (cap > PERSO_PUSH_BACKOFF_MAX)
+        cap = PERSO_PUSH_BACKOFF_MAX;
+    return cap / 2 + esp_random() % (cap / 2 + 1);
+}
+
+static bool _retryable(int status)
+{
+    return status == 408 || status == 429 || status >= 500;
+}
+
+static void _push_url(char* p_url, size_t len)
+{
+    if (strstr(CTRL_COMP_URL, "://") != NULL)
+        snprintf(p_url, len, "%s%s", CTRL_COMP_URL, CONFIG_OT_PERSO_PUSH_PATH);
+    else
+        snprintf(p_url, len, "http://%s:%d%s", CTRL_COMP_URL, CTRL_COMP_PORT, CONFIG_OT_PERSO_PUSH_PATH);
+}
+
+//
+//      _build_request()
+//      generate the CSR (subject CN/SN = factory MAC) and wrap it in the push body
+//      @param  - [Output] pp_body = allocated body, to be freed by the caller
+//      @param  - [Output] p_len = body length
+//      @return:    success: ESP_OK
+//                  failure: ESP_FAIL
+//
+static esp_err_t _build_request(char** pp_body, size_t* p_len)
+{
+    pjson_writer_t w;
+    uint8_t mac[6];
+    char sn[13];
+    char subject[64];
+    size_t csrlen = 0;
+
+    *pp_body = NULL;
+    if (esp_read_mac(mac, ESP_MAC_EFUSE_FACTORY) != ESP_OK)
+        return ESP_FAIL;
+    snprintf(sn, sizeof(sn), "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+    // same subject members as a station genCSR body
+    pjson_begin_buf(&w, subject, sizeof(subject));
+    pjson_str(&w, "CN", sn);
+    pjson_str(&w, "SN", sn);
+    if (pjson_end(&w) != ESP_OK ||
+        espPerso_genCSR(subject, w.olen, PERSO_FMT_JSON, gCertBuf, sizeof(gCertBuf), &csrlen) != DEVID_OK)
+    {
+        ESP_LOGE(TAG, "CSR generation failed");
+        return ESP_FAIL;
+    }
+
+    // the PEM escapes grow by one byte per line break at most
+    size_t size = 2 * csrlen + sizeof(subject);
+    char *p_body = (char*) malloc(size);
+    if (p_body == NULL)
+        return ESP_FAIL;
+    pjson_begin_buf(&w, p_body, size);
+    pjson_str(&w, "SN", sn);
+    pjson_str(&w, "CSR", (char*) gCertBuf);
+    if (pjson_end(&w) != ESP_OK)
+    {
+        free(p_body);
+        return ESP_FAIL;
+    }
+    *pp_body = p_body;
+    *p_len = w.olen;
+    return ESP_OK;
+}
+
+//
+//      _post()
+//      one POST to the control computer
+//      @param  - [Output] p_status = HTTP status, 0 if no response was received
+//      @param  - [Output] pp_rsp = allocated, NUL terminated response body (status 200 only)
+//      @return:    success: ESP_OK
+//                  failure: esp_http_client error, ESP_ERR_INVALID_SIZE
+//
+static esp_err_t _post(const char* p_url, const char* p_body, size_t len, int* p_status, char** pp_rsp, size_t* p_rsplen)
+{
+    esp_http_client_config_t config = {
+        .url = p_url,
+        .method = HTTP_METHOD_POST,
+        .timeout_ms = PERSO_PUSH_TIMEOUT_MS,
+    };
+    esp_err_t err;
+    int64_t content_len;
+    size_t written = 0, got = 0;
+
+    *p_status = 0;
+    *pp_rsp = NULL;
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL)
+        return ESP_FAIL;
+    esp_http_client_set_header(client, "Content-Type", "application/json");
+    err = esp_http_client_open(client, len);
+    while (err == ESP_OK && written < len)
+    {
+        int ret = esp_http_client_write(client, p_body + written, len - written);
+        if (ret <= 0)
+            err = ESP_FAIL;
+        else
+            written += ret;
+    }
+    if (err == ESP_OK)
+    {
+        content_len = esp_http_client_fetch_headers(client);
+        *p_status = esp_http_client_get_status_code(client);
+        if (content_len < 0)
+            err = ESP_FAIL;
+        else if (*p_status == 200)
+        {
+            // content_len is 0 for a chunked response: read up to the body limit
+            size_t cap = (content_len > 0) ? (size_t) content_len : PERSO_PUSH_MAX_RSP;
+            char *p_rsp = NULL;
+            if (cap > PERSO_PUSH_MAX_RSP || (p_rsp = (char*) malloc(cap + 1)) == NULL)
+                err = ESP_ERR_INVALID_SIZE;
+            while (err == ESP_OK && got < cap)
+            {
+                int ret = esp_http_client_read(client, p_rsp + got, cap - got);
+                if (ret < 0)
+                    err = ESP_FAIL;
+                if (ret <= 0)
+                    break;
+                got += ret;
+            }
+            if (err == ESP_OK)
+            {
+                p_rsp[got] = 0x00;
+                *pp_rsp = p_rsp;
+                *p_rsplen = got;
+            }
+            else
+                free(p_rsp);
+        }
+    }
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+    return err;
+}
+
+//
+//      espPersoPush_run()
+//      push the CSR to the control computer and store the returned DevID. 
+//      Call once the DevID key is ready.
+//      @return:    success: ESP_OK, device is personalised
+//                  failure: ESP_FAIL retries exhausted or rejected
+//
+esp_err_t espPersoPush_run(void)
+{
+    char url[PERSO_PUSH_URL_MAX];
+    char *p_body = NULL, *p_rsp = NULL;
+    size_t len = 0, rsplen = 0;
+    const char *reason = NULL;
+    int status = 0;
+    esp_err_t ret = ESP_FAIL;
+
+    _push_url(url, sizeof(url));
+    if (_build_request(&p_body, &len) != ESP_OK)
+        return ESP_FAIL;
+
+    for (int attempt = 0; attempt <= PERSO_PUSH_RETRIES; attempt++)
+    {
+        if (attempt > 0)
+        {
+            uint32_t delay = _backoff_ms(attempt);
+            ESP_LOGI(TAG, "retry %d of %d in %" PRIu32 " ms", attempt, PERSO_PUSH_RETRIES, delay);
+            vTaskDelay(pdMS_TO_TICKS(delay));
+        }
+        ESP_LOGI(TAG, "POST %s (%d bytes)", url, len);
+        esp_err_t err = _post(url, p_body, len, &status, &p_rsp, &rsplen);
+        if (err == ESP_OK && status == 200)
+        {
+            if (espPerso_finalize(p_rsp, rsplen, PERSO_FMT_JSON, &reason) == ESP_OK)
+            {
+                ESP_LOGI(TAG, "DevID stored");
+                ret = ESP_OK;
+            }
+            else
+                ESP_LOGE(TAG, "DevID response rejected: %s", reason);
+            free(p_rsp);
+            break;
+        }
+        ESP_LOGI(TAG, "push failed: %s, status %d", esp_err_to_name(err), status);
+        if (err == ESP_ERR_INVALID_SIZE || (status != 0 && !_retryable(status)))
+            break;
+    }
+    free(p_body);
+    return ret;
+}
+
+#else
+
+esp_err_t espPersoPush_run(void)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif // CONFIG_OT_PERSO_PUSH
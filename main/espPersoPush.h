@@ -0,0 +1,34 @@
+//
+//  espPersoPush.h
+//  device initiated personalisation: POST the CSR to the control computer
+//
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#ifndef __ESPPERSOPUSH_H__
+#define __ESPPERSOPUSH_H__
+
+#include "esp_err.h"
+
+
+/***********      Global definition       ************/
+#define PERSO_PUSH_URL_MAX      128
+
+
+
+/***********      function declaration       ************/
+esp_err_t espPersoPush_run(void);
+
+
+
+#endif // __ESPPERSOPUSH_H__
@@ -0,0 +1,411 @@
+//
+//  espPersoWS.c
+//  v2 personalisation session. The station opens one WebSocket per device on 
+//  PERSO_WS_URI and runs the whole exchange on it:
+//
+//      device  -> {"op":"status"|"csr-ready", ...}     on connect, csr-ready again once the key is ready
+//      station -> {"op":"status","id":"1"}             -> {"op":"status","id":"1","status":...}
+//      station -> {"op":"genCSR","id":"2","CN":...}    -> {"op":"csr","id":"2","csr":"-----BEGIN..."}
+//      station -> {"op":"final","id":"3","DevID":...}  -> {"op":"final-ack","id":"3","status":"Init"}
+//                                                      or {"op":"error","id":..,"msg":...}
+//
+//  Members besides "op" and "id" are the ones of the v1 genCSR / DevIDfinal bodies. 
+//  The optional "id" string is echoed, so the station can pipeline requests and 
+//  keep sessions to several devices open at the same time.
+//
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#include "sdkconfig.h"
+#define LOG_LOCAL_LEVEL CONFIG_OT_LOG_LEVEL_PERSO
+
+#include "esp_log.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "sdkconfig.h"
+#include "esp_http_server.h"
+
+#include "DeviceID.h"
+#include "espPerso.h"
+#include "espPersoWS.h"
+#include "PersoJSON.h"
+#include "PersoMetrics.h"
+#include "PersoLog.h"
+
+#ifdef CONFIG_OT_PERSO_V2_SESSION
+
+#define PERSO_WS_ID_MAX         33
+#define PERSO_WS_OP_MAX         16
+#define PERSO_WS_BROADCAST      -1
+
+// outgoing frame, sent by httpd_queue_work() on the httpd task
+typedef struct
+{
+    httpd_handle_t hd;
+    int fd;                                     // session socket or PERSO_WS_BROADCAST
+    size_t len;
+    char text[];
+} ws_msg_t;
+
+
+// Global var definition section:
+static const char *TAG = "PERSO_WS";
+
+static httpd_handle_t s_server = NULL;
+
+
+
+static esp_err_t _send_frame(httpd_handle_t hd, int fd, char* p_text, size_t len)
+{
+    httpd_ws_frame_t frame;
+
+    if (httpd_ws_get_fd_info(hd, fd) != HTTPD_WS_CLIENT_WEBSOCKET)
+        return ESP_ERR_INVALID_STATE;
+    memset(&frame, 0x00, sizeof(frame));
+    frame.final = true;
+    frame.type = HTTPD_WS_TYPE_TEXT;
+    frame.payload = (uint8_t*) p_text;
+    frame.len = len;
+    return httpd_ws_send_frame_async(hd, fd, &frame);
+}
+
+//
+//      _send_work()
+//      httpd work item: send a queued message to its session or to all sessions
+//
+static void _send_work(void* p_arg)
+{
+    ws_msg_t *p_msg = (ws_msg_t*) p_arg;
+
+    if (p_msg->fd != PERSO_WS_BROADCAST)
+    {
+        if (_send_frame(p_msg->hd, p_msg->fd, p_msg->text, p_msg->len) != ESP_OK)
+            ESP_LOGI(TAG, "session %d gone, drop message", p_msg->fd);
+    }
+    else
+    {
+        int fds[CONFIG_LWIP_MAX_SOCKETS];
+        size_t cnt = CONFIG_LWIP_MAX_SOCKETS;
+
+        if (httpd_get_client_list(p_msg->hd, &cnt, fds) == ESP_OK)
+        {
+            for (size_t i = 0; i < cnt; i++)
+                _send_frame(p_msg->hd, fds[i], p_msg->text, p_msg->len);
+        }
+    }
+    free(p_msg);
+}
+
+static ws_msg_t* _msg_alloc(httpd_handle_t hd, int fd, size_t size)
+{
+    ws_msg_t *p_msg = (ws_msg_t*) malloc(sizeof(ws_msg_t) + size);
+
+    if (p_msg != NULL)
+    {
+        p_msg->hd = hd;
+        p_msg->fd = fd;
+        p_msg->len = 0;
+    }
+    return p_msg;
+}
+
+static void _msg_post(ws_msg_t* p_msg)
+{
+    if (p_msg == NULL)
+        return;
+    if (httpd_queue_work(p_msg->hd, _send_work, p_msg) != ESP_OK)
+    {
+        ESP_LOGI(TAG, "httpd work queue full, drop message");
+        free(p_msg);
+    }
+}
+
+static void _begin(pjson_writer_t* p_w, char* p_out, size_t outlen, const char* p_op, const char* p_id)
+{
+    pjson_begin_buf(p_w, p_out, outlen);
+    pjson_str(p_w, "op", p_op);
+    if (p_id != NULL && p_id[0] != 0x00)
+        pjson_str(p_w, "id", p_id);
+}
+
+//
+//      _msg_status()
+//      status message; "csr-ready" once the key is ready, so the station can send genCSR
+//
+static ws_msg_t* _msg_status(httpd_handle_t hd, int fd)
+{
+    pjson_writer_t w;
+    ws_msg_t *p_msg = _msg_alloc(hd, fd, PERSO_WS_MSG_SIZE);
+
+    if (p_msg == NULL)
+        return NULL;
+    _begin(&w, p_msg->text, PERSO_WS_MSG_SIZE, espPerso_keyReady() ? "csr-ready" : "status", NULL);
+    espPerso_status(&w);
+    pjson_end(&w);
+    p_msg->len = w.olen;
+    return p_msg;
+}
+
+static ws_msg_t* _msg_error(httpd_handle_t hd, int fd, const char* p_id, const char* p_reason)
+{
+    pjson_writer_t w;
+    ws_msg_t *p_msg = _msg_alloc(hd, fd, PERSO_WS_MSG_SIZE);
+
+    if (p_msg == NULL)
+        return NULL;
+    _begin(&w, p_msg->text, PERSO_WS_MSG_SIZE, "error", p_id);
+    pjson_str(&w, "msg", p_reason);
+    pjson_end(&w);
+    p_msg->len = w.olen;
+    return p_msg;
+}
+
+//
+//      _csr_job()
+//      genCSR job of a session, runs on the crypto worker. The CSR is returned in a 
+//      "csr" message on the session socket.
+//
+static void _csr_job(perso_job_t* p_job)
+{
+    pjson_writer_t w;
+    char id[PERSO_WS_ID_MAX] = "";
+    ws_msg_t *p_msg = NULL;
+    size_t olen = 0;
+
+    pjson_get_string(p_job->p_body, p_job->len, "id", id, sizeof(id));
+    if (espPerso_genCSR(p_job->p_body, p_job->len, PERSO_FMT_JSON, gCertBuf, sizeof(gCertBuf), &olen) == DEVID_OK)
+    {
+        // the PEM escapes grow by one byte per line break at most
+        size_t size = 2 * olen + PERSO_WS_MSG_SIZE;
+        p_msg = _msg_alloc(p_job->hd, p_job->fd, size);
+        if (p_msg != NULL)
+        {
+            _begin(&w, p_msg->text, size, "csr", id);
+            pjson_str(&w, "csr", (char*) gCertBuf);
+            if (pjson_end(&w) == ESP_OK)
+                p_msg->len = w.olen;
+            else
+            {
+                free(p_msg);
+                p_msg = NULL;
+            }
+        }
+    }
+    if (p_msg == NULL)
+        p_msg = _msg_error(p_job->hd, p_job->fd, id, "CSR generation failed");
+    free(p_job->p_body);
+    _msg_post(p_msg);
+}
+
+//
+//      _reply()
+//      send a message built on the stack directly on the request (httpd task)
+//
+static esp_err_t _reply(httpd_req_t *req, pjson_writer_t* p_w)
+{
+    httpd_ws_frame_t frame;
+
+    if (pjson_end(p_w) != ESP_OK)
+        return ESP_FAIL;
+    memset(&frame, 0x00, sizeof(frame));
+    frame.final = true;
+    frame.type = HTTPD_WS_TYPE_TEXT;
+    frame.payload = (uint8_t*) p_w->p_out;
+    frame.len = p_w->olen;
+    return httpd_ws_send_frame(req, &frame);
+}
+
+static esp_err_t _reply_error(httpd_req_t *req, const char* p_id, const char* p_reason)
+{
+    pjson_writer_t w;
+    char buf[PERSO_WS_MSG_SIZE];
+
+    ESP_LOGI(TAG, "session %d: %s", httpd_req_to_sockfd(req), p_reason);
+    _begin(&w, buf, sizeof(buf), "error", p_id);
+    pjson_str(&w, "msg", p_reason);
+    return _reply(req, &w);
+}
+
+//
+//      _recv_frame()
+//      read one text frame into a right-sized, NUL terminated buffer
+//      @return:    success: ESP_OK
+//                  failure: ESP_FAIL (socket error, closes the session), ESP_ERR_INVALID_SIZE
+//
+static esp_err_t _recv_frame(httpd_req_t *req, char** pp_body, size_t* p_len)
+{
+    httpd_ws_frame_t frame;
+    esp_err_t ret;
+
+    *pp_body = NULL;
+    memset(&frame, 0x00, sizeof(frame));
+    frame.type = HTTPD_WS_TYPE_TEXT;
+    // len 0 only reads the frame header
+    ret = httpd_ws_recv_frame(req, &frame, 0);
+    if (ret != ESP_OK)
+        return ESP_FAIL;
+    if (frame.type != HTTPD_WS_TYPE_TEXT || frame.len == 0 || frame.len > CONFIG_OT_PERSO_MAX_BODY)
+    {
+        ESP_LOGI(TAG, "ignore frame type %d, %d bytes", frame.type, frame.len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    frame.payload = (uint8_t*) malloc(frame.len + 1);
+    if (frame.payload == NULL)
+        return ESP_ERR_INVALID_SIZE;
+    ret = httpd_ws_recv_frame(req, &frame, frame.len);
+    if (ret != ESP_OK)
+    {
+        free(frame.payload);
+        return ESP_FAIL;
+    }
+    frame.payload[frame.len] = 0x00;
+    *pp_body = (char*) frame.payload;
+    *p_len = frame.len;
+    return ESP_OK;
+}
+
+//
+//      _session_frame()
+//      handshake and one message per call
+//
+static esp_err_t _session_frame(httpd_req_t *req)
+{
+    pjson_writer_t w;
+    char buf[PERSO_WS_MSG_SIZE];
+    char op[PERSO_WS_OP_MAX] = "";
+    char id[PERSO_WS_ID_MAX] = "";
+    char *p_body = NULL;
+    size_t len = 0;
+    const char *reason = NULL;
+    esp_err_t ret;
+
+    if (req->method == HTTP_GET)
+    {
+        PLOG(TAG, "session %d opened", httpd_req_to_sockfd(req));
+        _msg_post(_msg_status(req->handle, httpd_req_to_sockfd(req)));
+        return ESP_OK;
+    }
+
+    ret = _recv_frame(req, &p_body, &len);
+    if (ret == ESP_ERR_INVALID_SIZE)
+    {   /* the payload is still in the socket, close the session */
+        _reply_error(req, NULL, "invalid frame");
+        return ESP_FAIL;
+    }
+    if (ret != ESP_OK)
+        return ESP_FAIL;
+
+    pjson_get_string(p_body, len, "id", id, sizeof(id));
+    if (pjson_get_string(p_body, len, "op", op, sizeof(op)) != PJSON_OK)
+    {
+        free(p_body);
+        return _reply_error(req, id, "op missing");
+    }
+    ESP_LOGI(TAG, "session %d: op %s id %s", httpd_req_to_sockfd(req), op, id);
+
+    if (strcmp(op, "status") == 0)
+    {
+        free(p_body);
+        _begin(&w, buf, sizeof(buf), "status", id);
+        espPerso_status(&w);
+        return _reply(req, &w);
+    }
+    if (strcmp(op, "genCSR") == 0)
+    {
+        if (!espPerso_keyReady())
+        {
+            free(p_body);
+            return _reply_error(req, id, "key generation in progress");
+        }
+        perso_job_t job = { .p_fn = _csr_job, .req = NULL, .hd = req->handle, 
+                            .fd = httpd_req_to_sockfd(req), .p_body = p_body, .len = len, 
+                            .fmt = PERSO_FMT_JSON, .start_us = esp_timer_get_time() };
+        ret = espPerso_queueJob(&job);
+        if (ret == ESP_ERR_NOT_SUPPORTED)
+            _csr_job(&job);
+        else if (ret != ESP_OK)
+        {
+            free(p_body);
+            return _reply_error(req, id, "busy");
+        }
+        return ESP_OK;
+    }
+    if (strcmp(op, "final") == 0)
+    {
+        ret = espPerso_finalize(p_body, len, PERSO_FMT_JSON, &reason);
+        free(p_body);
+        if (ret != ESP_OK)
+            return _reply_error(req, id, reason);
+        _begin(&w, buf, sizeof(buf), "final-ack", id);
+        pjson_str(&w, "status", "Init");
+        return _reply(req, &w);
+    }
+    free(p_body);
+    return _reply_error(req, id, "unknown op");
+}
+
+//
+//      _session_handler()
+//      WebSocket handler; the latency covers the inline part of a message, the CSR 
+//      itself is signed on the crypto worker
+//
+static esp_err_t _session_handler(httpd_req_t *req)
+{
+    int64_t start = esp_timer_get_time();
+    esp_err_t ret = _session_frame(req);
+
+    PMETRIC_SINCE(PMETRIC_URI_SESSION, start);
+    return ret;
+}
+
+static const httpd_uri_t uri_session = {
+    .uri        = PERSO_WS_URI,
+    .method     = HTTP_GET,
+    .handler    = _session_handler,
+    .user_ctx   = NULL,
+    .is_websocket = true
+};
+
+
+
+//
+//      espPersoWS_register()
+//      register the v2 session endpoint on the personalisation server
+//      @param  - [Input] server = running httpd
+//      @return:    success: ESP_OK
+//                  failure: httpd_register_uri_handler() error
+//
+esp_err_t espPersoWS_register(httpd_handle_t server)
+{
+    esp_err_t ret = httpd_register_uri_handler(server, &uri_session);
+
+    if (ret == ESP_OK)
+    {
+        s_server = server;
+        ESP_LOGI(TAG, "v2 session endpoint %s", PERSO_WS_URI);
+    }
+    return ret;
+}
+
+//
+//      espPersoWS_keyReady()
+//      push csr-ready to all open sessions, called once the DevID key is generated
+//
+void espPersoWS_keyReady(void)
+{
+    if (s_server != NULL)
+        _msg_post(_msg_status(s_server, PERSO_WS_BROADCAST));
+}
+
+#endif // CONFIG_OT_PERSO_V2_SESSION
@@ -0,0 +1,37 @@
+//
+//  espPersoWS.h
+//  v2 personalisation session: status, CSR and finalize over one WebSocket
+//
+//  
+//  Created by Andreas Philipp on 11.07.2023
+//  Copyright © 2023 Keyfactor
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may   
+// not use this file except in compliance with the License.  You may obtain a 
+// copy of the License at http://www.apache.org/licenses/LICENSE-2.0.  Unless 
+// required by applicable law or agreed to in writing, software distributed   
+// under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES   
+// OR CONDITIONS OF ANY KIND, either express or implied. See the License for  
+// thespecific language governing permissions and limitations under the       
+// License.     
+
+#ifndef __ESPPERSOWS_H__
+#define __ESPPERSOWS_H__
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+
+/***********      Global definition       ************/
+#define PERSO_WS_URI            "/v2/DevID/session"
+#define PERSO_WS_MSG_SIZE       256             // status, ack and error messages
+
+
+
+/***********      function declaration       ************/
+esp_err_t espPersoWS_register(httpd_handle_t server);
+void espPersoWS_keyReady(void);
+
+
+
+#endif // __ESPPERSOWS_H__
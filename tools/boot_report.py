@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+#
+#  boot_report.py
+#  Compares the boot phase records of two or more boots side by side, e.g. a
+#  personalising boot against a provisioned boot. Each input is either a serial
+#  capture (idf.py monitor | tee boot.log) holding the "PersoBoot:" dump of the
+#  ready phase or the "boot" console command, or a scrape of /v1/metrics with
+#  the perso_boot_phase_seconds series. The last record of each file is used;
+#  --previous takes the previous boot record of the dump instead.
+#
+#  usage: boot_report.py perso.log provisioned.log [--previous]
+#
+#  Copyright (c) 2023 Keyfactor
+#  Licensed under the Apache License, Version 2.0
+
+import argparse
+import re
+
+PHASES = ["app_main", "nvs_init", "tp_mount", "tp_key", "rng_seed", "wifi_start",
+          "wifi_connect", "wifi_ip", "first_tls", "perso_done", "ready"]
+
+RE_HEAD = re.compile(r"(?:PersoBoot: (this|previous) )?boot #(\d+), reset reason (\d+)")
+RE_PHASE = re.compile(r"^\s*(?:\S+ \(\d+\) PersoBoot: )?\s*([a-z_]+)\s+([0-9.]+) ms\s+\+")
+RE_METRIC = re.compile(r'^perso_boot_phase_seconds\{phase="([a-z_]+)"\}\s+([0-9.eE+-]+)')
+
+
+def parse(path, previous):
+    records = []
+    current = None
+    with open(path, errors="replace") as f:
+        for raw in f:
+            line = re.sub(r"\x1b\[[0-9;]*m", "", raw.rstrip())
+            m = RE_HEAD.search(line)
+            if m:
+                which = m.group(1) or "this"
+                current = {"which": which, "boot": int(m.group(2)), "phases": {}}
+                records.append(current)
+                continue
+            m = RE_METRIC.match(line)
+            if m:
+                if current is None or current["which"] != "metrics":
+                    current = {"which": "metrics", "boot": None, "phases": {}}
+                    records.append(current)
+                current["phases"][m.group(1)] = float(m.group(2)) * 1000.0
+                continue
+            m = RE_PHASE.match(line)
+            if m and current is not None and m.group(1) in PHASES:
+                current["phases"][m.group(1)] = float(m.group(2))
+    want = "previous" if previous else "this"
+    for rec in reversed(records):
+        if rec["phases"] and rec["which"] in (want, "metrics"):
+            return rec
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="boot phase comparison")
+    parser.add_argument("files", nargs="+", help="serial capture or /v1/metrics scrape, one per boot")
+    parser.add_argument("--previous", action="store_true", help="use the previous boot record of a dump")
+    args = parser.parse_args()
+
+    records = []
+    for path in args.files:
+        rec = parse(path, args.previous)
+        if rec is None:
+            parser.error("%s: no boot record found" % path)
+        records.append(rec)
+
+    width = max(12, max(len(p) for p in args.files))
+    print("%-13s" % "phase" + "".join(" %*s" % (width, p[-width:]) for p in args.files)
+          + ("  %10s" % "delta" if len(records) == 2 else ""))
+    for phase in PHASES:
+        values = [rec["phases"].get(phase) for rec in records]
+        if all(v is None for v in values):
+            continue
+        row = "%-13s" % phase
+        row += "".join(" %*s" % (width, "-" if v is None else "%.1f ms" % v) for v in values)
+        if len(values) == 2 and None not in values:
+            row += "  %+7.1f ms" % (values[1] - values[0])
+        print(row)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,314 @@
+#!/usr/bin/env python3
+#
+#  perso_line.py
+#  Host side simulation of an imprinting line, for capacity planning of the
+#  stations. One worker per device slot runs the personalisation sequence
+#  status (poll until the key is ready) -> genCSR -> stub CA -> DevIDfinal
+#  and the tool reports devices/hour and per phase latency percentiles.
+#
+#  --simulate N starts N simulated devices on loopback ports. They speak the
+#  v1 REST protocol of espPerso.c: 503 while the key is generated, PEM CSR,
+#  RequestID idempotency and the {"status":"Init"} final response. After the
+#  final response a simulated device restarts as the next unit on the line.
+#  Key and CSR are real (openssl), --keygen-ms adds the device keygen time.
+#  Without --simulate the slots are real devices (--host, one unit each);
+#  their free heap low watermark (status heap_min) is reported.
+#
+#  The stub CA is an EC P-256 CA in a temporary directory, signed by openssl.
+#  The device never takes the CA from DevIDfinal: real devices verify the chain
+#  only against a built in or pre-provisioned bundle (OT_DEVID_CA_BUNDLE).
+#
+#  usage: perso_line.py --simulate 8 --units 20 [--keygen-ms 6000]
+#         perso_line.py --host 192.168.3.240 --host 192.168.3.241
+#
+#  Copyright (c) 2023 Keyfactor
+#  Licensed under the Apache License, Version 2.0
+
+import argparse
+import http.client
+import http.server
+import json
+import os
+import random
+import resource
+import shutil
+import subprocess
+import tempfile
+import threading
+import time
+import uuid
+
+from perso_load import percentile
+
+PHASES = ("keygen", "genCSR", "sign", "final", "total")
+
+
+def openssl(*args, data=None):
+    return subprocess.run(("openssl",) + args, input=data, capture_output=True, check=True).stdout
+
+
+class StubCA:
+    """EC P-256 issuing CA; signs the device CSRs as DevID certificates"""
+
+    def __init__(self, workdir):
+        self.dir = workdir
+        self.key = os.path.join(workdir, "ca.key")
+        self.crt = os.path.join(workdir, "ca.crt")
+        openssl("req", "-x509", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:P-256", "-nodes",
+                "-keyout", self.key, "-out", self.crt, "-days", "30", "-subj", "/CN=perso-line stub CA")
+
+    def sign(self, csr_pem):
+        fd, path = tempfile.mkstemp(dir=self.dir, suffix=".csr")
+        with os.fdopen(fd, "w") as f:
+            f.write(csr_pem)
+        try:
+            return openssl("x509", "-req", "-in", path, "-CA", self.crt, "-CAkey", self.key, "-days", "365",
+                           "-set_serial", str(random.getrandbits(63))).decode()
+        finally:
+            os.unlink(path)
+
+
+class SimDevice(http.server.ThreadingHTTPServer):
+    """one device slot of the line: a new unit after every DevIDfinal"""
+
+    daemon_threads = True
+
+    def __init__(self, port, args, workdir):
+        super().__init__(("127.0.0.1", port), SimHandler)
+        self.args = args
+        self.key = os.path.join(workdir, "dev%d.key" % port)
+        self.lock = threading.Lock()
+        self.units = 0
+        self.new_unit()
+
+    def new_unit(self):
+        with self.lock:
+            self.units += 1
+            self.stage = "none"
+            self.ready = False
+            self.csr_cache = None               # (RequestID, CSR)
+            self.keygen_start = time.monotonic()
+        threading.Thread(target=self._keygen, args=(self.units,), daemon=True).start()
+
+    def _keygen(self, unit):
+        openssl("genpkey", "-algorithm", "RSA", "-pkeyopt", "rsa_keygen_bits:2048", "-out", self.key)
+        rest = self.args.keygen_ms / 1000.0 - (time.monotonic() - self.keygen_start)
+        if rest > 0:
+            time.sleep(rest * random.uniform(0.5, 1.5))
+        with self.lock:
+            if unit == self.units:
+                self.ready, self.stage = True, "key-ready"
+
+    def gen_csr(self, fields):
+        with self.lock:
+            reqid = fields.get("RequestID")
+            if reqid and self.csr_cache and self.csr_cache[0] == reqid:
+                return self.csr_cache[1]
+        subject = "".join("/%s=%s" % (k, str(fields[n]).replace("/", "\\/"))
+                          for k, n in (("CN", "CN"), ("O", "O"), ("OU", "OU"), ("C", "C"), ("serialNumber", "SN"))
+                          if fields.get(n))
+        csr = openssl("req", "-new", "-key", self.key, "-subj", subject or "/CN=perso-line").decode()
+        with self.lock:
+            self.csr_cache = (reqid, csr)
+            self.stage = "csr-issued"
+        return csr
+
+
+class SimHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *args):
+        pass
+
+    def _send(self, status, body, ctype="application/json"):
+        body = body.encode() if isinstance(body, str) else body
+        self.send_response(status)
+        self.send_header("Content-Type", ctype)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def _body(self):
+        data = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        try:
+            return json.loads(data or b"{}")
+        except ValueError:
+            return None
+
+    def do_GET(self):
+        dev = self.server
+        if self.path != "/v1/DevID/status":
+            return self._send(404, "")
+        if dev.ready:
+            return self._send(200, json.dumps({"stage": dev.stage, "status": "Ready"}))
+        elapsed = int((time.monotonic() - dev.keygen_start) * 1000)
+        self._send(503, json.dumps({"stage": dev.stage, "status": "KeyGen", "candidates": elapsed // 20,
+                                    "elapsed_ms": elapsed}))
+
+    def do_POST(self):
+        dev = self.server
+        fields = self._body()
+        if fields is None:
+            return self._send(400, "malformed JSON", "text/plain")
+        if not dev.ready:
+            return self._send(503, json.dumps({"status": "KeyGen"}))
+        if self.path == "/v1/DevID/genCSR":
+            return self._send(200, dev.gen_csr(fields), "text/html")
+        if self.path == "/v1/DevID/DevIDfinal":
+            if "BEGIN CERTIFICATE" not in fields.get("DevID", ""):
+                return self._send(400, "DevID missing", "text/plain")
+            with dev.lock:
+                dev.stage, dev.ready = "cert-stored", False
+            self._send(200, json.dumps({"status": "Init"}))
+            # the unit leaves the fixture, the next one boots
+            threading.Timer(dev.args.swap_ms / 1000.0, dev.new_unit).start()
+            return
+        self._send(404, "")
+
+
+class Slot(threading.Thread):
+    """station worker of one device slot"""
+
+    def __init__(self, host, port, units, ca, args):
+        super().__init__(daemon=True)
+        self.host, self.port, self.units, self.ca, self.args = host, port, units, ca, args
+        self.phases = {p: [] for p in PHASES}
+        self.done = 0
+        self.failed = 0
+        self.heap_min = None
+        self.conn = None
+
+    def _request(self, method, path, body=None):
+        for attempt in range(3):
+            try:
+                if self.conn is None:
+                    self.conn = http.client.HTTPConnection(self.host, self.port, timeout=self.args.timeout)
+                headers = {"Content-Type": "application/json"} if body is not None else {}
+                self.conn.request(method, path, body=body, headers=headers)
+                rsp = self.conn.getresponse()
+                return rsp.status, rsp.read()
+            except (OSError, http.client.HTTPException):
+                # a retried genCSR carries the same RequestID and gets the same CSR
+                self.conn = None
+                time.sleep(0.2 * (attempt + 1))
+        return None, b""
+
+    def _wait_ready(self, deadline):
+        while time.monotonic() < deadline:
+            status, data = self._request("GET", "/v1/DevID/status")
+            if status in (200, 503):
+                try:
+                    heap = json.loads(data).get("heap_min")
+                    if heap is not None:
+                        self.heap_min = heap if self.heap_min is None else min(self.heap_min, heap)
+                except ValueError:
+                    pass
+            if status == 200:
+                return True
+            time.sleep(self.args.poll_ms / 1000.0)
+        return False
+
+    def _unit(self, n):
+        t = {}
+        start = time.perf_counter()
+        if not self._wait_ready(time.monotonic() + self.args.timeout):
+            return None
+        t["keygen"] = time.perf_counter()
+        sn = "%s-%d-%d" % (self.host, self.port, n)
+        body = json.dumps({"CN": "perso-line", "O": "Keyfactor", "SN": sn, "RequestID": str(uuid.uuid4())})
+        status, csr = self._request("POST", "/v1/DevID/genCSR", body)
+        if status != 200:
+            return None
+        t["genCSR"] = time.perf_counter()
+        try:
+            crt = self.ca.sign(csr.decode())
+        except subprocess.CalledProcessError:
+            return None
+        t["sign"] = time.perf_counter()
+        status, _ = self._request("POST", "/v1/DevID/DevIDfinal", json.dumps({"DevID": crt}))
+        if status != 200:
+            return None
+        t["final"] = time.perf_counter()
+        t["total"] = t["final"]
+        last = start
+        for p in PHASES[:-1]:
+            t[p], last = t[p] - last, t[p]
+        t["total"] -= start
+        return t
+
+    def run(self):
+        for n in range(self.units):
+            t = self._unit(n)
+            if t is None:
+                self.failed += 1
+                self.conn = None
+                continue
+            self.done += 1
+            for p in PHASES:
+                self.phases[p].append(t[p])
+            # the next unit is a new device: new connection
+            if self.conn is not None:
+                self.conn.close()
+                self.conn = None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="imprinting line simulation")
+    parser.add_argument("--host", action="append", default=[], help="device host[:port], repeat for several slots")
+    parser.add_argument("--simulate", type=int, default=0, help="simulated devices on loopback")
+    parser.add_argument("--base-port", type=int, default=18080, help="first port of the simulated devices")
+    parser.add_argument("--units", type=int, help="units per slot (default 1 real, 10 simulated)")
+    parser.add_argument("--keygen-ms", type=int, default=0, help="simulated device keygen time, 50-150%% jitter")
+    parser.add_argument("--swap-ms", type=int, default=500, help="unit swap time after DevIDfinal")
+    parser.add_argument("--poll-ms", type=int, default=250, help="status poll interval")
+    parser.add_argument("--timeout", type=float, default=120.0, help="per unit")
+    args = parser.parse_args()
+    if not args.host and not args.simulate:
+        parser.error("--host or --simulate required")
+    units = args.units or (10 if args.simulate else 1)
+
+    workdir = tempfile.mkdtemp(prefix="perso_line_")
+    try:
+        ca = StubCA(workdir)
+        targets = []
+        for h in args.host:
+            host, _, port = h.partition(":")
+            targets.append((host, int(port or 80)))
+        sims = []
+        for i in range(args.simulate):
+            dev = SimDevice(args.base_port + i, args, workdir)
+            threading.Thread(target=dev.serve_forever, daemon=True).start()
+            sims.append(dev)
+            targets.append(("127.0.0.1", args.base_port + i))
+
+        slots = [Slot(host, port, units, ca, args) for host, port in targets]
+        start = time.perf_counter()
+        for s in slots:
+            s.start()
+        for s in slots:
+            s.join()
+        wall = time.perf_counter() - start
+        for dev in sims:
+            dev.shutdown()
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    done = sum(s.done for s in slots)
+    print("%d slot(s), %d unit(s) each: %d personalised, %d failed, %.1f s" % (
+        len(slots), units, done, sum(s.failed for s in slots), wall))
+    print("devices/hour: %.0f" % (done / wall * 3600 if wall > 0 else 0))
+    print("phase      p50 ms   p90 ms   p99 ms   max ms")
+    for p in PHASES:
+        lat = [l for s in slots for l in s.phases[p]]
+        if lat:
+            print("%-8s %8.1f %8.1f %8.1f %8.1f" % (p, percentile(lat, 50) * 1000, percentile(lat, 90) * 1000,
+                                                   percentile(lat, 99) * 1000, max(lat) * 1000))
+    heaps = [s.heap_min for s in slots if s.heap_min is not None]
+    if heaps:
+        print("device heap low watermark: %d bytes (min over %d device(s))" % (min(heaps), len(heaps)))
+    if sims:
+        print("simulator peak RSS: %d kB" % resource.getrusage(resource.RUSAGE_SELF).ru_maxrss)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,234 @@
+#!/usr/bin/env python3
+#
+#  perso_load.py
+#  Host side load test of the personalisation REST endpoint.
+#  Several stations (threads) send status and optionally genCSR requests to one
+#  or more devices and report requests/second and latency percentiles. Each
+#  station keeps its connection alive; --close opens a new connection per
+#  request, for a comparison with the previous server profile.
+#  --https connects with TLS, pins the bootstrap certificate (--fingerprint)
+#  and offers the last session ticket on every new connection; the TCP+TLS
+#  connect time is reported separately for full and resumed handshakes.
+#  --cbor sends and accepts application/cbor instead of JSON (CSR as DER byte
+#  string); run once with and once without to compare payload sizes and latency.
+#  --json-bench (firmware with OT_PERSO_JSON_BENCH) sends JSON genCSR requests and
+#  reads the perso_json_* counters of /v1/metrics before and after the run: parse
+#  time and heap allocations per request of PersoJSON and of the former cJSON path.
+#
+#  usage: perso_load.py --host 192.168.3.240 --stations 4 --requests 50 [--csr] [--close]
+#                       [--https [--fingerprint <sha256 hex>]] [--cbor] [--json-bench]
+#
+#  Copyright (c) 2023 Keyfactor
+#  Licensed under the Apache License, Version 2.0
+
+import argparse
+import hashlib
+import http.client
+import json
+import re
+import socket
+import ssl
+import threading
+import time
+
+GENCSR_BODY = {"CN": "load-test", "O": "Keyfactor", "SN": "0000", "URI": "urn:load-test"}
+
+
+def cbor_head(major, n):
+    if n < 24:
+        return bytes([major << 5 | n])
+    for ai, size in ((24, 1), (25, 2), (26, 4), (27, 8)):
+        if n < 1 << (8 * size):
+            return bytes([major << 5 | ai]) + n.to_bytes(size, "big")
+
+
+def cbor_map(d):
+    """definite length map of text keys and text values, as PersoCBOR decodes it"""
+    out = cbor_head(5, len(d))
+    for k, v in d.items():
+        for t in (k, v):
+            t = t.encode()
+            out += cbor_head(3, len(t)) + t
+    return out
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    k = min(len(values) - 1, max(0, int(round(p / 100.0 * len(values) + 0.5)) - 1))
+    return values[k]
+
+
+def json_counters(host, port, args):
+    """perso_json_* counters by (metric, parser) from GET /v1/metrics"""
+    if args.https:
+        ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+        ctx.check_hostname = False
+        ctx.verify_mode = ssl.CERT_NONE
+        conn = http.client.HTTPSConnection(host, port, timeout=args.timeout, context=ctx)
+    else:
+        conn = http.client.HTTPConnection(host, port, timeout=args.timeout)
+    conn.request("GET", "/v1/metrics")
+    text = conn.getresponse().read().decode()
+    conn.close()
+    counters = {}
+    for m in re.finditer(r'^perso_json_(\w+)\{parser="(\w+)"\} (\S+)$', text, re.M):
+        counters[(m.group(1), m.group(2))] = float(m.group(3))
+    return counters
+
+
+def json_report(before, after, wall):
+    delta = {k: after[k] - before.get(k, 0.0) for k in after}
+    for parser in ("pjson", "cjson"):
+        n = delta.get(("parses_total", parser), 0.0)
+        if not n:
+            print("JSON %-5s no parses (cjson needs OT_PERSO_JSON_BENCH)" % parser)
+            continue
+        print("JSON %-5s %6d parses  %7.1f parses/s  %8.1f us/parse  %6.1f allocs  %8.1f B heap per parse" % (
+            parser, n, n / wall, delta[("parse_seconds_total", parser)] / n * 1e6,
+            delta[("heap_allocs_total", parser)] / n, delta[("heap_bytes_total", parser)] / n))
+
+
+class PinnedHTTPSConnection(http.client.HTTPSConnection):
+    """HTTPS connection that resumes the station's last TLS session and times the handshake"""
+
+    def __init__(self, station, *args, **kwargs):
+        super().__init__(*args, context=station.context, **kwargs)
+        self.station = station
+
+    def connect(self):
+        start = time.perf_counter()
+        sock = socket.create_connection((self.host, self.port), self.timeout)
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.sock = self._context.wrap_socket(sock, server_hostname=self.host, session=self.station.session)
+        elapsed = time.perf_counter() - start
+        self.station.handshakes["resumed" if self.sock.session_reused else "full"].append(elapsed)
+        fingerprint = hashlib.sha256(self.sock.getpeercert(binary_form=True)).hexdigest()
+        if self.station.args.fingerprint and fingerprint != self.station.args.fingerprint.lower():
+            self.sock.close()
+            raise ssl.SSLError("bootstrap certificate fingerprint mismatch: %s" % fingerprint)
+
+
+class Station(threading.Thread):
+    def __init__(self, host, port, args):
+        super().__init__(daemon=True)
+        self.host, self.port, self.args = host, port, args
+        self.latencies = {"status": [], "genCSR": []}
+        self.sizes = {"status": [], "genCSR": []}
+        self.errors = 0
+        self.busy = 0
+        self.conn = None
+        self.handshakes = {"full": [], "resumed": []}
+        self.session = None
+        self.context = None
+        if args.https:
+            # the bootstrap certificate is self-signed: pin it instead of a chain check
+            self.context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+            self.context.check_hostname = False
+            self.context.verify_mode = ssl.CERT_NONE
+
+    def _connection(self):
+        if self.conn is None or self.args.close:
+            if self.conn is not None:
+                self.conn.close()
+            if self.args.https:
+                self.conn = PinnedHTTPSConnection(self, self.host, self.port, timeout=self.args.timeout)
+            else:
+                self.conn = http.client.HTTPConnection(self.host, self.port, timeout=self.args.timeout)
+            self.conn.connect()
+            # the request line and the body go out as separate writes; do not let Nagle hold the body
+            self.conn.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        return self.conn
+
+    def _request(self, name, method, path, body=None):
+        ctype = "application/cbor" if self.args.cbor else "application/json"
+        headers = {"Content-Type": ctype} if body else {}
+        headers["Accept"] = ctype
+        if self.args.close:
+            headers["Connection"] = "close"
+        start = time.perf_counter()
+        try:
+            conn = self._connection()
+            conn.request(method, path, body=body, headers=headers)
+            rsp = conn.getresponse()
+            data = rsp.read()
+            if self.args.https and conn.sock is not None:
+                self.session = conn.sock.session
+        except (OSError, http.client.HTTPException):
+            self.errors += 1
+            self.conn = None
+            return
+        elapsed = time.perf_counter() - start
+        if rsp.status == 503:
+            self.busy += 1
+        elif rsp.status != 200:
+            self.errors += 1
+        else:
+            self.latencies[name].append(elapsed)
+            self.sizes[name].append((len(body or b""), len(data)))
+
+    def run(self):
+        body = cbor_map(GENCSR_BODY) if self.args.cbor else json.dumps(GENCSR_BODY).encode()
+        for _ in range(self.args.requests):
+            self._request("status", "GET", "/v1/DevID/status")
+            if self.args.csr:
+                self._request("genCSR", "POST", "/v1/DevID/genCSR", body)
+        if self.conn is not None:
+            self.conn.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="personalisation endpoint load test")
+    parser.add_argument("--host", action="append", required=True, help="device address, repeat for several devices")
+    parser.add_argument("--port", type=int, help="default 80, 443 with --https")
+    parser.add_argument("--stations", type=int, default=4, help="concurrent stations per device")
+    parser.add_argument("--requests", type=int, default=50, help="rounds per station")
+    parser.add_argument("--csr", action="store_true", help="add a genCSR request to every round")
+    parser.add_argument("--close", action="store_true", help="new TCP connection per request")
+    parser.add_argument("--https", action="store_true", help="TLS with session resumption")
+    parser.add_argument("--fingerprint", help="SHA-256 of the bootstrap certificate (log / mDNS TXT tls)")
+    parser.add_argument("--cbor", action="store_true", help="application/cbor request and response bodies")
+    parser.add_argument("--json-bench", action="store_true", help="JSON genCSR, report the perso_json_* counters")
+    parser.add_argument("--timeout", type=float, default=15.0)
+    args = parser.parse_args()
+    if args.port is None:
+        args.port = 443 if args.https else 80
+    if args.json_bench:
+        args.csr, args.cbor = True, False
+        before = {h: json_counters(h, args.port, args) for h in args.host}
+
+    stations = [Station(h, args.port, args) for h in args.host for _ in range(args.stations)]
+    start = time.perf_counter()
+    for s in stations:
+        s.start()
+    for s in stations:
+        s.join()
+    wall = time.perf_counter() - start
+
+    print("%d station(s), %s, %s, %.2f s" % (len(stations), "close" if args.close else "keep-alive",
+                                           "CBOR" if args.cbor else "JSON", wall))
+    for name in ("status", "genCSR"):
+        lat = [l for s in stations for l in s.latencies[name]]
+        if not lat:
+            continue
+        print("%-7s %6d ok  %7.1f req/s  p50 %7.1f ms  p99 %7.1f ms  max %7.1f ms" % (
+            name, len(lat), len(lat) / wall, percentile(lat, 50) * 1000,
+            percentile(lat, 99) * 1000, max(lat) * 1000))
+        sizes = [sz for s in stations for sz in s.sizes[name]]
+        print("        request %6.0f B  response %6.0f B (mean)" % (
+            sum(q for q, _ in sizes) / len(sizes), sum(r for _, r in sizes) / len(sizes)))
+    for name in ("full", "resumed"):
+        lat = [l for s in stations for l in s.handshakes[name]]
+        if lat:
+            print("TLS %-7s %4d     connect p50 %7.1f ms  p99 %7.1f ms" % (
+                name, len(lat), percentile(lat, 50) * 1000, percentile(lat, 99) * 1000))
+    print("503 busy: %d  errors: %d" % (sum(s.busy for s in stations), sum(s.errors for s in stations)))
+    if args.json_bench:
+        for h in args.host:
+            print("%s:" % h)
+            json_report(before[h], json_counters(h, args.port, args), wall)
+
+
+if __name__ == "__main__":
+    main()